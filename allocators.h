@@ -0,0 +1,4123 @@
+#ifndef ALLOCATORS_H
+#define ALLOCATORS_H
+
+// Header-only: include this and go. Everything in here is either a template,
+// a class with inline member functions, or explicitly inline, so it can be
+// included from as many translation units as you like.
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Fast paths get forced inline so a bump allocation is a handful of
+// instructions at the call site. Whatever isn't the common case (failure,
+// refilling, tags and stats) lives out of line in a cold function so it
+// doesn't bloat every caller or crowd the hot code out of the i-cache.
+#if defined(__GNUC__)
+#define ALLOC_ALWAYS_INLINE inline __attribute__((always_inline))
+#define ALLOC_COLD __attribute__((noinline, cold))
+#define ALLOC_LIKELY(x) __builtin_expect(!!(x), 1)
+#define ALLOC_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define ALLOC_PREFETCH_WRITE(addr) __builtin_prefetch((addr), 1)
+#else
+#define ALLOC_ALWAYS_INLINE inline
+#define ALLOC_COLD
+#define ALLOC_LIKELY(x) (x)
+#define ALLOC_UNLIKELY(x) (x)
+#define ALLOC_PREFETCH_WRITE(addr) ((void)(addr))
+#endif
+
+inline bool is_power_of_two(uint64_t x) { return ~(x & (x - 1)); }
+
+// Get the next address >= the `base` address aligned to `align` boundary.
+inline uintptr_t forward_align(uintptr_t base, size_t align) {
+    assert(is_power_of_two(align));
+    size_t padding = align - base & (align - 1);
+    return base + padding;
+}
+
+//============================== MEMORY TAGS ==============================//
+
+// Accounting for who's using how much memory. Tags form a tree (subsystem ->
+// component -> ...) and every byte charged to a tag is also charged to each of
+// its ancestors, so a subsystem's usage is the sum of its components'.
+// Allocators with a tag charge it for memory as they hand it out and give it
+// back as it's freed.
+//
+// Each tag can have a soft limit, which only gets reported, and a hard limit,
+// which makes the allocation fail. Limits of 0 mean no limit.
+// Everything's atomic so several allocators on different threads can share
+// a tag.
+//
+//     MemoryTag net = { .m_name = "net", .m_hard_limit = 64 << 20 };
+//     MemoryTag net_rx = { .m_name = "rx", .m_parent = &net, .m_soft_limit = 16 << 20 };
+//     arena.set_tag(&net_rx);
+
+enum BudgetEvent {
+    // Usage went over the soft limit (fires once per crossing).
+    BUDGET_SOFT_EXCEEDED,
+    // A charge was refused because it would've gone over the hard limit.
+    BUDGET_HARD_EXCEEDED,
+};
+
+struct MemoryTag;
+typedef void (*BudgetCallback)(MemoryTag *tag, BudgetEvent event, size_t bytes, void *ctx);
+
+struct MemoryTag {
+    const char *m_name;
+    MemoryTag *m_parent;
+    size_t m_soft_limit;
+    size_t m_hard_limit;
+    BudgetCallback m_on_exceeded;
+    void *m_ctx;
+    size_t m_used;
+    size_t m_peak;
+    // How many charges the hard limit turned down.
+    size_t m_refused;
+
+    // Charge this tag and its ancestors. Fails, charging nothing, if that
+    // would take any of them over its hard limit.
+    bool charge(size_t bytes) {
+        if (bytes == 0) return true;
+        for (MemoryTag *tag = this; tag != nullptr; tag = tag->m_parent) {
+            size_t used = __atomic_add_fetch(&tag->m_used, bytes, __ATOMIC_RELAXED);
+            if (tag->m_hard_limit != 0 && used > tag->m_hard_limit) {
+                for (MemoryTag *undo = this; ; undo = undo->m_parent) {
+                    __atomic_sub_fetch(&undo->m_used, bytes, __ATOMIC_RELAXED);
+                    if (undo == tag) break;
+                }
+                __atomic_add_fetch(&tag->m_refused, 1, __ATOMIC_RELAXED);
+                if (tag->m_on_exceeded != nullptr) tag->m_on_exceeded(tag, BUDGET_HARD_EXCEEDED, bytes, tag->m_ctx);
+                return false;
+            }
+        }
+
+        // It went through, now update peaks and report soft limits.
+        for (MemoryTag *tag = this; tag != nullptr; tag = tag->m_parent) {
+            size_t used = __atomic_load_n(&tag->m_used, __ATOMIC_RELAXED);
+            size_t peak = __atomic_load_n(&tag->m_peak, __ATOMIC_RELAXED);
+            while (used > peak && !__atomic_compare_exchange_n(&tag->m_peak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+            if (tag->m_soft_limit != 0 && used > tag->m_soft_limit && used - bytes <= tag->m_soft_limit && tag->m_on_exceeded != nullptr) {
+                tag->m_on_exceeded(tag, BUDGET_SOFT_EXCEEDED, bytes, tag->m_ctx);
+            }
+        }
+        return true;
+    }
+
+    void uncharge(size_t bytes) {
+        if (bytes == 0) return;
+        for (MemoryTag *tag = this; tag != nullptr; tag = tag->m_parent) {
+            size_t used = __atomic_sub_fetch(&tag->m_used, bytes, __ATOMIC_RELAXED);
+            assert(used + bytes >= bytes && "uncharged more than was charged");
+        }
+    }
+
+    // Move `bytes` already in use from one tag to another, skipping the hard
+    // limit check since the memory is already out there.
+    static void transfer(MemoryTag *from, MemoryTag *to, size_t bytes) {
+        if (from != nullptr) from->uncharge(bytes);
+        if (to == nullptr || bytes == 0) return;
+        for (MemoryTag *tag = to; tag != nullptr; tag = tag->m_parent) {
+            size_t used = __atomic_add_fetch(&tag->m_used, bytes, __ATOMIC_RELAXED);
+            size_t peak = __atomic_load_n(&tag->m_peak, __ATOMIC_RELAXED);
+            while (used > peak && !__atomic_compare_exchange_n(&tag->m_peak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        }
+    }
+
+    size_t depth() {
+        size_t depth = 0;
+        for (MemoryTag *tag = m_parent; tag != nullptr; tag = tag->m_parent) { depth++; }
+        return depth;
+    }
+};
+
+// Print a usage table for a set of tags, indented by depth. Pass them parents
+// first for it to read like a tree.
+inline void memory_tags_report(FILE *out, MemoryTag **tags, size_t count) {
+    fprintf(out, "%-24s %12s %12s %12s %12s %8s\n", "tag", "used", "peak", "soft", "hard", "refused");
+    for (size_t i = 0; i < count; i++) {
+        MemoryTag *tag = tags[i];
+        int indent = (int)tag->depth() * 2;
+        fprintf(out, "%*s%-*s %12zu %12zu %12zu %12zu %8zu\n", indent, "", 24 - indent, tag->m_name,
+            tag->m_used, tag->m_peak, tag->m_soft_limit, tag->m_hard_limit, tag->m_refused);
+    }
+}
+
+//============================== STATS SEGMENT ==============================//
+
+// Allocator stats published into a memory-mapped file so another process can
+// watch them live (`./build/main stats <file>`). Each allocator with a stats
+// entry writes its numbers straight into the mapping as it goes. Every
+// allocator has a single writer, so the counters are relaxed loads and
+// stores rather than read-modify-writes and cost about as much as plain ones.
+// Readers might see one counter updated before another but never a torn value.
+// +--------+---------+---------+-----+---------+
+// | Header | Entry 0 | Entry 1 | ... | Entry N |
+// +--------+---------+---------+-----+---------+
+
+constexpr uint64_t STATS_MAGIC = 0x5354415453414c43ull; // "CLASTATS"
+constexpr uint32_t STATS_VERSION = 1;
+constexpr size_t STATS_NAME_SIZE = 40;
+
+enum StatsKind : uint32_t {
+    STATS_ARENA,
+    STATS_STACK,
+    STATS_POOL,
+};
+
+struct StatsHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t max_entries;
+    uint32_t num_entries;
+    uint32_t pid;
+};
+
+struct alignas(64) StatsEntry {
+    char name[STATS_NAME_SIZE];
+    uint32_t kind;
+    uint32_t live;
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t peak;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures;
+
+    // Single writer only (see alloc_block_atomic for the exception).
+    void record_alloc(uint64_t new_used) {
+        __atomic_store_n(&allocs, __atomic_load_n(&allocs, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+        this->record_used(new_used);
+    }
+
+    void record_free(uint64_t new_used) {
+        __atomic_store_n(&frees, __atomic_load_n(&frees, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&used, new_used, __ATOMIC_RELAXED);
+    }
+
+    void record_failure() {
+        __atomic_store_n(&failures, __atomic_load_n(&failures, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    }
+
+    void record_used(uint64_t new_used) {
+        __atomic_store_n(&used, new_used, __ATOMIC_RELAXED);
+        if (new_used > __atomic_load_n(&peak, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&peak, new_used, __ATOMIC_RELAXED);
+        }
+    }
+};
+
+struct StatsSegment {
+    StatsHeader *m_header;
+    StatsEntry *m_entries;
+    size_t m_size;
+
+    // Create (or truncate) the stats file with room for `max_entries`.
+    bool create(const char *path, uint32_t max_entries) {
+        m_size = sizeof(StatsEntry) * (max_entries + 1);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, m_size) != 0) {
+            ::close(fd);
+            return false;
+        }
+        void *memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) return false;
+
+        // The header gets a whole entry's worth of space so entries stay aligned.
+        m_header = (StatsHeader*)memory;
+        m_entries = (StatsEntry*)memory + 1;
+        m_header->version = STATS_VERSION;
+        m_header->max_entries = max_entries;
+        m_header->num_entries = 0;
+        m_header->pid = (uint32_t)getpid();
+        // Magic last, readers check it before anything else.
+        __atomic_store_n(&m_header->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Map somebody else's stats file to read it.
+    bool open_readonly(const char *path) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < 2 * sizeof(StatsEntry)) {
+            ::close(fd);
+            return false;
+        }
+        m_size = st.st_size;
+        void *memory = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) return false;
+
+        m_header = (StatsHeader*)memory;
+        m_entries = (StatsEntry*)memory + 1;
+        if (__atomic_load_n(&m_header->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+            || m_header->version != STATS_VERSION
+            || sizeof(StatsEntry) * (m_header->max_entries + 1) > m_size) {
+            this->close();
+            return false;
+        }
+        return true;
+    }
+
+    // Claim an entry for an allocator. Point the allocator's m_stats at it.
+    // Thread-safe. Returns null once every entry is taken.
+    StatsEntry* add(const char *name, StatsKind kind, uint64_t capacity) {
+        uint32_t index = __atomic_load_n(&m_header->num_entries, __ATOMIC_RELAXED);
+        do {
+            if (index >= m_header->max_entries) return nullptr;
+        } while (!__atomic_compare_exchange_n(&m_header->num_entries, &index, index + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        // Readers only look at entries marked live, so fill it in first.
+        StatsEntry *entry = &m_entries[index];
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        entry->kind = kind;
+        entry->capacity = capacity;
+        __atomic_store_n(&entry->live, 1, __ATOMIC_RELEASE);
+        return entry;
+    }
+
+    // The allocator is going away. Its entry stays taken but stops showing up.
+    void remove(StatsEntry *entry) {
+        __atomic_store_n(&entry->live, 0, __ATOMIC_RELEASE);
+    }
+
+    void close() {
+        if (m_header != nullptr) munmap(m_header, m_size);
+        m_header = nullptr;
+        m_entries = nullptr;
+    }
+};
+
+inline void stats_print(FILE *out, StatsSegment &segment) {
+    static const char *kinds[] = { "arena", "stack", "pool" };
+    fprintf(out, "pid %u, %u entries\n", segment.m_header->pid, __atomic_load_n(&segment.m_header->num_entries, __ATOMIC_RELAXED));
+    fprintf(out, "%-24s %-6s %12s %12s %12s %6s %10s %10s %8s\n",
+        "name", "kind", "capacity", "used", "peak", "use%", "allocs", "frees", "failed");
+    uint32_t num_entries = __atomic_load_n(&segment.m_header->num_entries, __ATOMIC_RELAXED);
+    if (num_entries > segment.m_header->max_entries) num_entries = segment.m_header->max_entries;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        StatsEntry *entry = &segment.m_entries[i];
+        if (!__atomic_load_n(&entry->live, __ATOMIC_ACQUIRE)) continue;
+        uint64_t capacity = __atomic_load_n(&entry->capacity, __ATOMIC_RELAXED);
+        uint64_t used = __atomic_load_n(&entry->used, __ATOMIC_RELAXED);
+        uint32_t kind = __atomic_load_n(&entry->kind, __ATOMIC_RELAXED);
+        char name[STATS_NAME_SIZE];
+        std::memcpy(name, entry->name, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        fprintf(out, "%-24s %-6s %12llu %12llu %12llu %5.1f%% %10llu %10llu %8llu\n",
+            name, kind <= STATS_POOL ? kinds[kind] : "?",
+            (unsigned long long)capacity, (unsigned long long)used,
+            (unsigned long long)__atomic_load_n(&entry->peak, __ATOMIC_RELAXED),
+            capacity != 0 ? 100.0 * used / capacity : 0.0,
+            (unsigned long long)__atomic_load_n(&entry->allocs, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&entry->frees, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&entry->failures, __ATOMIC_RELAXED));
+    }
+}
+
+//============================== ARENA ==============================//
+
+// The arena keeps pointers rather than a base and offsets, so the fast path
+// is: align the current pointer, compare against the end, bump.
+// +-------------------------+------------------------+
+// | Allocations             | Free                   |
+// +-------------------------+------------------------+
+// ↑ m_memory                ↑ m_current              ↑ m_end
+
+struct Arena {
+    unsigned char* m_memory;
+    unsigned char* m_current;
+    unsigned char* m_end;
+    // Start of the most recent allocation, so it can be resized in place.
+    unsigned char* m_prev;
+    // Optional. Charged for everything below the offset (padding included)
+    // plus any blocks child arenas have borrowed.
+    MemoryTag *m_tag;
+    // Optional. Where to publish our numbers.
+    StatsEntry *m_stats;
+    // Optional. For streaming through memory that isn't in cache yet: every
+    // allocation prefetches (for write) this many bytes past the new current
+    // pointer, so the lines are on their way before we bump into them. A few
+    // cache lines (256-1024) is usually about right.
+    size_t m_prefetch_ahead;
+
+    Arena()
+        :   m_memory(nullptr),
+            m_current(nullptr),
+            m_end(nullptr),
+            m_prev(nullptr),
+            m_tag(nullptr),
+            m_stats(nullptr),
+            m_prefetch_ahead(0)
+    {}
+
+    Arena(void *memory, size_t capacity)
+        :   m_memory((unsigned char*)memory),
+            m_current((unsigned char*)memory),
+            m_end((unsigned char*)memory + capacity),
+            m_prev(nullptr),
+            m_tag(nullptr),
+            m_stats(nullptr),
+            m_prefetch_ahead(0)
+    {}
+
+    size_t offset() const { return m_current - m_memory; }
+    size_t capacity() const { return m_end - m_memory; }
+
+    // Tags and stats need bookkeeping on every allocation, so arenas with
+    // either one always take the slow path.
+    bool instrumented() const { return ((uintptr_t)m_tag | (uintptr_t)m_stats) != 0; }
+
+    // Try to allocate some amount of memory with the given alignment.
+    ALLOC_ALWAYS_INLINE void* alloc_aligned(size_t bytes, size_t align) {
+        uintptr_t aligned_addr = ((uintptr_t)m_current + (align - 1)) & ~(uintptr_t)(align - 1);
+        uintptr_t next = aligned_addr + bytes;
+        // `aligned_addr < next` rules out zero sizes and overflow in one go.
+        if (ALLOC_LIKELY(aligned_addr < next && next <= (uintptr_t)m_end && !this->instrumented())) {
+            m_prev = (unsigned char*)aligned_addr;
+            m_current = (unsigned char*)next;
+            // Prefetching past the end is fine, it never faults.
+            if (m_prefetch_ahead != 0) ALLOC_PREFETCH_WRITE(m_current + m_prefetch_ahead);
+            return std::memset((void*)aligned_addr, 0, bytes);
+        }
+        return this->alloc_slow(bytes, align);
+    }
+
+    ALLOC_COLD void* alloc_slow(size_t bytes, size_t align) {
+        if (bytes == 0) return nullptr;
+
+        uintptr_t aligned_addr = forward_align((uintptr_t)m_current, align);
+        if (aligned_addr > (uintptr_t)m_end || bytes > (uintptr_t)m_end - aligned_addr
+            || (m_tag != nullptr && !m_tag->charge(aligned_addr + bytes - (uintptr_t)m_current))) {
+            if (m_stats != nullptr) m_stats->record_failure();
+            return nullptr;
+        }
+
+        m_prev = (unsigned char*)aligned_addr;
+        m_current = (unsigned char*)aligned_addr + bytes;
+        if (m_prefetch_ahead != 0) ALLOC_PREFETCH_WRITE(m_current + m_prefetch_ahead);
+        if (m_stats != nullptr) m_stats->record_alloc(this->offset());
+        return std::memset((void*)aligned_addr, 0, bytes);
+    }
+
+    // Given an older allocation from the arena, attempt to resize it.
+    // NOTE: This does NOT support changing the _alignment_ of an allocation.
+    void* resize_aligned(void* old_allocation, size_t old_size, size_t new_size, size_t align) {
+        assert(is_power_of_two(align));
+        unsigned char* old_alloc = (unsigned char*)old_allocation;
+        if (old_alloc == nullptr || old_size == 0) return nullptr;
+        if (old_alloc < m_memory || old_alloc > m_end) return nullptr;
+
+        // Was this the last thing we allocated from the arena?
+        if (old_alloc == m_prev) {
+            if (new_size > (size_t)(m_end - old_alloc)) return nullptr;
+            unsigned char* next = old_alloc + new_size;
+            if (m_tag != nullptr) {
+                if (next > m_current && !m_tag->charge(next - m_current)) {
+                    if (m_stats != nullptr) m_stats->record_failure();
+                    return nullptr;
+                }
+                if (next < m_current) m_tag->uncharge(m_current - next);
+            }
+            m_current = next;
+            if (m_stats != nullptr) m_stats->record_used(this->offset());
+            if (new_size > old_size) {
+                // Zero new memory
+                std::memset(old_alloc + old_size, 0, new_size - old_size);
+            }
+            return old_alloc;
+        } else {
+            // If not, allocate new mem from the arena and copy the old data to it.
+            void* new_alloc = this->alloc_aligned(new_size, align);
+            if (new_alloc == nullptr) return nullptr;
+            size_t copy_size = old_size < new_size ? old_size : new_size;
+            std::memmove(new_alloc, old_alloc, copy_size);
+            return new_alloc;
+        }
+    }
+
+    // Thread-safe bump for handing out large blocks to several threads at once
+    // (see Tlab below). Only the current pointer is updated, with a single CAS
+    // in the uncontended case, so this must not race with the non-atomic
+    // functions.
+    // NOTE: Unlike alloc_aligned, the memory is NOT zeroed. Whoever carves
+    // out the block is responsible for zeroing what they hand out.
+    void* alloc_block_atomic(size_t bytes, size_t align) {
+        if (bytes == 0) return nullptr;
+
+        unsigned char *current = __atomic_load_n(&m_current, __ATOMIC_RELAXED);
+        unsigned char *next;
+        uintptr_t aligned_addr;
+        do {
+            aligned_addr = forward_align((uintptr_t)current, align);
+            if (aligned_addr > (uintptr_t)m_end || bytes > (uintptr_t)m_end - aligned_addr) {
+                if (m_stats != nullptr) __atomic_fetch_add(&m_stats->failures, 1, __ATOMIC_RELAXED);
+                return nullptr;
+            }
+            next = (unsigned char*)aligned_addr + bytes;
+        } while (!__atomic_compare_exchange_n(
+            &m_current, &current, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+        ));
+
+        // Charged after the fact, so if the tag says no we can only give the
+        // block back if nobody has bumped past it in the meantime. If someone
+        // has, the block is stuck inside offset() until reset, so it gets
+        // charged anyway (over the limit) to keep reset's uncharge honest.
+        if (m_tag != nullptr && !m_tag->charge(next - current)) {
+            unsigned char *expected = next;
+            if (!__atomic_compare_exchange_n(&m_current, &expected, current, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                MemoryTag::transfer(nullptr, m_tag, next - current);
+            }
+            if (m_stats != nullptr) __atomic_fetch_add(&m_stats->failures, 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+
+        // Several writers here, so these need real read-modify-writes.
+        if (m_stats != nullptr) {
+            __atomic_fetch_add(&m_stats->allocs, 1, __ATOMIC_RELAXED);
+            uint64_t used = next - m_memory;
+            uint64_t peak = __atomic_load_n(&m_stats->peak, __ATOMIC_RELAXED);
+            while (used > peak && !__atomic_compare_exchange_n(&m_stats->peak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+            __atomic_store_n(&m_stats->used, __atomic_load_n(&m_current, __ATOMIC_RELAXED) - m_memory, __ATOMIC_RELAXED);
+        }
+        return (void*)aligned_addr;
+    }
+
+    void reset() {
+        if (m_tag != nullptr) m_tag->uncharge(this->offset());
+        m_current = m_memory;
+        m_prev = nullptr;
+        if (m_stats != nullptr) m_stats->record_free(0);
+    }
+
+    // Charge our current usage to `tag` (or nobody) from now on.
+    // NOTE: Blocks lent out to child arenas stay charged to the old tag, so
+    // do this while no child has any.
+    void set_tag(MemoryTag *tag) {
+        MemoryTag::transfer(m_tag, tag, this->offset());
+        m_tag = tag;
+    }
+};
+
+//============================== TLAB ==============================//
+
+// Thread-local allocation buffer.
+// Each thread grabs a big block from a shared arena with one atomic bump and
+// then bump-allocates out of that block privately, grabbing another block
+// when it runs dry. Everything still lives in the shared arena, so resetting
+// the shared arena frees every allocation made through every TLAB. Just make
+// sure to reset the TLABs as well so they don't hand out stale blocks.
+// +-----------------+-----------------+-----------------+------+
+// | Thread A block  | Thread B block  | Thread A block  | Free |
+// +-----------------+-----------------+-----------------+------+
+
+// Blocks start on their own cache line so two threads never share one.
+constexpr size_t TLAB_BLOCK_ALIGN = 64;
+
+struct Tlab {
+    Arena *m_shared;
+    size_t m_block_size;
+    unsigned char *m_block;
+    size_t m_offset;
+    size_t m_capacity;
+
+    // Try to allocate some amount of memory with the given alignment.
+    ALLOC_ALWAYS_INLINE void* alloc_aligned(size_t bytes, size_t align) {
+        if (ALLOC_UNLIKELY(bytes == 0)) return nullptr;
+
+        if (ALLOC_LIKELY(m_block != nullptr)) {
+            uintptr_t aligned_addr = forward_align((uintptr_t)m_block + m_offset, align);
+            size_t next_offset = aligned_addr - (uintptr_t)m_block + bytes;
+            if (ALLOC_LIKELY(next_offset <= m_capacity)) {
+                m_offset = next_offset;
+                return std::memset((void*)aligned_addr, 0, bytes);
+            }
+        }
+
+        return this->alloc_slow(bytes, align);
+    }
+
+    // Current block is exhausted (or we never had one).
+    ALLOC_COLD void* alloc_slow(size_t bytes, size_t align) {
+        // Big allocations go straight to the shared arena. Replacing our
+        // block for them would throw away whatever is left in it.
+        if (bytes + align > m_block_size / 2) {
+            void* alloc = m_shared->alloc_block_atomic(bytes, align);
+            if (alloc == nullptr) return nullptr;
+            return std::memset(alloc, 0, bytes);
+        }
+
+        unsigned char* block = (unsigned char*)m_shared->alloc_block_atomic(m_block_size, TLAB_BLOCK_ALIGN);
+        if (block == nullptr) return nullptr;
+        m_block = block;
+        m_offset = 0;
+        m_capacity = m_block_size;
+
+        // We asked for at least twice what we need so this can't fail.
+        return this->alloc_aligned(bytes, align);
+    }
+
+    void reset() {
+        m_block = nullptr;
+        m_offset = 0;
+        m_capacity = 0;
+    }
+};
+
+//============================== ARENA SPLIT ==============================//
+
+// For data-parallel loops: carve whatever is left in an arena into `count`
+// sub-arenas, one per worker, so every worker can bump-allocate without
+// touching anyone else's memory. Once the workers are done, merge the
+// sub-arenas back so the results end up in the parent arena.
+// +--------------------+-------------+-------------+-------------+
+// | Parent allocations | Sub-arena 0 | Sub-arena 1 | Sub-arena 2 |
+// +--------------------+-------------+-------------+-------------+
+//
+// While split, the parent is marked as full so nothing allocates from it by
+// accident. `weights` may be null for equal splits. Each sub-arena starts on
+// an `align` boundary (use a cache line to keep workers off each other's
+// lines). Returns false if there isn't room for every sub-arena.
+// A tagged parent is charged for the whole region up front and gets back
+// what the workers didn't use on merge. The sub-arenas don't get a tag.
+inline bool arena_split(Arena &parent, Arena *subs, size_t count, const size_t *weights, size_t align) {
+    assert(is_power_of_two(align));
+    if (count == 0) return false;
+
+    size_t total_weight = 0;
+    for (size_t i = 0; i < count; i++) {
+        total_weight += weights != nullptr ? weights[i] : 1;
+    }
+    if (total_weight == 0) return false;
+
+    uintptr_t start = (uintptr_t)parent.m_current;
+    uintptr_t end = (uintptr_t)parent.m_end;
+    // Worst case we burn (align - 1) bytes of padding in front of every sub-arena.
+    if (end - start < count * align) return false;
+    size_t usable = end - start - count * (align - 1);
+
+    uintptr_t next = start;
+    for (size_t i = 0; i < count; i++) {
+        size_t weight = weights != nullptr ? weights[i] : 1;
+        uintptr_t sub_start = forward_align(next, align);
+        size_t sub_size = (size_t)((unsigned __int128)usable * weight / total_weight);
+        subs[i] = Arena((void*)sub_start, sub_size);
+        next = sub_start + sub_size;
+    }
+
+    if (parent.m_tag != nullptr && !parent.m_tag->charge(parent.m_end - parent.m_current)) return false;
+    parent.m_prev = nullptr;
+    parent.m_current = parent.m_end;
+    return true;
+}
+
+// Merge sub-arenas back by moving the parent's offset just past the highest
+// byte any sub-arena used. Whatever a sub-arena didn't use stays wasted in
+// between, but every pointer the workers handed out stays valid.
+inline void arena_merge(Arena &parent, Arena *subs, size_t count) {
+    if (count == 0) return;
+
+    unsigned char *current = subs[0].m_memory;
+    for (size_t i = 0; i < count; i++) {
+        if (subs[i].m_current > subs[i].m_memory && subs[i].m_current > current) { current = subs[i].m_current; }
+    }
+
+    if (parent.m_tag != nullptr) parent.m_tag->uncharge(parent.m_current - current);
+    parent.m_current = current;
+    parent.m_prev = nullptr;
+}
+
+// Merge sub-arenas back, sliding each one's used bytes down so they sit back
+// to back in the parent with no gaps. Every sub-arena keeps `align`, so this
+// must be at least the biggest alignment anybody allocated with.
+// NOTE: This moves memory! Pointers into a sub-arena must be rebased
+// using `out_bases[i]`, the new address of sub-arena i's first byte.
+inline void arena_merge_compact(Arena &parent, Arena *subs, size_t count, size_t align, unsigned char **out_bases) {
+    assert(is_power_of_two(align));
+    if (count == 0) return;
+
+    uintptr_t next = (uintptr_t)subs[0].m_memory;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* base = (unsigned char*)forward_align(next, align);
+        // Sub-arenas are in address order and only ever move down, so memmove
+        // never clobbers anything that hasn't been moved yet.
+        std::memmove(base, subs[i].m_memory, subs[i].offset());
+        if (out_bases != nullptr) { out_bases[i] = base; }
+        next = (uintptr_t)base + subs[i].offset();
+    }
+
+    if (parent.m_tag != nullptr) parent.m_tag->uncharge((uintptr_t)parent.m_current - next);
+    parent.m_current = (unsigned char*)next;
+    parent.m_prev = nullptr;
+}
+
+//============================== CHILD ARENA ==============================//
+
+// A child arena borrows memory from a parent arena one block at a time and
+// hands all of it back on reset. Blocks are taken off the _top_ of the
+// parent's free space by shrinking the parent's capacity. That leaves the
+// bottom of the parent free for regular allocations, which is exactly where
+// results get promoted to before we throw the child away.
+// +---------------------+-----------+---------+---------+
+// | Parent allocations  |   Free    | Block 2 | Block 1 |
+// +---------------------+-----------+---------+---------+
+//                       ↑           ↑                   ↑
+//                Parent offset  Parent capacity   Original capacity
+//
+// Since reset just restores the parent's capacity to what it was before the
+// child took its first block, children of the same parent must be reset in
+// the reverse order they started allocating (like a stack). Children can
+// have children of their own by using a block of theirs as the parent.
+
+// Lives at the start of each block.
+struct ChildArenaBlock {
+    ChildArenaBlock *prev;
+    ChildArenaBlock *next; // Null for the newest block
+    size_t capacity; // Bytes available after the header
+    size_t offset;   // Bytes used after the header
+};
+
+struct ChildArena {
+    Arena *m_parent;
+    size_t m_block_size;
+    ChildArenaBlock *m_block;
+    // Oldest block, for going through them in allocation order.
+    ChildArenaBlock *m_first_block;
+    // Parent's capacity before we took our first block.
+    size_t m_parent_capacity;
+
+    // Try to allocate some amount of memory with the given alignment.
+    void* alloc_aligned(size_t bytes, size_t align) {
+        if (bytes == 0) return nullptr;
+
+        if (m_block != nullptr) {
+            void* alloc = this->bump(m_block, bytes, align);
+            if (alloc != nullptr) return alloc;
+        }
+
+        // Doesn't fit, take another block from the parent.
+        size_t block_size = m_block_size;
+        if (block_size < sizeof(ChildArenaBlock) + bytes + align) {
+            block_size = sizeof(ChildArenaBlock) + bytes + align;
+        }
+        ChildArenaBlock *block = this->take_block(block_size);
+        if (block == nullptr) return nullptr;
+        return this->bump(block, bytes, align);
+    }
+
+    void* bump(ChildArenaBlock *block, size_t bytes, size_t align) {
+        uintptr_t data = (uintptr_t)(block + 1);
+        uintptr_t aligned_addr = forward_align(data + block->offset, align);
+        size_t next_offset = aligned_addr - data + bytes;
+        if (next_offset > block->capacity) { return nullptr; }
+        block->offset = next_offset;
+        return std::memset((void*)aligned_addr, 0, bytes);
+    }
+
+    ChildArenaBlock* take_block(size_t block_size) {
+        Arena *parent = m_parent;
+        if (block_size > parent->capacity()) return nullptr;
+
+        uintptr_t top = (uintptr_t)parent->m_end;
+        uintptr_t start = (top - block_size) & ~(uintptr_t)(alignof(ChildArenaBlock) - 1);
+        if (start < (uintptr_t)parent->m_current) return nullptr;
+        // Borrowed blocks count against the parent's tag.
+        if (parent->m_tag != nullptr && !parent->m_tag->charge(top - start)) return nullptr;
+
+        if (m_block == nullptr) { m_parent_capacity = parent->capacity(); }
+        parent->m_end = (unsigned char*)start;
+
+        ChildArenaBlock *block = (ChildArenaBlock*)start;
+        block->prev = m_block;
+        block->next = nullptr;
+        if (m_block != nullptr) m_block->next = block;
+        else m_first_block = block;
+        block->capacity = top - start - sizeof(ChildArenaBlock);
+        block->offset = 0;
+        m_block = block;
+        return block;
+    }
+
+    // Does this pointer point into one of our blocks?
+    bool owns(const void* ptr) {
+        uintptr_t addr = (uintptr_t)ptr;
+        for (ChildArenaBlock *block = m_block; block != nullptr; block = block->prev) {
+            uintptr_t data = (uintptr_t)(block + 1);
+            if (addr >= data && addr < data + block->offset) return true;
+        }
+        return false;
+    }
+
+    // Copy a single allocation out of this child into the parent so it
+    // survives the child being reset. Pointers inside it are copied as they
+    // are; use ChildPromotion below to promote everything reachable from it.
+    void* promote(const void* alloc, size_t bytes, size_t align) {
+        if (alloc == nullptr) return nullptr;
+        void* promoted = m_parent->alloc_aligned(bytes, align);
+        if (promoted == nullptr) return nullptr;
+        return std::memcpy(promoted, alloc, bytes);
+    }
+
+    size_t num_blocks() {
+        size_t count = 0;
+        for (ChildArenaBlock *block = m_block; block != nullptr; block = block->prev) { count++; }
+        return count;
+    }
+
+    // Describe our used memory as iovecs, oldest block first, so it can go
+    // straight to writev without being copied into one buffer first. Starts
+    // at `cursor` (m_first_block to start from the beginning), fills in at
+    // most `max_iovecs` entries and moves `cursor` past them, so calling it
+    // again picks up where this left off. It's null once every block has been
+    // described. Returns the number of entries filled in.
+    // NOTE: Alignment padding between allocations is included, so allocate
+    // with an alignment of 1 if the blocks are meant to be a byte stream.
+    size_t to_iovecs(iovec *iovecs, size_t max_iovecs, ChildArenaBlock *&cursor) {
+        size_t filled = 0;
+        for (; cursor != nullptr && filled < max_iovecs; cursor = cursor->next) {
+            iovecs[filled++] = { cursor + 1, cursor->offset };
+        }
+        return filled;
+    }
+
+    // Give all of our blocks back to the parent.
+    void reset() {
+        if (m_block == nullptr) return;
+        if (m_parent->m_tag != nullptr) m_parent->m_tag->uncharge(m_parent_capacity - m_parent->capacity());
+        m_parent->m_end = m_parent->m_memory + m_parent_capacity;
+        m_block = nullptr;
+        m_first_block = nullptr;
+    }
+};
+
+// Promotes a whole object graph out of a child: everything reachable from
+// the roots that lives in the child gets copied into the parent, and every
+// pointer to it (from the roots or from other promoted objects) is rewritten
+// to point at the copy. Pointers that don't point into the child (into the
+// parent, or anywhere else) are left alone. Shared objects are copied once
+// and cycles are fine.
+//
+// The promotion only knows about pointers it's told about. Relocate each
+// root, and give it a visit callback that relocates every pointer field of
+// an object, with the size and alignment of whatever that field points to:
+//
+//     void visit_node(ChildPromotion &promotion, void *object, void *ctx) {
+//         Node *node = (Node*)object;
+//         promotion.relocate((void**)&node->next, sizeof(Node), alignof(Node));
+//     }
+//
+//     ChildPromotion promotion = { .m_child = &child, .m_visit = visit_node };
+//     promotion.relocate((void**)&result, sizeof(Node), alignof(Node));
+//     if (!promotion.finish()) { /* parent ran out of memory */ }
+//     child.reset();
+//
+// Like Cheney's algorithm, copies are visited in the order they were made,
+// so there's no recursion however deep the graph is. Which copy each object
+// got is tracked in a table allocated from the child itself, since it's about
+// to be thrown away anyway.
+// NOTE: Pointers must point at the start of an object. If the parent runs
+// out of memory, whatever was copied before that stays in the parent.
+
+struct ChildPromotion;
+
+typedef void (*PromoteVisitFn)(ChildPromotion &promotion, void *object, void *ctx);
+
+struct PromotedObject {
+    void *from;
+    void *to;
+};
+
+struct ChildPromotion {
+    ChildArena *m_child;
+    PromoteVisitFn m_visit;
+    void *m_ctx;
+    // Every object copied so far, in the order they were copied.
+    PromotedObject *m_objects;
+    size_t m_count;
+    size_t m_capacity;
+    // Open addressing over m_objects, index + 1 (0 means empty). Twice as
+    // many buckets as m_capacity.
+    uint32_t *m_buckets;
+    bool m_failed;
+
+    size_t bucket_of(const void *from) {
+        return ((uintptr_t)from >> 3) * 0x9e3779b97f4a7c15ull & (2 * m_capacity - 1);
+    }
+
+    // The copy of an object we've already promoted, or null.
+    void* find(const void *from) {
+        if (m_count == 0) return nullptr;
+        for (size_t bucket = this->bucket_of(from); m_buckets[bucket] != 0; bucket = (bucket + 1) & (2 * m_capacity - 1)) {
+            PromotedObject &object = m_objects[m_buckets[bucket] - 1];
+            if (object.from == from) return object.to;
+        }
+        return nullptr;
+    }
+
+    bool grow() {
+        size_t capacity = m_capacity == 0 ? 64 : 2 * m_capacity;
+        if (capacity > UINT32_MAX) return false;
+        PromotedObject *objects = (PromotedObject*)m_child->alloc_aligned(capacity * sizeof(PromotedObject), alignof(PromotedObject));
+        uint32_t *buckets = (uint32_t*)m_child->alloc_aligned(2 * capacity * sizeof(uint32_t), alignof(uint32_t));
+        if (objects == nullptr || buckets == nullptr) return false;
+        std::memset(buckets, 0, 2 * capacity * sizeof(uint32_t));
+        if (m_count > 0) std::memcpy(objects, m_objects, m_count * sizeof(PromotedObject));
+        m_objects = objects;
+        m_buckets = buckets;
+        m_capacity = capacity;
+        for (size_t i = 0; i < m_count; i++) {
+            size_t bucket = this->bucket_of(m_objects[i].from);
+            while (m_buckets[bucket] != 0) bucket = (bucket + 1) & (2 * m_capacity - 1);
+            m_buckets[bucket] = i + 1;
+        }
+        return true;
+    }
+
+    // If `*field` points into the child, point it at the object's copy in
+    // the parent instead, copying the object (`bytes` long, aligned to
+    // `align`) if this is the first time we've seen it. Returns false if we
+    // ran out of memory, in which case the field is left as it was.
+    bool relocate(void **field, size_t bytes, size_t align) {
+        void *from = *field;
+        if (from == nullptr || !m_child->owns(from)) return true;
+        void *to = this->find(from);
+        if (to == nullptr) {
+            if (m_count == m_capacity && !this->grow()) {
+                m_failed = true;
+                return false;
+            }
+            to = m_child->promote(from, bytes, align);
+            if (to == nullptr) {
+                m_failed = true;
+                return false;
+            }
+            m_objects[m_count] = { from, to };
+            size_t bucket = this->bucket_of(from);
+            while (m_buckets[bucket] != 0) bucket = (bucket + 1) & (2 * m_capacity - 1);
+            m_buckets[bucket] = ++m_count;
+        }
+        *field = to;
+        return true;
+    }
+
+    // Visit every copy (including the ones visiting makes) so their fields
+    // get relocated too. Returns false if anything couldn't be promoted.
+    bool finish() {
+        for (size_t i = 0; i < m_count && !m_failed; i++) {
+            m_visit(*this, m_objects[i].to, m_ctx);
+        }
+        return !m_failed;
+    }
+};
+
+//============================== SEMISPACE ==============================//
+
+// A Cheney-style copying collector built on two arenas. We allocate from one
+// of them (from-space) at bump-pointer speed and when it fills up we copy
+// everything reachable from the roots into the other one (to-space), reset
+// from-space, and swap. Garbage costs nothing, only the live set is touched,
+// and the survivors end up packed together with no fragmentation.
+//
+// Every object is preceded by a header pointing at its type descriptor, which
+// tells the collector how big the object is and where its pointer fields are.
+// +--------+--------+--------+--------+-------+------+
+// | Header | Object | Header | Object |  ...  | Free |
+// +--------+--------+--------+--------+-------+------+
+//
+// Pointer fields must point at the start of a collected object, at memory
+// outside of the collector (left alone), or be null.
+
+struct GcType {
+    size_t size;
+    size_t num_refs;
+    // Byte offsets of the pointer fields within the object.
+    const size_t *ref_offsets;
+};
+
+struct GcHeader {
+    const GcType *type;
+    // Set once the object has been copied to to-space during a collection.
+    void *forward;
+};
+
+// Objects are aligned to this. Sizes get rounded up to it as well so we can
+// walk to-space object by object during a collection.
+constexpr size_t GC_ALIGN = 16;
+static_assert(sizeof(GcHeader) % GC_ALIGN == 0, "object after header must stay aligned");
+
+struct Semispace {
+    Arena m_spaces[2];
+    // Index of the space we're currently allocating from.
+    int m_active;
+    // Addresses of the pointers that keep objects alive. If set, alloc will
+    // collect by itself when it runs out of space.
+    void ***m_roots;
+    size_t m_num_roots;
+    size_t m_collections;
+
+    // Allocate a zeroed object of the given type.
+    void* alloc(const GcType *type) {
+        void* obj = this->alloc_in(m_spaces[m_active], type);
+        if (obj != nullptr || m_roots == nullptr) return obj;
+
+        if (!this->collect(m_roots, m_num_roots)) return nullptr;
+        return this->alloc_in(m_spaces[m_active], type);
+    }
+
+    void* alloc_in(Arena &space, const GcType *type) {
+        size_t size = forward_align(type->size, GC_ALIGN);
+        GcHeader *header = (GcHeader*)space.alloc_aligned(sizeof(GcHeader) + size, GC_ALIGN);
+        if (header == nullptr) return nullptr;
+        header->type = type;
+        return header + 1;
+    }
+
+    bool in_space(Arena &space, void *ptr) {
+        return (unsigned char*)ptr >= space.m_memory && (unsigned char*)ptr < space.m_current;
+    }
+
+    // Copy an object to to-space (if it hasn't been already) and return its new address.
+    void* evacuate(void *obj) {
+        Arena &from = m_spaces[m_active];
+        if (obj == nullptr || !this->in_space(from, obj)) return obj;
+
+        GcHeader *header = (GcHeader*)obj - 1;
+        if (header->forward != nullptr) return header->forward;
+
+        Arena &to = m_spaces[1 - m_active];
+        void* copy = this->alloc_in(to, header->type);
+        // Can only happen if to-space is smaller than from-space.
+        if (copy == nullptr) return nullptr;
+        std::memcpy(copy, obj, header->type->size);
+        header->forward = copy;
+        return copy;
+    }
+
+    // Copy everything reachable from `roots` into the other space and swap.
+    // Returns false if the live set doesn't fit in the other space, in which
+    // case the heap is left in an unusable state.
+    bool collect(void ***roots, size_t num_roots) {
+        Arena &to = m_spaces[1 - m_active];
+        to.reset();
+
+        for (size_t i = 0; i < num_roots; i++) {
+            void *root = *roots[i];
+            *roots[i] = this->evacuate(root);
+            if (root != nullptr && *roots[i] == nullptr) return false;
+        }
+
+        // Cheney scan: to-space doubles as our work queue. Everything between
+        // the scan pointer and to-space's offset has been copied but its
+        // fields still point into from-space.
+        uintptr_t scan = forward_align((uintptr_t)to.m_memory, GC_ALIGN);
+        while (scan < (uintptr_t)to.m_current) {
+            GcHeader *header = (GcHeader*)scan;
+            unsigned char *obj = (unsigned char*)(header + 1);
+            const GcType *type = header->type;
+            for (size_t i = 0; i < type->num_refs; i++) {
+                void **field = (void**)(obj + type->ref_offsets[i]);
+                void *old = *field;
+                *field = this->evacuate(old);
+                if (old != nullptr && *field == nullptr) return false;
+            }
+            scan += sizeof(GcHeader) + forward_align(type->size, GC_ALIGN);
+        }
+
+        m_spaces[m_active].reset();
+        m_active = 1 - m_active;
+        m_collections++;
+        return true;
+    }
+};
+
+//============================== STACK ==============================//
+
+// This is what our stack memory block looks like.
+// We ensure that there's enough padding between allocations to do two things:
+// 1) Properly align the next allocation to a user-supplied alignment (power of two).
+// 2) Store a header within the padding between allocations.
+// The header stores information that allows us to set our offset back to the start
+// of a previous allocation, in effect freeing memory of the most recent allocations.
+// +----------------+---------+------+----------------+------+
+// | Old Allocation | Padding |Header| New Allocation | Free |
+// +----------------+---------+------+----------------+------+
+//                  ↑                                 ↑
+//          Previous Offset                    Current Offset
+//
+// Big alignments (pages, huge pages) are a problem for that layout: if the
+// alignment padding is too small for a header we'd have to burn an entire
+// extra alignment unit (4 KiB, 2 MiB...) just to fit a 32 byte header. In that
+// case the header is "detached" instead and pushed onto a little stack of
+// headers that grows down from the end of our memory.
+// +----------------+----------------+------+--------+--------+
+// | Old Allocation | New Allocation | Free | Header | Header |
+// +----------------+----------------+------+--------+--------+
+//                                          ↑
+//                               End - Detached Size
+
+// Headers placed within the padding used to align data in our stack.
+// I get the feeling that making the headers essentially a doubly-linked list
+// might not have been the right way to go about things...
+struct StackAllocationHeader {
+    // Offset to go back to when this allocation is freed.
+    size_t prev_offset;
+    // Offset of the allocation itself. Everything in between the two is
+    // padding, so there's no limit on how much padding we can have.
+    size_t alloc_offset;
+    StackAllocationHeader *prev_header;
+    StackAllocationHeader *next_header;
+};
+
+// Calculate the amount of padding we need to both
+// A) align our pointer to an `align` byte boundary, and
+// B) fit a header of size `header_size` bytes in the padding.
+inline size_t calc_padding_with_header(uintptr_t base, size_t align, size_t header_size) {
+    assert(is_power_of_two(align));
+    size_t padding = align - base & (align - 1);
+
+    // If we can't fit our header into the padding we need to bump our
+    // padding up to the next aligned boundary that _can_ fit our header.
+    if (header_size > padding) {
+        size_t space_needed = header_size - padding;
+        // Is the additional space we need to store our header a multiple
+        // of our desired alignment?
+        if ((space_needed & (align - 1)) != 0) {
+            padding += align * (1 + space_needed / align);
+        } else {
+            padding += space_needed;
+        }
+    }
+
+    return padding;
+}
+
+struct Stack {
+    unsigned char* m_memory;
+    size_t m_capacity;
+    size_t m_offset;
+    size_t m_prev_offset;
+    StackAllocationHeader *m_prev_header;
+    // Bytes at the end of our memory used by detached headers.
+    size_t m_detached_size;
+    // Optional. Charged for the offset plus detached headers.
+    MemoryTag *m_tag;
+    // Optional. Where to publish our numbers.
+    StatsEntry *m_stats;
+
+    size_t used() { return m_offset + m_detached_size; }
+
+    // Charge or give back the difference between what we used before an
+    // operation and what we use now.
+    bool charge_to(size_t used) {
+        if (m_tag == nullptr) return true;
+        size_t current = this->used();
+        if (used > current) return m_tag->charge(used - current);
+        m_tag->uncharge(current - used);
+        return true;
+    }
+
+    // Try to allocate some amount of memory with the given alignment.
+    void* alloc_aligned(size_t alloc_size, size_t align) {
+        assert(is_power_of_two(align));
+        uintptr_t start = (uintptr_t)m_memory;
+        uintptr_t end = start + m_capacity;
+        uintptr_t base_addr = start + m_offset;
+        uintptr_t headers_addr = end - m_detached_size;
+
+        size_t padding = align - base_addr & (align - 1);
+        bool detached = false;
+        if (ALLOC_UNLIKELY(padding < sizeof(StackAllocationHeader))) {
+            if (align <= sizeof(StackAllocationHeader)) {
+                // Small alignments only ever cost a few extra bytes.
+                padding = calc_padding_with_header(base_addr, align, sizeof(StackAllocationHeader));
+            } else {
+                detached = true;
+                headers_addr = (headers_addr - sizeof(StackAllocationHeader)) & ~(uintptr_t)(alignof(StackAllocationHeader) - 1);
+            }
+        }
+
+        // Check if we're out of memory
+        if (ALLOC_UNLIKELY(headers_addr < base_addr || headers_addr - base_addr < padding + alloc_size
+            || !this->charge_to(m_offset + padding + alloc_size + (end - headers_addr)))) {
+            if (m_stats != nullptr) m_stats->record_failure();
+            return nullptr;
+        }
+        m_prev_offset = m_offset;
+        m_offset += padding;
+
+        uintptr_t next_aligned_addr = base_addr + padding;
+        StackAllocationHeader* header;
+        if (detached) {
+            header = (StackAllocationHeader*)headers_addr;
+            m_detached_size = end - headers_addr;
+        } else {
+            header = (StackAllocationHeader*)(next_aligned_addr - sizeof(StackAllocationHeader));
+        }
+        header->prev_offset = m_prev_offset;
+        header->alloc_offset = m_offset;
+        header->prev_header = m_prev_header;
+        header->next_header = nullptr;
+        if (m_prev_header != nullptr) {
+            m_prev_header->next_header = header;
+        }
+        m_prev_header = header;
+        m_offset += alloc_size;
+        if (m_stats != nullptr) m_stats->record_alloc(this->used());
+
+        return std::memset((void*)next_aligned_addr, 0, alloc_size);
+    }
+
+    // Find the header for a live allocation.
+    // The top allocation's header is always m_prev_header so the common case
+    // is O(1), anything else has to walk back through the headers.
+    StackAllocationHeader* find_header(uintptr_t alloc) {
+        uintptr_t start = (uintptr_t)m_memory;
+        for (StackAllocationHeader *header = m_prev_header; header != nullptr; header = header->prev_header) {
+            if (start + header->alloc_offset == alloc) return header;
+        }
+        return nullptr;
+    }
+
+    // Given an allocation, free to the start of the previous allocation.
+    // Returns whether the operation was successful.
+    bool free(void* alloc) {
+        if (alloc == nullptr) return false;
+
+        uintptr_t start = (uintptr_t)m_memory;
+        uintptr_t end = start + m_capacity;
+        uintptr_t curr_addr = (uintptr_t)alloc;
+        // Ensure that we're in the bounds of our memory.
+        // Should probably assert here.
+        if (curr_addr < start || curr_addr > end) { return false; }
+        // Allow double-frees
+        if (curr_addr >= start + m_offset) { return false; }
+
+        // Protect against out-of-order frees
+        StackAllocationHeader* header = m_prev_header;
+        if (header == nullptr || start + header->alloc_offset != curr_addr) { return false; }
+        size_t used = this->used();
+
+        // Detached headers live above our current offset. Pop this one and
+        // anything below it (which can only belong to dead allocations).
+        if ((uintptr_t)header >= start + m_offset) {
+            m_detached_size = end - (uintptr_t)(header + 1);
+        }
+
+        m_offset = header->prev_offset;
+        if (header->prev_header != nullptr) {
+            m_prev_offset = header->prev_header->prev_offset;
+            m_prev_header = header->prev_header;
+            m_prev_header->next_header = nullptr;
+        } else {
+            m_prev_offset = 0;
+            m_prev_header = nullptr;
+        }
+
+        // If the new top has a detached header, everything below it is dead.
+        if (m_prev_header == nullptr) {
+            m_detached_size = 0;
+        } else if ((uintptr_t)m_prev_header >= start + m_offset) {
+            m_detached_size = end - (uintptr_t)m_prev_header;
+        }
+
+        if (m_tag != nullptr) m_tag->uncharge(used - this->used());
+        if (m_stats != nullptr) m_stats->record_free(this->used());
+        return true;
+    }
+
+    // NOTE: This does NOT support changing the _alignment_ of an allocation.
+    void* resize_aligned(void* old_allocation, size_t old_size, size_t new_size, size_t align) {
+        if (old_allocation == nullptr) { return this->alloc_aligned(new_size, align); }
+        if (new_size == 0) {
+            this->free(old_allocation);
+            return nullptr;
+        }
+
+        uintptr_t old_alloc = (uintptr_t)old_allocation;
+        uintptr_t start = (uintptr_t)m_memory;
+        uintptr_t end = start + m_capacity;
+        if (old_alloc < start || old_alloc > end) { return nullptr; }
+        if (old_alloc >= start + m_offset) { return nullptr; }
+
+        // Is the user trying to resize a block of memory that was already
+        // resized (see below note)? Those aren't linked in anymore.
+        StackAllocationHeader* header = this->find_header(old_alloc);
+        if (header == nullptr) { return nullptr; }
+
+        // Was this the most recent thing we allocated?
+        if (header == m_prev_header) {
+            size_t new_offset = (old_alloc - start) + new_size;
+            if (new_offset > m_capacity - m_detached_size) {
+                if (m_stats != nullptr) m_stats->record_failure();
+                return nullptr;
+            }
+            if (!this->charge_to(new_offset + m_detached_size)) {
+                if (m_stats != nullptr) m_stats->record_failure();
+                return nullptr;
+            }
+            if (new_size > old_size) {
+                std::memset((void*)(old_alloc + old_size), 0, new_size - old_size);
+            }
+            m_offset = new_offset;
+            if (m_stats != nullptr) m_stats->record_used(this->used());
+            return old_allocation;
+        }
+
+        uintptr_t resized_alloc = (uintptr_t)this->alloc_aligned(new_size, align);
+        if (resized_alloc == 0) { return nullptr; }
+        size_t min_size = old_size < new_size ? old_size : new_size;
+        std::memmove((void*)resized_alloc, old_allocation, min_size);
+
+        // Treat this block of memory as if it doesn't exist such that when
+        // the user attempts to free the _next_ block, we free to the
+        // previous offset before _this_ block. This allows the user to
+        // discard the old pointer they were using if they attempted to
+        // resize a non-top allocation.
+        // In short, we're basically making this block of memory invisible
+        // to our stack allocator and treating the next block of memory as
+        // if it just has a lot more padding than usual.
+        //
+        // TODO Actually is this good? Maybe this is confusing from a user
+        // perspective. Now the user has to ensure that they _don't_ use
+        // the old allocation again. Need to think on this.
+        header->next_header->prev_offset = header->prev_offset;
+        header->next_header->prev_header = header->prev_header;
+        if (header->prev_header != nullptr) {
+            header->prev_header->next_header = header->next_header;
+        }
+        header->prev_header = nullptr;
+        header->next_header = nullptr;
+        m_prev_offset = m_prev_header->prev_offset;
+
+        return (void*)resized_alloc;
+    }
+
+    void reset() {
+        if (m_tag != nullptr) m_tag->uncharge(this->used());
+        m_offset = 0;
+        m_prev_offset = 0;
+        m_prev_header = nullptr;
+        m_detached_size = 0;
+        if (m_stats != nullptr) m_stats->record_free(0);
+    }
+
+    void set_tag(MemoryTag *tag) {
+        MemoryTag::transfer(m_tag, tag, this->used());
+        m_tag = tag;
+    }
+};
+
+//============================== POOL ==============================//
+
+struct PoolFreeNode {
+    PoolFreeNode *next;
+};
+
+struct Pool {
+    unsigned char *m_memory;
+    unsigned char *m_aligned_memory;
+    PoolFreeNode *m_free_list_head;
+    size_t m_capacity;
+    size_t m_chunk_size;
+    size_t m_num_chunks;
+    // Chunks from this index on have never been handed out (or were handed
+    // back to the OS by the Scavenger, or the pool was reset) and aren't on
+    // the free list. alloc() only takes from here once the free list is empty.
+    size_t m_bump;
+    // Chunks handed out and not freed yet, so nothing has to walk the free
+    // list to find out.
+    size_t m_num_in_use;
+    // Optional. Charged a chunk for every chunk in use.
+    MemoryTag *m_tag;
+    // Optional. Where to publish our numbers.
+    StatsEntry *m_stats;
+    // How many free-list nodes past the head to keep prefetched: 0 (off), 1
+    // or 2. Popping reads the head's next pointer, which is a cache miss on
+    // every alloc when the free list is cold (freed long ago, or in random
+    // order). With prefetching on, that line was requested one or two allocs
+    // earlier. Not worth it when the free list is hot.
+    uint32_t m_prefetch_distance;
+
+    Pool(bool &valid, void *memory, size_t capacity, size_t chunk_size, size_t chunk_align)
+        :   m_memory((unsigned char *)memory),
+            m_capacity(capacity),
+            m_chunk_size(chunk_size),
+            m_free_list_head(nullptr),
+            m_num_chunks(0),
+            m_bump(0),
+            m_num_in_use(0),
+            m_tag(nullptr),
+            m_stats(nullptr),
+            m_prefetch_distance(0)
+    {
+        // chunks need to start at the right alignment
+        m_aligned_memory = (unsigned char *)forward_align((uintptr_t)m_memory, chunk_align);
+        m_capacity -= m_aligned_memory - m_memory;
+        // chunk size should be a multiple of chunk alignment
+        m_chunk_size = forward_align(m_chunk_size, chunk_align);
+
+        // We need to be able to store metadata for free nodes in free chunks.
+        // Obviously we need to enough capacity to store at least one chunk.
+        if (chunk_size < sizeof(PoolFreeNode) || m_capacity < m_chunk_size) {
+            valid = false;
+            return;
+        }
+        m_num_chunks = m_capacity / m_chunk_size;
+
+        this->free_all();
+        valid = true;
+    }
+
+    // O(chunks): every chunk gets pushed onto the free list. See reset() for
+    // huge pools.
+    void free_all() {
+        if (m_tag != nullptr) m_tag->uncharge(this->num_in_use() * m_chunk_size);
+        m_free_list_head = nullptr;
+        for (size_t i = 0; i < m_num_chunks; i++) {
+            void *chunk = &m_aligned_memory[i * m_chunk_size];
+            PoolFreeNode *node = (PoolFreeNode *)chunk;
+            node->next = m_free_list_head;
+            m_free_list_head = node;
+        }
+        m_bump = m_num_chunks;
+        m_num_in_use = 0;
+        if (m_stats != nullptr) m_stats->record_free(0);
+    }
+
+    // Same as free_all() as far as anyone allocating can tell, but O(1): drop
+    // the free list and move the bump cursor back to the first chunk, so the
+    // chunks get handed out again in address order without ever being walked.
+    // Nothing is written to the chunks, and the Scavenger sees every chunk as
+    // untouched and can give all of it back to the OS.
+    void reset() {
+        if (m_tag != nullptr) m_tag->uncharge(m_num_in_use * m_chunk_size);
+        m_free_list_head = nullptr;
+        m_bump = 0;
+        m_num_in_use = 0;
+        if (m_stats != nullptr) m_stats->record_free(0);
+    }
+
+    size_t num_untouched() { return m_num_chunks - m_bump; }
+
+    size_t num_in_use() { return m_num_in_use; }
+
+    void set_tag(MemoryTag *tag) {
+        MemoryTag::transfer(m_tag, tag, this->num_in_use() * m_chunk_size);
+        m_tag = tag;
+    }
+
+    bool free(void *ptr) {
+        if (ptr == nullptr) { return false; }
+
+        uintptr_t chunk = (uintptr_t)ptr;
+        uintptr_t start = (uintptr_t)m_aligned_memory;
+        uintptr_t end = start + m_capacity;
+        if (chunk < start || chunk > end) { return false; }
+
+        PoolFreeNode *node = (PoolFreeNode *)chunk;
+        node->next = m_free_list_head;
+        m_free_list_head = node;
+        m_num_in_use--;
+        if (m_tag != nullptr) m_tag->uncharge(m_chunk_size);
+        if (m_stats != nullptr) m_stats->record_free(m_num_in_use * m_chunk_size);
+        return true;
+    }
+
+    // Fast path: pop the free list, or bump when it's empty (always the case
+    // right after a reset). Tags, stats and running dry are handled out of
+    // line.
+    ALLOC_ALWAYS_INLINE void* alloc() {
+        if (ALLOC_LIKELY(m_tag == nullptr && m_stats == nullptr)) {
+            PoolFreeNode *node = m_free_list_head;
+            if (ALLOC_LIKELY(node != nullptr)) {
+                m_free_list_head = node->next;
+                m_num_in_use++;
+                if (m_prefetch_distance != 0) this->prefetch_free_list();
+                return memset(node, 0, m_chunk_size);
+            }
+            if (m_bump < m_num_chunks) {
+                m_num_in_use++;
+                return memset(&m_aligned_memory[m_bump++ * m_chunk_size], 0, m_chunk_size);
+            }
+        }
+        return this->alloc_slow();
+    }
+
+    // Called right after a pop. The new head was prefetched by the pop before
+    // this one when the distance is 2, so reading its next pointer to reach
+    // one further shouldn't stall.
+    ALLOC_ALWAYS_INLINE void prefetch_free_list() {
+        PoolFreeNode *head = m_free_list_head;
+        if (head == nullptr) return;
+        ALLOC_PREFETCH_WRITE(head);
+        if (m_prefetch_distance >= 2) ALLOC_PREFETCH_WRITE(head->next);
+    }
+
+    ALLOC_COLD void* alloc_slow() {
+        PoolFreeNode *node = m_free_list_head;
+        if ((node == nullptr && m_bump == m_num_chunks)
+            || (m_tag != nullptr && !m_tag->charge(m_chunk_size))) {
+            if (m_stats != nullptr) m_stats->record_failure();
+            return nullptr;
+        }
+        m_num_in_use++;
+        if (m_stats != nullptr) m_stats->record_alloc(m_num_in_use * m_chunk_size);
+        if (node == nullptr) {
+            return memset(&m_aligned_memory[m_bump++ * m_chunk_size], 0, m_chunk_size);
+        }
+        // pop from free list
+        m_free_list_head = m_free_list_head->next;
+        if (m_prefetch_distance != 0) this->prefetch_free_list();
+        return memset(node, 0, m_chunk_size);
+    }
+};
+
+//============================== DIRECT I/O ==============================//
+
+// O_DIRECT reads skip the page cache and DMA straight into our buffers, but
+// the kernel is picky about it: the buffer address must be aligned to the
+// device's memory alignment, and the file offset and length must be multiples
+// of its logical block size. Get it wrong and the read fails with EINVAL.
+
+struct DirectIoAlignment {
+    size_t mem_align;
+    size_t offset_align;
+};
+
+// Used when the kernel can't tell us. A page covers every common block device.
+constexpr size_t DIRECT_IO_FALLBACK_ALIGN = 4096;
+
+// Ask the kernel what O_DIRECT needs for this file. Linux 6.1+ tells us
+// through statx(STATX_DIOALIGN). On older kernels we fall back to the logical
+// block size for block devices and to a page for everything else.
+// Returns false if the file doesn't support O_DIRECT at all.
+inline bool query_direct_io_alignment(int fd, DirectIoAlignment &alignment) {
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN | STATX_TYPE, &stx) != 0) { return false; }
+
+    if (stx.stx_mask & STATX_DIOALIGN) {
+        // Zeroes mean the file can't do direct I/O.
+        if (stx.stx_dio_mem_align == 0 || stx.stx_dio_offset_align == 0) { return false; }
+        alignment.mem_align = stx.stx_dio_mem_align;
+        alignment.offset_align = stx.stx_dio_offset_align;
+        return true;
+    }
+
+    int block_size;
+    if (S_ISBLK(stx.stx_mode) && ioctl(fd, BLKSSZGET, &block_size) == 0) {
+        alignment.mem_align = block_size;
+        alignment.offset_align = block_size;
+        return true;
+    }
+
+    alignment.mem_align = DIRECT_IO_FALLBACK_ALIGN;
+    alignment.offset_align = DIRECT_IO_FALLBACK_ALIGN;
+    return true;
+}
+
+// Round a transfer size up to something O_DIRECT will accept.
+inline size_t direct_io_size(size_t bytes, DirectIoAlignment alignment) {
+    return forward_align(bytes, alignment.offset_align);
+}
+
+// Allocate an O_DIRECT-ready buffer of at least `bytes` bytes from an arena.
+// The actual (rounded up) size is written to `out_size` if it isn't null.
+inline void* alloc_direct_io_buffer(Arena &arena, size_t bytes, DirectIoAlignment alignment, size_t *out_size) {
+    size_t size = direct_io_size(bytes, alignment);
+    void* buffer = arena.alloc_aligned(size, alignment.mem_align);
+    if (buffer != nullptr && out_size != nullptr) { *out_size = size; }
+    return buffer;
+}
+
+// Make a pool of equally sized O_DIRECT-ready buffers. Every chunk is aligned
+// to the memory alignment and sized to a multiple of the block size.
+inline Pool make_direct_io_pool(bool &valid, void *memory, size_t capacity, size_t buffer_size, DirectIoAlignment alignment) {
+    size_t chunk_align = alignment.mem_align > alignment.offset_align ? alignment.mem_align : alignment.offset_align;
+    return Pool(valid, memory, capacity, direct_io_size(buffer_size, alignment), chunk_align);
+}
+
+//============================== IO_URING ==============================//
+
+// Just enough of io_uring to drive our buffer pools, talking to the kernel
+// through the raw syscalls so we don't need liburing.
+// The submission and completion rings are shared with the kernel. We own the
+// SQ tail and the CQ head, the kernel owns the other two.
+
+struct IoUring {
+    int m_fd;
+    unsigned m_sq_entries;
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_mask;
+    unsigned *m_sq_array;
+    io_uring_sqe *m_sqes;
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned *m_cq_mask;
+    io_uring_cqe *m_cqes;
+    // Our copy of the SQ tail, published to the kernel on submit.
+    unsigned m_sqe_tail;
+    unsigned m_submitted_tail;
+    void *m_sq_ring;
+    size_t m_sq_ring_size;
+    void *m_cq_ring;
+    size_t m_cq_ring_size;
+    size_t m_sqes_size;
+
+    IoUring(bool &valid, unsigned entries)
+        :   m_fd(-1),
+            m_sqes((io_uring_sqe*)MAP_FAILED),
+            m_sqe_tail(0),
+            m_submitted_tail(0),
+            m_sq_ring(MAP_FAILED),
+            m_cq_ring(MAP_FAILED)
+    {
+        valid = false;
+        io_uring_params params = {};
+        m_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0) { return; }
+
+        m_sq_entries = params.sq_entries;
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        // Newer kernels let us map both rings with one mmap.
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap && m_cq_ring_size > m_sq_ring_size) { m_sq_ring_size = m_cq_ring_size; }
+
+        m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ring == MAP_FAILED) { return; }
+        if (single_mmap) {
+            m_cq_ring = m_sq_ring;
+        } else {
+            m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cq_ring == MAP_FAILED) { return; }
+        }
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED) { return; }
+
+        unsigned char *sq = (unsigned char*)m_sq_ring;
+        m_sq_head = (unsigned*)(sq + params.sq_off.head);
+        m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        m_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        m_sq_array = (unsigned*)(sq + params.sq_off.array);
+        unsigned char *cq = (unsigned char*)m_cq_ring;
+        m_cq_head = (unsigned*)(cq + params.cq_off.head);
+        m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        m_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        m_sqe_tail = *m_sq_tail;
+        m_submitted_tail = m_sqe_tail;
+        valid = true;
+    }
+
+    // Grab a zeroed submission entry, or null if the SQ is full.
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sqe_tail - head >= m_sq_entries) { return nullptr; }
+        unsigned index = m_sqe_tail & *m_sq_mask;
+        io_uring_sqe *sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(io_uring_sqe));
+        m_sq_array[index] = index;
+        m_sqe_tail++;
+        return sqe;
+    }
+
+    // Hand every prepared SQE to the kernel and optionally wait for completions.
+    // Returns the number of SQEs submitted or -errno.
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = m_sqe_tail - m_submitted_tail;
+        m_submitted_tail = m_sqe_tail;
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret = (int)syscall(__NR_io_uring_enter, m_fd, to_submit, wait_nr, flags, nullptr, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    io_uring_cqe* peek_cqe() {
+        unsigned head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) { return nullptr; }
+        return &m_cqes[head & *m_cq_mask];
+    }
+
+    io_uring_cqe* wait_cqe() {
+        io_uring_cqe *cqe;
+        while ((cqe = this->peek_cqe()) == nullptr) {
+            if (this->submit(1) < 0) { return nullptr; }
+        }
+        return cqe;
+    }
+
+    // Let the kernel reuse the CQE we just looked at.
+    void cqe_seen() {
+        __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    int register_op(unsigned opcode, void *arg, unsigned nr_args) {
+        int ret = (int)syscall(__NR_io_uring_register, m_fd, opcode, arg, nr_args);
+        return ret < 0 ? -errno : ret;
+    }
+
+    void destroy() {
+        if (m_sqes != MAP_FAILED) { munmap(m_sqes, m_sqes_size); }
+        if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) { munmap(m_cq_ring, m_cq_ring_size); }
+        if (m_sq_ring != MAP_FAILED) { munmap(m_sq_ring, m_sq_ring_size); }
+        if (m_fd >= 0) { close(m_fd); }
+        m_fd = -1;
+        m_sqes = (io_uring_sqe*)MAP_FAILED;
+        m_sq_ring = m_cq_ring = MAP_FAILED;
+    }
+};
+
+//============================== IO BUFFER POOL ==============================//
+
+// A pool of fixed-size I/O buffers that io_uring knows about up front.
+//
+// 1) Registered buffers: the whole pool is registered with the ring once
+//    (IORING_REGISTER_BUFFERS) so READ_FIXED/WRITE_FIXED on any chunk skip
+//    pinning and unpinning the pages on every I/O.
+// 2) Provided buffer ring: chunks are handed to the kernel through a buffer
+//    ring (IORING_REGISTER_PBUF_RING) and the kernel picks one whenever data
+//    shows up, e.g. for multishot receives. The CQE tells us which one it
+//    used, and we hand it back to the ring (or the pool) when we're done.
+//
+// Chunks given to the buffer ring are taken out of the pool so nothing else
+// can allocate them while the kernel might be writing into them.
+
+// The whole pool goes in this slot of the ring's registered buffer table.
+constexpr unsigned IO_BUFFER_POOL_FIXED_INDEX = 0;
+
+struct IoBufferPool {
+    Pool m_pool;
+    IoUring *m_ring;
+    bool m_registered;
+    io_uring_buf_ring *m_buf_ring;
+    uint16_t m_buf_ring_mask;
+    uint16_t m_buf_group;
+
+    IoBufferPool(bool &valid, IoUring &ring, void *memory, size_t capacity, size_t buffer_size, size_t buffer_align)
+        :   m_pool(valid, memory, capacity, buffer_size, buffer_align),
+            m_ring(&ring),
+            m_registered(false),
+            m_buf_ring(nullptr),
+            m_buf_ring_mask(0),
+            m_buf_group(0)
+    {}
+
+    size_t num_buffers() { return m_pool.m_capacity / m_pool.m_chunk_size; }
+
+    // Register all of the pool's memory as a single fixed buffer.
+    // Returns 0 or -errno.
+    int register_buffers() {
+        iovec region = { m_pool.m_aligned_memory, this->num_buffers() * m_pool.m_chunk_size };
+        int ret = m_ring->register_op(IORING_REGISTER_BUFFERS, &region, 1);
+        m_registered = ret == 0;
+        return ret;
+    }
+
+    void* alloc() { return m_pool.alloc(); }
+    bool free(void *buffer) { return m_pool.free(buffer); }
+
+    void prep_fixed(io_uring_sqe *sqe, uint8_t opcode, int fd, void *buffer, unsigned len, uint64_t offset) {
+        assert(m_registered);
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->buf_index = IO_BUFFER_POOL_FIXED_INDEX;
+    }
+
+    void prep_read_fixed(io_uring_sqe *sqe, int fd, void *buffer, unsigned len, uint64_t offset) {
+        this->prep_fixed(sqe, IORING_OP_READ_FIXED, fd, buffer, len, offset);
+    }
+
+    void prep_write_fixed(io_uring_sqe *sqe, int fd, void *buffer, unsigned len, uint64_t offset) {
+        this->prep_fixed(sqe, IORING_OP_WRITE_FIXED, fd, buffer, len, offset);
+    }
+
+    // Set up a provided buffer ring with `entries` slots (power of two) in
+    // buffer group `group`. The ring itself must be page aligned so we take
+    // it from an arena. Returns 0 or -errno.
+    int register_buf_ring(Arena &arena, uint16_t entries, uint16_t group) {
+        assert(is_power_of_two(entries));
+        // Buffer IDs are 16 bits.
+        if (this->num_buffers() > 65536) { return -EINVAL; }
+
+        io_uring_buf_ring *buf_ring = (io_uring_buf_ring*)arena.alloc_aligned(entries * sizeof(io_uring_buf), 4096);
+        if (buf_ring == nullptr) { return -ENOMEM; }
+
+        io_uring_buf_reg reg = {};
+        reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+        reg.ring_entries = entries;
+        reg.bgid = group;
+        int ret = m_ring->register_op(IORING_REGISTER_PBUF_RING, &reg, 1);
+        if (ret != 0) { return ret; }
+
+        m_buf_ring = buf_ring;
+        m_buf_ring_mask = entries - 1;
+        m_buf_group = group;
+        return 0;
+    }
+
+    // Give a buffer to the kernel through the buffer ring.
+    void provide(void *buffer) {
+        uint16_t tail = m_buf_ring->tail;
+        // Don't use m_buf_ring->bufs, the kernel header's flexible array
+        // trick puts it at the wrong offset in C++ (empty structs aren't
+        // empty here). The entries start right at the beginning of the ring.
+        io_uring_buf *buf = (io_uring_buf*)m_buf_ring + (tail & m_buf_ring_mask);
+        buf->addr = (uint64_t)(uintptr_t)buffer;
+        buf->len = (uint32_t)m_pool.m_chunk_size;
+        buf->bid = (uint16_t)(((unsigned char*)buffer - m_pool.m_aligned_memory) / m_pool.m_chunk_size);
+        __atomic_store_n(&m_buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // Fill the buffer ring from the pool. Returns how many buffers were provided.
+    size_t provide_from_pool(size_t count) {
+        size_t provided = 0;
+        for (; provided < count; provided++) {
+            void *buffer = m_pool.alloc();
+            if (buffer == nullptr) break;
+            this->provide(buffer);
+        }
+        return provided;
+    }
+
+    // Which buffer did the kernel pick for this completion? Null if none.
+    void* cqe_buffer(io_uring_cqe *cqe) {
+        if (!(cqe->flags & IORING_CQE_F_BUFFER)) { return nullptr; }
+        size_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        return m_pool.m_aligned_memory + bid * m_pool.m_chunk_size;
+    }
+
+    // Receive into kernel-picked buffers until the socket closes or we run
+    // out of buffers. Every message gets its own CQE with IORING_CQE_F_MORE
+    // set as long as the receive is still armed.
+    void prep_recv_multishot(io_uring_sqe *sqe, int fd) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = m_buf_group;
+    }
+};
+
+//============================== SCATTER-GATHER ==============================//
+
+// Write out everything in a chained arena with as few syscalls as possible
+// and without first copying it all into one contiguous buffer.
+
+// How many iovecs we hand to the kernel at once. IOV_MAX is 1024 on Linux
+// but most outputs have nowhere near that many blocks.
+constexpr size_t SCATTER_GATHER_BATCH = 64;
+
+// Write all of a child arena's used bytes to `fd`, in allocation order.
+// `offset` is the file offset to write at, or -1 for the current position.
+// `flags` are passed to pwritev2 (RWF_DSYNC etc).
+// Returns the number of bytes written, or -errno on failure. That's short of
+// everything if the file stops taking data (pwritev2 returns 0).
+inline ssize_t write_arena_blocks(int fd, ChildArena &arena, off_t offset, int flags) {
+    iovec iovecs[SCATTER_GATHER_BATCH];
+    size_t written = 0;
+    ChildArenaBlock *cursor = arena.m_first_block;
+
+    for (;;) {
+        size_t count = arena.to_iovecs(iovecs, SCATTER_GATHER_BATCH, cursor);
+        if (count == 0) break;
+
+        iovec *iov = iovecs;
+        while (count > 0) {
+            ssize_t n = pwritev2(fd, iov, (int)count, offset, flags);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            // Nothing went out and nothing will if we ask again.
+            if (n == 0) {
+                while (count > 0 && iov->iov_len == 0) { iov++; count--; }
+                if (count > 0) return written;
+                break;
+            }
+            written += n;
+            if (offset != -1) { offset += n; }
+
+            // Short write, skip whatever made it out and go again.
+            while (count > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = (unsigned char*)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+    }
+
+    return written;
+}
+
+//============================== FLAT BUFFERS ==============================//
+
+// A serialization format that's built directly in arena memory. Every
+// reference inside a message is a 32-bit offset from the start of the
+// message, so the arena's used bytes _are_ the serialized message: no encode
+// pass on the way out, and the reader uses the bytes in place (e.g. straight
+// out of an mmap'd file) with no decode pass on the way in.
+// +--------+-----------------------------------------------+
+// | Header | Tables, strings and vectors, in build order   |
+// +--------+-----------------------------------------------+
+// ↑
+// Message base (every offset is relative to this)
+//
+// Tables are plain structs of scalars and FlatRefs to other tables, strings
+// and vectors. Messages use the host's byte order and struct layout, which is
+// fine for passing files between stages on the same machine.
+
+constexpr uint32_t FLAT_MAGIC = 0x31544c46; // "FLT1"
+// Message base alignment. Nothing inside a message can be aligned past this.
+constexpr size_t FLAT_ALIGN = 16;
+
+struct FlatHeader {
+    uint32_t magic;
+    uint32_t size; // Whole message, header included
+    uint32_t root; // Offset of the root table
+    uint32_t reserved;
+};
+
+// Offset of a T within a message. Zero means null (that's the header).
+template <typename T>
+struct FlatRef {
+    uint32_t offset;
+};
+
+// Followed by `length` chars and a null terminator.
+struct FlatString {
+    uint32_t length;
+};
+
+// Followed by `count` Ts, aligned for T.
+template <typename T>
+struct FlatVector {
+    uint32_t count;
+};
+
+// Where a vector's elements start relative to the vector itself.
+template <typename T>
+inline size_t flat_vector_data_offset() {
+    return sizeof(uint32_t) > alignof(T) ? forward_align(sizeof(uint32_t), alignof(T)) : alignof(T);
+}
+
+struct FlatBuilder {
+    Arena *m_arena;
+    unsigned char *m_base;
+    // Set if the arena ran out of space at any point.
+    bool m_failed;
+
+    // Start a new message at the arena's current position.
+    bool begin() {
+        m_failed = false;
+        m_base = (unsigned char*)m_arena->alloc_aligned(sizeof(FlatHeader), FLAT_ALIGN);
+        if (m_base == nullptr) { m_failed = true; return false; }
+        return true;
+    }
+
+    uint32_t offset_of(const void *ptr) {
+        return ptr == nullptr ? 0 : (uint32_t)((const unsigned char*)ptr - m_base);
+    }
+
+    void* alloc(size_t bytes, size_t align) {
+        assert(align <= FLAT_ALIGN);
+        void* alloc = m_arena->alloc_aligned(bytes, align);
+        // Offsets are 32 bits.
+        if (alloc != nullptr && (unsigned char*)alloc + bytes - m_base > UINT32_MAX) { alloc = nullptr; }
+        if (alloc == nullptr) { m_failed = true; }
+        return alloc;
+    }
+
+    // Lay out a zeroed table in the message and hand back a pointer so it can
+    // be filled in place. The pointer stays valid while the arena lives.
+    template <typename T>
+    T* add_table(FlatRef<T> &ref) {
+        static_assert(alignof(T) <= FLAT_ALIGN, "table is over-aligned");
+        T* table = (T*)this->alloc(sizeof(T), alignof(T));
+        ref.offset = this->offset_of(table);
+        return table;
+    }
+
+    FlatRef<FlatString> add_string(const char *str, size_t length) {
+        FlatString *flat = (FlatString*)this->alloc(sizeof(FlatString) + length + 1, alignof(FlatString));
+        if (flat == nullptr) return { 0 };
+        flat->length = (uint32_t)length;
+        std::memcpy(flat + 1, str, length);
+        ((char*)(flat + 1))[length] = '\0';
+        return { this->offset_of(flat) };
+    }
+
+    // Lay out a zeroed vector and hand back a pointer to its elements so they
+    // can be filled in place.
+    template <typename T>
+    T* add_vector(FlatRef<FlatVector<T>> &ref, size_t count) {
+        static_assert(alignof(T) <= FLAT_ALIGN, "vector element is over-aligned");
+        size_t data_offset = flat_vector_data_offset<T>();
+        size_t align = alignof(T) > alignof(FlatVector<T>) ? alignof(T) : alignof(FlatVector<T>);
+        unsigned char *vector = (unsigned char*)this->alloc(data_offset + count * sizeof(T), align);
+        ref.offset = this->offset_of(vector);
+        if (vector == nullptr) return nullptr;
+        ((FlatVector<T>*)vector)->count = (uint32_t)count;
+        return (T*)(vector + data_offset);
+    }
+
+    // Fill in the header. Returns the size of the message (0 on failure),
+    // which is everything in the arena from m_base up to its offset.
+    template <typename T>
+    size_t finish(FlatRef<T> root) {
+        if (m_failed) return 0;
+        FlatHeader *header = (FlatHeader*)m_base;
+        header->magic = FLAT_MAGIC;
+        header->size = (uint32_t)(m_arena->m_current - m_base);
+        header->root = root.offset;
+        return header->size;
+    }
+};
+
+// Reads a message in place. Everything is bounds-checked against the message
+// size so a truncated or corrupt file can't send us off into the weeds; bad
+// references come back as null.
+struct FlatReader {
+    const unsigned char *m_data;
+    size_t m_size;
+
+    bool open(const void *data, size_t size) {
+        m_data = (const unsigned char*)data;
+        m_size = 0;
+        if (data == nullptr || size < sizeof(FlatHeader)) return false;
+        if (((uintptr_t)data & (FLAT_ALIGN - 1)) != 0) return false;
+        const FlatHeader *header = (const FlatHeader*)data;
+        if (header->magic != FLAT_MAGIC || header->size > size || header->size < sizeof(FlatHeader)) return false;
+        m_size = header->size;
+        return true;
+    }
+
+    bool in_bounds(uint32_t offset, size_t bytes, size_t align) {
+        if (offset == 0 || (offset & (align - 1)) != 0) return false;
+        return offset <= m_size && bytes <= m_size - offset;
+    }
+
+    template <typename T>
+    const T* root() {
+        return this->get(FlatRef<T> { ((const FlatHeader*)m_data)->root });
+    }
+
+    template <typename T>
+    const T* get(FlatRef<T> ref) {
+        if (!this->in_bounds(ref.offset, sizeof(T), alignof(T))) return nullptr;
+        return (const T*)(m_data + ref.offset);
+    }
+
+    const char* string(FlatRef<FlatString> ref, size_t *length) {
+        const FlatString *flat = this->get(ref);
+        if (flat == nullptr) return nullptr;
+        if (!this->in_bounds(ref.offset, sizeof(FlatString) + (size_t)flat->length + 1, alignof(FlatString))) return nullptr;
+        if (((const char*)(flat + 1))[flat->length] != '\0') return nullptr;
+        if (length != nullptr) { *length = flat->length; }
+        return (const char*)(flat + 1);
+    }
+
+    template <typename T>
+    const T* vector(FlatRef<FlatVector<T>> ref, size_t *count) {
+        const FlatVector<T> *vector = this->get(ref);
+        if (vector == nullptr) return nullptr;
+        size_t data_offset = flat_vector_data_offset<T>();
+        if (vector->count > (m_size - data_offset) / sizeof(T)) return nullptr;
+        if (!this->in_bounds(ref.offset, data_offset + vector->count * sizeof(T), alignof(FlatVector<T>))) return nullptr;
+        if (count != nullptr) { *count = vector->count; }
+        return (const T*)((const unsigned char*)vector + data_offset);
+    }
+};
+
+// Read-only mapping of a message file.
+struct FlatFile {
+    void *m_memory;
+    size_t m_size;
+
+    bool open(const char *path, FlatReader &reader) {
+        m_memory = MAP_FAILED;
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); return false; }
+        m_size = st.st_size;
+        m_memory = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m_memory == MAP_FAILED) return false;
+        return reader.open(m_memory, m_size);
+    }
+
+    void close() {
+        if (m_memory != MAP_FAILED) { munmap(m_memory, m_size); }
+        m_memory = MAP_FAILED;
+    }
+};
+
+//============================== SPILL ARENA ==============================//
+
+// An arena for intermediate data that might not fit in RAM. Its memory is a
+// shared mapping of a temporary file, so it's still plain bump allocation,
+// but the kernel can write cold pages back to the file and drop them instead
+// of us getting OOM killed. The file is unlinked from the start (O_TMPFILE)
+// so nothing is left behind if we crash. Without a directory we fall back to
+// a memfd, which can only spill to swap.
+//
+// The hints are where the speed comes from when we go over RAM: tell the
+// kernel when we're about to sweep through a range in order (read-ahead) and
+// when a range we're done with can be paged out first.
+
+struct SpillArena {
+    Arena m_arena;
+    int m_fd;
+
+    SpillArena(bool &valid, const char *dir, size_t capacity)
+        :   m_arena({}),
+            m_fd(-1)
+    {
+        valid = false;
+        if (dir != nullptr) { m_fd = open(dir, O_TMPFILE | O_RDWR, 0600); }
+        if (m_fd < 0) { m_fd = memfd_create("spill_arena", 0); }
+        if (m_fd < 0) return;
+        // Sparse, nothing is allocated on disk until we touch it.
+        if (ftruncate(m_fd, capacity) != 0) return;
+
+        void *memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (memory == MAP_FAILED) return;
+        m_arena = Arena(memory, capacity);
+        valid = true;
+    }
+
+    void* alloc_aligned(size_t bytes, size_t align) { return m_arena.alloc_aligned(bytes, align); }
+
+    void* resize_aligned(void *old_allocation, size_t old_size, size_t new_size, size_t align) {
+        return m_arena.resize_aligned(old_allocation, old_size, new_size, align);
+    }
+
+    void reset() { m_arena.reset(); }
+
+    // madvise wants page boundaries, widen the range out to them.
+    bool advise(const void *start, size_t bytes, int advice) {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (uintptr_t)start & ~(uintptr_t)(page_size - 1);
+        uintptr_t end = forward_align((uintptr_t)start + bytes, page_size);
+        return madvise((void*)begin, end - begin, advice) == 0;
+    }
+
+    // We're about to go through this range front to back: read ahead aggressively
+    // and drop pages behind us early.
+    bool advise_sequential(const void *start, size_t bytes) { return this->advise(start, bytes, MADV_SEQUENTIAL); }
+
+    // Start reading this range back in now, we'll need it soon.
+    bool prefetch(const void *start, size_t bytes) { return this->advise(start, bytes, MADV_WILLNEED); }
+
+    // Done with this range for a while, page it out before anything else.
+    bool page_out(const void *start, size_t bytes) { return this->advise(start, bytes, MADV_COLD); }
+
+    // Give the disk space (and page cache) above the current offset back.
+    bool trim() {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = forward_align(m_arena.offset(), page_size);
+        if (start >= m_arena.capacity()) return true;
+        return fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, m_arena.capacity() - start) == 0;
+    }
+
+    void destroy() {
+        if (m_arena.m_memory != nullptr) { munmap(m_arena.m_memory, m_arena.capacity()); }
+        if (m_fd >= 0) { close(m_fd); }
+        m_arena = {};
+        m_fd = -1;
+    }
+};
+
+//============================== INTRUSIVE CONTAINERS ==============================//
+
+// Containers whose links live inside the elements themselves. The container
+// never allocates: you allocate the element however you like (usually a
+// Pool chunk or an Arena allocation) and the container just threads its links
+// through it, so there's no per-node malloc and one less pointer to chase.
+// An element can be in several containers at once by having several links.
+//
+// Containers find their element from a link using the link's offset within
+// the element, e.g.
+//     struct Order { int price; ListLink link; };
+//     IntrusiveList<Order, offsetof(Order, link)> orders = {};
+
+template <typename T, size_t LinkOffset, typename Link>
+inline T* intrusive_owner(Link *link) {
+    return link == nullptr ? nullptr : (T*)((unsigned char*)link - LinkOffset);
+}
+
+template <typename T, size_t LinkOffset, typename Link>
+inline Link* intrusive_link(T *owner) {
+    return (Link*)((unsigned char*)owner + LinkOffset);
+}
+
+//------------------------------ LIST ------------------------------//
+
+struct ListLink {
+    ListLink *prev;
+    ListLink *next;
+};
+
+// Doubly-linked list. Zero-initialized is empty.
+template <typename T, size_t LinkOffset>
+struct IntrusiveList {
+    ListLink *m_head;
+    ListLink *m_tail;
+    size_t m_size;
+
+    static ListLink* link(T *item) { return intrusive_link<T, LinkOffset, ListLink>(item); }
+    static T* owner(ListLink *link) { return intrusive_owner<T, LinkOffset, ListLink>(link); }
+
+    bool empty() { return m_head == nullptr; }
+    T* front() { return owner(m_head); }
+    T* back() { return owner(m_tail); }
+    T* next(T *item) { return owner(link(item)->next); }
+    T* prev(T *item) { return owner(link(item)->prev); }
+
+    void push_front(T *item) {
+        ListLink *node = link(item);
+        node->prev = nullptr;
+        node->next = m_head;
+        if (m_head != nullptr) { m_head->prev = node; } else { m_tail = node; }
+        m_head = node;
+        m_size++;
+    }
+
+    void push_back(T *item) {
+        ListLink *node = link(item);
+        node->prev = m_tail;
+        node->next = nullptr;
+        if (m_tail != nullptr) { m_tail->next = node; } else { m_head = node; }
+        m_tail = node;
+        m_size++;
+    }
+
+    // Insert `item` right after `position` (which must be in this list).
+    void insert_after(T *position, T *item) {
+        ListLink *at = link(position);
+        ListLink *node = link(item);
+        node->prev = at;
+        node->next = at->next;
+        if (at->next != nullptr) { at->next->prev = node; } else { m_tail = node; }
+        at->next = node;
+        m_size++;
+    }
+
+    // Unlink an item that's in this list. O(1).
+    void remove(T *item) {
+        ListLink *node = link(item);
+        if (node->prev != nullptr) { node->prev->next = node->next; } else { m_head = node->next; }
+        if (node->next != nullptr) { node->next->prev = node->prev; } else { m_tail = node->prev; }
+        node->prev = nullptr;
+        node->next = nullptr;
+        m_size--;
+    }
+
+    T* pop_front() {
+        T *item = this->front();
+        if (item != nullptr) { this->remove(item); }
+        return item;
+    }
+};
+
+//------------------------------ RED-BLACK TREE ------------------------------//
+
+struct RbLink {
+    RbLink *parent;
+    RbLink *left;
+    RbLink *right;
+    bool red;
+};
+
+// Ordered tree. `Compare` provides `static int compare(const T &a, const T &b)`
+// returning <0, 0 or >0. Equal elements are allowed and kept in insertion order.
+// Lookups take a probe element that only needs its key filled in.
+// Zero-initialized is empty.
+template <typename T, size_t LinkOffset, typename Compare>
+struct IntrusiveRbTree {
+    RbLink *m_root;
+    size_t m_size;
+
+    static RbLink* link(const T *item) { return intrusive_link<T, LinkOffset, RbLink>((T*)item); }
+    static T* owner(RbLink *link) { return intrusive_owner<T, LinkOffset, RbLink>(link); }
+
+    bool empty() { return m_root == nullptr; }
+
+    static RbLink* leftmost(RbLink *node) {
+        while (node != nullptr && node->left != nullptr) { node = node->left; }
+        return node;
+    }
+
+    static RbLink* rightmost(RbLink *node) {
+        while (node != nullptr && node->right != nullptr) { node = node->right; }
+        return node;
+    }
+
+    T* first() { return owner(leftmost(m_root)); }
+    T* last() { return owner(rightmost(m_root)); }
+
+    // In-order successor.
+    T* next(T *item) {
+        RbLink *node = link(item);
+        if (node->right != nullptr) { return owner(leftmost(node->right)); }
+        while (node->parent != nullptr && node == node->parent->right) { node = node->parent; }
+        return owner(node->parent);
+    }
+
+    // In-order predecessor.
+    T* prev(T *item) {
+        RbLink *node = link(item);
+        if (node->left != nullptr) { return owner(rightmost(node->left)); }
+        while (node->parent != nullptr && node == node->parent->left) { node = node->parent; }
+        return owner(node->parent);
+    }
+
+    // First element that isn't less than the probe.
+    T* lower_bound(const T &probe) {
+        RbLink *node = m_root;
+        RbLink *result = nullptr;
+        while (node != nullptr) {
+            if (Compare::compare(*owner(node), probe) < 0) {
+                node = node->right;
+            } else {
+                result = node;
+                node = node->left;
+            }
+        }
+        return owner(result);
+    }
+
+    // First element equal to the probe, or null.
+    T* find(const T &probe) {
+        T *item = this->lower_bound(probe);
+        if (item == nullptr || Compare::compare(*item, probe) != 0) return nullptr;
+        return item;
+    }
+
+    void replace_child(RbLink *parent, RbLink *old_child, RbLink *new_child) {
+        if (parent == nullptr) { m_root = new_child; }
+        else if (parent->left == old_child) { parent->left = new_child; }
+        else { parent->right = new_child; }
+    }
+
+    void rotate_left(RbLink *node) {
+        RbLink *pivot = node->right;
+        node->right = pivot->left;
+        if (pivot->left != nullptr) { pivot->left->parent = node; }
+        pivot->parent = node->parent;
+        this->replace_child(node->parent, node, pivot);
+        pivot->left = node;
+        node->parent = pivot;
+    }
+
+    void rotate_right(RbLink *node) {
+        RbLink *pivot = node->left;
+        node->left = pivot->right;
+        if (pivot->right != nullptr) { pivot->right->parent = node; }
+        pivot->parent = node->parent;
+        this->replace_child(node->parent, node, pivot);
+        pivot->right = node;
+        node->parent = pivot;
+    }
+
+    void insert(T *item) {
+        RbLink *node = link(item);
+        RbLink *parent = nullptr;
+        RbLink **slot = &m_root;
+        while (*slot != nullptr) {
+            parent = *slot;
+            // Equal keys go right so they stay in insertion order.
+            slot = Compare::compare(*item, *owner(parent)) < 0 ? &parent->left : &parent->right;
+        }
+        node->parent = parent;
+        node->left = nullptr;
+        node->right = nullptr;
+        node->red = true;
+        *slot = node;
+        m_size++;
+
+        // Fix up any red node with a red parent.
+        while ((parent = node->parent) != nullptr && parent->red) {
+            RbLink *grandparent = parent->parent;
+            if (parent == grandparent->left) {
+                RbLink *uncle = grandparent->right;
+                if (uncle != nullptr && uncle->red) {
+                    parent->red = false;
+                    uncle->red = false;
+                    grandparent->red = true;
+                    node = grandparent;
+                    continue;
+                }
+                if (node == parent->right) {
+                    this->rotate_left(parent);
+                    node = parent;
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                this->rotate_right(grandparent);
+            } else {
+                RbLink *uncle = grandparent->left;
+                if (uncle != nullptr && uncle->red) {
+                    parent->red = false;
+                    uncle->red = false;
+                    grandparent->red = true;
+                    node = grandparent;
+                    continue;
+                }
+                if (node == parent->left) {
+                    this->rotate_right(parent);
+                    node = parent;
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                this->rotate_left(grandparent);
+            }
+        }
+        m_root->red = false;
+    }
+
+    // Unlink an item that's in this tree. O(log n).
+    void remove(T *item) {
+        RbLink *node = link(item);
+        RbLink *child;
+        RbLink *parent;
+        bool removed_red;
+
+        if (node->left == nullptr || node->right == nullptr) {
+            child = node->left != nullptr ? node->left : node->right;
+            parent = node->parent;
+            removed_red = node->red;
+            if (child != nullptr) { child->parent = parent; }
+            this->replace_child(parent, node, child);
+        } else {
+            // Two children: swap the successor into the node's place.
+            RbLink *successor = leftmost(node->right);
+            child = successor->right;
+            removed_red = successor->red;
+            if (successor->parent == node) {
+                parent = successor;
+            } else {
+                parent = successor->parent;
+                parent->left = child;
+                if (child != nullptr) { child->parent = parent; }
+                successor->right = node->right;
+                node->right->parent = successor;
+            }
+            successor->left = node->left;
+            node->left->parent = successor;
+            successor->parent = node->parent;
+            successor->red = node->red;
+            this->replace_child(node->parent, node, successor);
+        }
+        m_size--;
+        node->parent = node->left = node->right = nullptr;
+        if (removed_red) return;
+
+        // We took a black node out of the path through `child`, fix that up.
+        while (child != m_root && (child == nullptr || !child->red)) {
+            if (child == parent->left) {
+                RbLink *sibling = parent->right;
+                if (sibling->red) {
+                    sibling->red = false;
+                    parent->red = true;
+                    this->rotate_left(parent);
+                    sibling = parent->right;
+                }
+                bool left_black = sibling->left == nullptr || !sibling->left->red;
+                bool right_black = sibling->right == nullptr || !sibling->right->red;
+                if (left_black && right_black) {
+                    sibling->red = true;
+                    child = parent;
+                    parent = child->parent;
+                    continue;
+                }
+                if (right_black) {
+                    sibling->left->red = false;
+                    sibling->red = true;
+                    this->rotate_right(sibling);
+                    sibling = parent->right;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->right->red = false;
+                this->rotate_left(parent);
+                child = m_root;
+            } else {
+                RbLink *sibling = parent->left;
+                if (sibling->red) {
+                    sibling->red = false;
+                    parent->red = true;
+                    this->rotate_right(parent);
+                    sibling = parent->left;
+                }
+                bool left_black = sibling->left == nullptr || !sibling->left->red;
+                bool right_black = sibling->right == nullptr || !sibling->right->red;
+                if (left_black && right_black) {
+                    sibling->red = true;
+                    child = parent;
+                    parent = child->parent;
+                    continue;
+                }
+                if (left_black) {
+                    sibling->right->red = false;
+                    sibling->red = true;
+                    this->rotate_left(sibling);
+                    sibling = parent->left;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->left->red = false;
+                this->rotate_right(parent);
+                child = m_root;
+            }
+        }
+        if (child != nullptr) { child->red = false; }
+    }
+};
+
+//------------------------------ SKIP LIST ------------------------------//
+
+// Plenty for ~16 million elements at a branching factor of 4.
+constexpr int SKIP_LIST_MAX_HEIGHT = 12;
+
+// The whole tower lives in the element, so elements are a fixed size and
+// fit nicely in a Pool.
+struct SkipLink {
+    SkipLink *next[SKIP_LIST_MAX_HEIGHT];
+    int height;
+};
+
+// Ordered skip list, same `Compare` as IntrusiveRbTree. Equal elements are
+// allowed. Zero-initialized is empty.
+template <typename T, size_t LinkOffset, typename Compare>
+struct IntrusiveSkipList {
+    SkipLink m_head;
+    int m_height;
+    size_t m_size;
+    uint64_t m_rng;
+
+    static SkipLink* link(const T *item) { return intrusive_link<T, LinkOffset, SkipLink>((T*)item); }
+    static T* owner(SkipLink *link) { return intrusive_owner<T, LinkOffset, SkipLink>(link); }
+
+    bool empty() { return m_head.next[0] == nullptr; }
+    T* first() { return owner(m_head.next[0]); }
+    T* next(T *item) { return owner(link(item)->next[0]); }
+
+    // Each level up is 1/4 as likely as the one below.
+    int random_height() {
+        if (m_rng == 0) { m_rng = 0x9e3779b97f4a7c15ull; }
+        // xorshift64
+        m_rng ^= m_rng << 13;
+        m_rng ^= m_rng >> 7;
+        m_rng ^= m_rng << 17;
+        uint64_t bits = m_rng;
+        int height = 1;
+        while (height < SKIP_LIST_MAX_HEIGHT && (bits & 3) == 0) {
+            height++;
+            bits >>= 2;
+        }
+        return height;
+    }
+
+    // For every level, find the last link whose element is less than the probe.
+    void find_predecessors(const T &probe, SkipLink **preds) {
+        SkipLink *node = &m_head;
+        for (int level = m_height - 1; level >= 0; level--) {
+            while (node->next[level] != nullptr && Compare::compare(*owner(node->next[level]), probe) < 0) {
+                node = node->next[level];
+            }
+            preds[level] = node;
+        }
+    }
+
+    // First element that isn't less than the probe.
+    T* lower_bound(const T &probe) {
+        SkipLink *preds[SKIP_LIST_MAX_HEIGHT];
+        if (m_height == 0) return nullptr;
+        this->find_predecessors(probe, preds);
+        return owner(preds[0]->next[0]);
+    }
+
+    T* find(const T &probe) {
+        T *item = this->lower_bound(probe);
+        if (item == nullptr || Compare::compare(*item, probe) != 0) return nullptr;
+        return item;
+    }
+
+    void insert(T *item) {
+        SkipLink *node = link(item);
+        SkipLink *preds[SKIP_LIST_MAX_HEIGHT];
+        int height = this->random_height();
+        for (int level = m_height; level < height; level++) { preds[level] = &m_head; }
+        if (m_height > 0) { this->find_predecessors(*item, preds); }
+        if (height > m_height) { m_height = height; }
+
+        // Goes in front of equal elements, which keeps insert O(log n) even
+        // with lots of duplicates.
+        node->height = height;
+        for (int level = 0; level < height; level++) {
+            node->next[level] = preds[level]->next[level];
+            preds[level]->next[level] = node;
+        }
+        m_size++;
+    }
+
+    // Unlink an item that's in this list.
+    void remove(T *item) {
+        SkipLink *node = link(item);
+        SkipLink *preds[SKIP_LIST_MAX_HEIGHT];
+        this->find_predecessors(*item, preds);
+        for (int level = 0; level < node->height; level++) {
+            SkipLink *pred = preds[level];
+            // Step over any equal elements in front of ours.
+            while (pred->next[level] != node) { pred = pred->next[level]; }
+            pred->next[level] = node->next[level];
+        }
+        while (m_height > 0 && m_head.next[m_height - 1] == nullptr) { m_height--; }
+        m_size--;
+    }
+};
+
+//============================== B+TREE ==============================//
+
+// A cache-conscious B+tree mapping int32 keys to uint64 values, meant for
+// short-lived sorted indexes. Every node is the same size (a few cache lines)
+// so they all come out of one Pool, and that Pool lives in an Arena: when
+// the request is done, reset the arena and the whole tree is gone without
+// visiting a single node.
+//
+// Searching within a node is a branch-free count of "how many keys are less
+// than this one", four keys at a time with SSE2. Keys sit in their own array
+// (values/children live in a separate array) so a node's keys span as few
+// cache lines as possible.
+//
+// NOTE: remove() doesn't rebalance. Nodes can end up underfull, which is
+// fine for indexes that get thrown away wholesale.
+
+constexpr size_t BTREE_NODE_SIZE = 512;
+constexpr size_t BTREE_NODE_ALIGN = 64;
+constexpr int BTREE_LEAF_KEYS = 40;
+constexpr int BTREE_INNER_KEYS = 40;
+// Deep enough for billions of keys.
+constexpr int BTREE_MAX_HEIGHT = 16;
+
+struct BTreeNode {
+    uint32_t count;
+    uint32_t leaf;
+};
+
+struct BTreeLeaf {
+    BTreeNode node;
+    BTreeLeaf *next;
+    int32_t keys[BTREE_LEAF_KEYS];
+    uint64_t values[BTREE_LEAF_KEYS];
+};
+
+// children[i] holds the keys in [keys[i - 1], keys[i]).
+struct BTreeInner {
+    BTreeNode node;
+    int32_t keys[BTREE_INNER_KEYS];
+    BTreeNode *children[BTREE_INNER_KEYS + 1];
+};
+
+static_assert(sizeof(BTreeLeaf) <= BTREE_NODE_SIZE, "leaf doesn't fit in a node");
+static_assert(sizeof(BTreeInner) <= BTREE_NODE_SIZE, "inner node doesn't fit in a node");
+
+// How many of the first `count` keys are less than `key` (or less than or
+// equal to it, if `inclusive`).
+inline int btree_rank(const int32_t *keys, int count, int32_t key, bool inclusive) {
+    int rank = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i needle = _mm_set1_epi32(key);
+    for (; i + 4 <= count; i += 4) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(keys + i));
+        // inclusive: key >= k, i.e. !(k > key). Otherwise: k < key.
+        int mask = inclusive
+            ? ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(chunk, needle))) & 0xf
+            : _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, chunk)));
+        rank += __builtin_popcount(mask);
+    }
+#endif
+    // The last count % 4 keys one at a time, so we never read past `count`.
+    for (; i < count; i++) {
+        rank += inclusive ? keys[i] <= key : keys[i] < key;
+    }
+    return rank;
+}
+
+// Carve a pool for B+tree nodes out of an arena.
+inline Pool make_btree_pool(bool &valid, Arena &arena, size_t max_nodes) {
+    size_t capacity = max_nodes * BTREE_NODE_SIZE + BTREE_NODE_ALIGN;
+    void *memory = arena.alloc_aligned(capacity, BTREE_NODE_ALIGN);
+    if (memory == nullptr) { capacity = 0; }
+    return Pool(valid, memory, capacity, BTREE_NODE_SIZE, BTREE_NODE_ALIGN);
+}
+
+// Zero-initialize with a node pool, e.g. `BTree tree = { .m_pool = &pool };`
+struct BTree {
+    Pool *m_pool;
+    BTreeNode *m_root;
+    size_t m_size;
+    int m_height;
+
+    BTreeLeaf* find_leaf(int32_t key) {
+        BTreeNode *node = m_root;
+        while (node != nullptr && !node->leaf) {
+            BTreeInner *inner = (BTreeInner*)node;
+            node = inner->children[btree_rank(inner->keys, inner->node.count, key, true)];
+        }
+        return (BTreeLeaf*)node;
+    }
+
+    bool find(int32_t key, uint64_t *value) {
+        BTreeLeaf *leaf = this->find_leaf(key);
+        if (leaf == nullptr) return false;
+        int index = btree_rank(leaf->keys, leaf->node.count, key, false);
+        if (index >= (int)leaf->node.count || leaf->keys[index] != key) return false;
+        if (value != nullptr) { *value = leaf->values[index]; }
+        return true;
+    }
+
+    // Insert a key, or update its value if it's already there.
+    // Returns false if we ran out of nodes.
+    bool insert(int32_t key, uint64_t value) {
+        if (m_root == nullptr) {
+            BTreeLeaf *leaf = (BTreeLeaf*)m_pool->alloc();
+            if (leaf == nullptr) return false;
+            leaf->node.leaf = 1;
+            m_root = &leaf->node;
+            m_height = 1;
+        }
+
+        // Walk down, remembering the way so splits can go back up.
+        BTreeInner *path[BTREE_MAX_HEIGHT];
+        int path_index[BTREE_MAX_HEIGHT];
+        int depth = 0;
+        BTreeNode *node = m_root;
+        while (!node->leaf) {
+            BTreeInner *inner = (BTreeInner*)node;
+            int index = btree_rank(inner->keys, inner->node.count, key, true);
+            path[depth] = inner;
+            path_index[depth] = index;
+            depth++;
+            node = inner->children[index];
+        }
+
+        BTreeLeaf *leaf = (BTreeLeaf*)node;
+        int index = btree_rank(leaf->keys, leaf->node.count, key, false);
+        if (index < (int)leaf->node.count && leaf->keys[index] == key) {
+            leaf->values[index] = value;
+            return true;
+        }
+
+        // Make sure we have enough nodes for the worst case (every level
+        // splits, plus a new root) before touching anything.
+        if (leaf->node.count == BTREE_LEAF_KEYS && !this->can_split(depth + 2)) return false;
+
+        if (leaf->node.count < BTREE_LEAF_KEYS) {
+            this->leaf_insert_at(leaf, index, key, value);
+            m_size++;
+            return true;
+        }
+
+        // Split the leaf in half and push the right half's first key up.
+        BTreeLeaf *right = (BTreeLeaf*)m_pool->alloc();
+        right->node.leaf = 1;
+        int half = BTREE_LEAF_KEYS / 2;
+        right->node.count = BTREE_LEAF_KEYS - half;
+        std::memcpy(right->keys, leaf->keys + half, right->node.count * sizeof(int32_t));
+        std::memcpy(right->values, leaf->values + half, right->node.count * sizeof(uint64_t));
+        leaf->node.count = half;
+        right->next = leaf->next;
+        leaf->next = right;
+        if (index <= half) {
+            this->leaf_insert_at(leaf, index, key, value);
+        } else {
+            this->leaf_insert_at(right, index - half, key, value);
+        }
+        m_size++;
+
+        int32_t separator = right->keys[0];
+        BTreeNode *new_child = &right->node;
+        while (depth > 0) {
+            depth--;
+            BTreeInner *parent = path[depth];
+            int child_index = path_index[depth];
+            if (parent->node.count < BTREE_INNER_KEYS) {
+                this->inner_insert_at(parent, child_index, separator, new_child);
+                return true;
+            }
+
+            // Split the inner node too. The middle key moves up instead of
+            // being copied, inner nodes don't need to keep it.
+            BTreeInner *sibling = (BTreeInner*)m_pool->alloc();
+            int32_t keys[BTREE_INNER_KEYS + 1];
+            BTreeNode *children[BTREE_INNER_KEYS + 2];
+            std::memcpy(keys, parent->keys, child_index * sizeof(int32_t));
+            keys[child_index] = separator;
+            std::memcpy(keys + child_index + 1, parent->keys + child_index, (BTREE_INNER_KEYS - child_index) * sizeof(int32_t));
+            std::memcpy(children, parent->children, (child_index + 1) * sizeof(BTreeNode*));
+            children[child_index + 1] = new_child;
+            std::memcpy(children + child_index + 2, parent->children + child_index + 1, (BTREE_INNER_KEYS - child_index) * sizeof(BTreeNode*));
+
+            int mid = (BTREE_INNER_KEYS + 1) / 2;
+            parent->node.count = mid;
+            std::memcpy(parent->keys, keys, mid * sizeof(int32_t));
+            std::memcpy(parent->children, children, (mid + 1) * sizeof(BTreeNode*));
+            sibling->node.count = BTREE_INNER_KEYS - mid;
+            std::memcpy(sibling->keys, keys + mid + 1, sibling->node.count * sizeof(int32_t));
+            std::memcpy(sibling->children, children + mid + 1, (sibling->node.count + 1) * sizeof(BTreeNode*));
+
+            separator = keys[mid];
+            new_child = &sibling->node;
+        }
+
+        // Split all the way up, grow a new root.
+        BTreeInner *root = (BTreeInner*)m_pool->alloc();
+        root->node.count = 1;
+        root->keys[0] = separator;
+        root->children[0] = m_root;
+        root->children[1] = new_child;
+        m_root = &root->node;
+        m_height++;
+        return true;
+    }
+
+    bool can_split(int nodes_needed) {
+        int free_nodes = (int)m_pool->num_untouched();
+        for (PoolFreeNode *node = m_pool->m_free_list_head; node != nullptr && free_nodes < nodes_needed; node = node->next) {
+            free_nodes++;
+        }
+        return free_nodes >= nodes_needed;
+    }
+
+    void leaf_insert_at(BTreeLeaf *leaf, int index, int32_t key, uint64_t value) {
+        int tail = leaf->node.count - index;
+        std::memmove(leaf->keys + index + 1, leaf->keys + index, tail * sizeof(int32_t));
+        std::memmove(leaf->values + index + 1, leaf->values + index, tail * sizeof(uint64_t));
+        leaf->keys[index] = key;
+        leaf->values[index] = value;
+        leaf->node.count++;
+    }
+
+    // Insert `separator` so that `child` ends up right after children[index].
+    void inner_insert_at(BTreeInner *inner, int index, int32_t separator, BTreeNode *child) {
+        int tail = inner->node.count - index;
+        std::memmove(inner->keys + index + 1, inner->keys + index, tail * sizeof(int32_t));
+        std::memmove(inner->children + index + 2, inner->children + index + 1, tail * sizeof(BTreeNode*));
+        inner->keys[index] = separator;
+        inner->children[index + 1] = child;
+        inner->node.count++;
+    }
+
+    bool remove(int32_t key) {
+        BTreeLeaf *leaf = this->find_leaf(key);
+        if (leaf == nullptr) return false;
+        int index = btree_rank(leaf->keys, leaf->node.count, key, false);
+        if (index >= (int)leaf->node.count || leaf->keys[index] != key) return false;
+        int tail = leaf->node.count - index - 1;
+        std::memmove(leaf->keys + index, leaf->keys + index + 1, tail * sizeof(int32_t));
+        std::memmove(leaf->values + index, leaf->values + index + 1, tail * sizeof(uint64_t));
+        leaf->node.count--;
+        m_size--;
+        return true;
+    }
+
+    // Position of the first key >= `key`, for walking keys in order:
+    //     for (BTree::Cursor it = tree.lower_bound(k); it.valid(); it.next()) ...
+    struct Cursor {
+        BTreeLeaf *leaf;
+        int index;
+
+        bool valid() { return leaf != nullptr; }
+        int32_t key() { return leaf->keys[index]; }
+        uint64_t value() { return leaf->values[index]; }
+
+        void next() {
+            index++;
+            // Skip to the next leaf, and past any leaves remove() emptied.
+            while (leaf != nullptr && index >= (int)leaf->node.count) {
+                leaf = leaf->next;
+                index = 0;
+            }
+        }
+    };
+
+    Cursor lower_bound(int32_t key) {
+        BTreeLeaf *leaf = this->find_leaf(key);
+        if (leaf == nullptr) return { nullptr, 0 };
+        Cursor cursor = { leaf, btree_rank(leaf->keys, leaf->node.count, key, false) - 1 };
+        cursor.next();
+        return cursor;
+    }
+};
+
+//============================== TIMER WHEEL ==============================//
+
+// Hierarchical timing wheel. Time is measured in ticks; whatever a tick means
+// (a millisecond, a frame...) is up to the caller, who calls advance() with
+// the current tick.
+//
+// There are four wheels of 256 slots. The first has a slot per tick, the
+// second a slot per 256 ticks, and so on. A timer goes in the coarsest wheel
+// that can tell its expiry apart from now, and every time a finer wheel wraps
+// around, the next coarser wheel's current slot is emptied back into it
+// ("cascading"). Scheduling and cancelling are O(1), and each timer cascades
+// at most three times before it fires.
+//
+// Timers are allocated from a Pool and link themselves into their slot
+// through an intrusive list, so nothing touches the heap in steady state.
+
+constexpr int TIMER_WHEEL_BITS = 8;
+constexpr int TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS;
+constexpr int TIMER_WHEEL_LEVELS = 4;
+
+struct Timer;
+typedef void (*TimerCallback)(Timer *timer, void *ctx);
+
+struct Timer {
+    uint64_t expires;
+    TimerCallback callback;
+    void *ctx;
+    ListLink link;
+    // Index of the slot we're in, across all levels.
+    uint32_t bucket;
+};
+
+typedef IntrusiveList<Timer, offsetof(Timer, link)> TimerList;
+
+// Zero-initialize with a pool of Timer-sized chunks,
+// e.g. `TimerWheel wheel = { .m_pool = &pool };`
+// It's big (a few tens of KiB), so don't put it on the stack.
+struct TimerWheel {
+    Pool *m_pool;
+    uint64_t m_now;
+    size_t m_count;
+    TimerList m_buckets[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+
+    // Call `callback(timer, ctx)` once `delay` ticks have passed (at least
+    // one). Returns null if the pool is out of timers.
+    // The timer is freed right after its callback returns.
+    Timer* schedule(uint64_t delay, TimerCallback callback, void *ctx) {
+        Timer *timer = (Timer*)m_pool->alloc();
+        if (timer == nullptr) return nullptr;
+        timer->expires = m_now + (delay > 0 ? delay : 1);
+        timer->callback = callback;
+        timer->ctx = ctx;
+        this->add(timer);
+        m_count++;
+        return timer;
+    }
+
+    void cancel(Timer *timer) {
+        m_buckets[timer->bucket].remove(timer);
+        m_pool->free(timer);
+        m_count--;
+    }
+
+    void add(Timer *timer) {
+        uint64_t delta = timer->expires > m_now ? timer->expires - m_now : 0;
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_BITS * (level + 1)) != 0) { level++; }
+
+        // Beyond what the last wheel covers, park it as far out as we can
+        // and let it cascade around until it's in range.
+        uint64_t expires = timer->expires;
+        uint64_t max_delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        if (delta > max_delta) { expires = m_now + max_delta; }
+
+        uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+        timer->bucket = level * TIMER_WHEEL_SLOTS + slot;
+        m_buckets[timer->bucket].push_back(timer);
+    }
+
+    // Move every timer in a coarse slot down to wherever it belongs now.
+    void cascade(int level) {
+        uint32_t slot = (m_now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+        TimerList &bucket = m_buckets[level * TIMER_WHEEL_SLOTS + slot];
+        Timer *timer;
+        while ((timer = bucket.pop_front()) != nullptr) { this->add(timer); }
+    }
+
+    // Run every timer that expires up to and including tick `now`.
+    // Returns how many fired.
+    size_t advance(uint64_t now) {
+        size_t fired = 0;
+        while (m_now < now) {
+            // Nothing scheduled, nothing to walk through.
+            if (m_count == 0) {
+                m_now = now;
+                break;
+            }
+
+            m_now++;
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                if ((m_now & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+                this->cascade(level);
+            }
+
+            TimerList &bucket = m_buckets[m_now & (TIMER_WHEEL_SLOTS - 1)];
+            Timer *timer;
+            while ((timer = bucket.pop_front()) != nullptr) {
+                m_count--;
+                timer->callback(timer, timer->ctx);
+                m_pool->free(timer);
+                fired++;
+            }
+        }
+        return fired;
+    }
+};
+
+//============================== CONCURRENT POOL ==============================//
+
+// A Pool that any number of threads can allocate from and free to at once.
+// The free list is a lock-free (Treiber) stack. To dodge the ABA problem the
+// head holds a chunk _index_ plus a tag that's bumped on every change, packed
+// together into 64 bits so a plain CAS covers both.
+// +--------------+-----------------+
+// | Tag (32 bit) | Index + 1 (32)  |    Index + 1 == 0 means empty
+// +--------------+-----------------+
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+struct ConcurrentPoolFreeNode {
+    uint32_t next; // Index + 1 of the next free chunk, 0 for none
+};
+
+// The lock-free stack itself, over chunks someone else owns. Every operation
+// is handed the chunks' base address and size so the same stack works for a
+// ConcurrentPool's single free list and each stripe of a StripedPool.
+// On its own cache line, every thread using it hammers it.
+struct alignas(CACHE_LINE_SIZE) ConcurrentFreeStack {
+    uint64_t m_head;
+
+    static ConcurrentPoolFreeNode* node(unsigned char *chunks, size_t chunk_size, uint32_t index) {
+        return (ConcurrentPoolFreeNode*)(chunks + (size_t)index * chunk_size);
+    }
+
+    // Returns the popped chunk's index + 1, or 0 if the stack is empty.
+    uint32_t pop(unsigned char *chunks, size_t chunk_size) {
+        uint64_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+        for (;;) {
+            uint32_t index = (uint32_t)head;
+            if (index == 0) { return 0; }
+            ConcurrentPoolFreeNode *node = ConcurrentFreeStack::node(chunks, chunk_size, index - 1);
+            // Someone may pop this node and start using it before our CAS,
+            // in which case this read is garbage but the tag makes the CAS fail.
+            uint32_t next = __atomic_load_n(&node->next, __ATOMIC_RELAXED);
+            uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+            if (__atomic_compare_exchange_n(&m_head, &head, new_head, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                return index;
+            }
+        }
+    }
+
+    void push(unsigned char *chunks, size_t chunk_size, uint32_t index) {
+        ConcurrentPoolFreeNode *node = ConcurrentFreeStack::node(chunks, chunk_size, index);
+        uint64_t head = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+        for (;;) {
+            __atomic_store_n(&node->next, (uint32_t)head, __ATOMIC_RELAXED);
+            uint64_t new_head = ((head >> 32) + 1) << 32 | (index + 1);
+            if (__atomic_compare_exchange_n(&m_head, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+    }
+
+    // NOTE: Not thread-safe. Links chunks [first, last) into the stack,
+    // replacing whatever was on it.
+    void fill(unsigned char *chunks, size_t chunk_size, size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            ConcurrentFreeStack::node(chunks, chunk_size, i)->next = i + 1 < last ? i + 2 : 0;
+        }
+        m_head = first < last ? first + 1 : 0;
+    }
+};
+
+struct ConcurrentPool {
+    unsigned char *m_memory;
+    unsigned char *m_aligned_memory;
+    size_t m_capacity;
+    size_t m_chunk_size;
+    size_t m_num_chunks;
+    ConcurrentFreeStack m_free;
+
+    ConcurrentPool(bool &valid, void *memory, size_t capacity, size_t chunk_size, size_t chunk_align)
+        :   m_memory((unsigned char *)memory),
+            m_capacity(capacity),
+            m_chunk_size(chunk_size),
+            m_free({ 0 })
+    {
+        // Same layout rules as Pool.
+        m_aligned_memory = (unsigned char *)forward_align((uintptr_t)m_memory, chunk_align);
+        m_capacity -= m_aligned_memory - m_memory;
+        m_chunk_size = forward_align(m_chunk_size, chunk_align);
+
+        if (m_chunk_size < sizeof(ConcurrentPoolFreeNode) || m_capacity < m_chunk_size || m_memory == nullptr) {
+            valid = false;
+            return;
+        }
+        m_num_chunks = m_capacity / m_chunk_size;
+        if (m_num_chunks >= UINT32_MAX) { m_num_chunks = UINT32_MAX - 1; }
+
+        this->free_all();
+        valid = true;
+    }
+
+    // NOTE: Not thread-safe, nobody else can be using the pool.
+    void free_all() { m_free.fill(m_aligned_memory, m_chunk_size, 0, m_num_chunks); }
+
+    void* alloc() {
+        uint32_t index = m_free.pop(m_aligned_memory, m_chunk_size);
+        if (index == 0) { return nullptr; }
+        return std::memset(m_aligned_memory + (size_t)(index - 1) * m_chunk_size, 0, m_chunk_size);
+    }
+
+    bool free(void *ptr) {
+        if (ptr == nullptr) { return false; }
+
+        uintptr_t chunk = (uintptr_t)ptr;
+        uintptr_t start = (uintptr_t)m_aligned_memory;
+        if (chunk < start || chunk >= start + m_num_chunks * m_chunk_size) { return false; }
+        m_free.push(m_aligned_memory, m_chunk_size, (uint32_t)((chunk - start) / m_chunk_size));
+        return true;
+    }
+};
+
+//============================== STRIPED POOL ==============================//
+
+// A concurrent pool for a moderate number of threads (8-16 or so) without
+// the memory overhead of per-thread caches. The free list is split into
+// stripes, each its own lock-free stack on its own cache line, and every
+// thread sticks to one stripe. Threads only contend when they share a
+// stripe, or when a thread's stripe runs dry and it steals from the others.
+// Frees go to the freeing thread's stripe, so chunks drift towards the
+// threads that free them and producer/consumer setups end up stealing.
+// +----------+----------+----------+----------+
+// | Stripe 0 | Stripe 1 | Stripe 2 | Stripe 3 |   one cache line each
+// +----------+----------+----------+----------+
+//     ↓ 0..n/4   ↓ n/4..n/2 ...                   chunks to start with
+
+// Threads are numbered in the order they first use any StripedPool and keep
+// their number for good, so with no more threads than stripes nobody shares.
+inline uint32_t striped_pool_thread_index() {
+    static uint32_t next_index = 0;
+    static thread_local uint32_t index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+    return index;
+}
+
+struct StripedPool {
+    unsigned char *m_memory;
+    unsigned char *m_aligned_memory;
+    size_t m_capacity;
+    size_t m_chunk_size;
+    size_t m_num_chunks;
+    ConcurrentFreeStack *m_stripes;
+    size_t m_num_stripes;
+
+    // The stripes come out of `arena`.
+    StripedPool(bool &valid, void *memory, size_t capacity, size_t chunk_size, size_t chunk_align, Arena &arena, size_t num_stripes)
+        :   m_memory((unsigned char *)memory),
+            m_capacity(capacity),
+            m_chunk_size(chunk_size),
+            m_stripes(nullptr),
+            m_num_stripes(num_stripes)
+    {
+        // Same layout rules as Pool.
+        m_aligned_memory = (unsigned char *)forward_align((uintptr_t)m_memory, chunk_align);
+        m_capacity -= m_aligned_memory - m_memory;
+        m_chunk_size = forward_align(m_chunk_size, chunk_align);
+
+        if (m_chunk_size < sizeof(ConcurrentPoolFreeNode) || m_capacity < m_chunk_size || m_memory == nullptr || num_stripes == 0) {
+            valid = false;
+            return;
+        }
+        m_num_chunks = m_capacity / m_chunk_size;
+        if (m_num_chunks >= UINT32_MAX) { m_num_chunks = UINT32_MAX - 1; }
+
+        m_stripes = (ConcurrentFreeStack*)arena.alloc_aligned(num_stripes * sizeof(ConcurrentFreeStack), CACHE_LINE_SIZE);
+        if (m_stripes == nullptr) {
+            valid = false;
+            return;
+        }
+
+        this->free_all();
+        valid = true;
+    }
+
+    size_t home_stripe() { return striped_pool_thread_index() % m_num_stripes; }
+
+    // NOTE: Not thread-safe, nobody else can be using the pool.
+    // Every stripe starts with an equal, contiguous share of the chunks.
+    void free_all() {
+        for (size_t i = 0; i < m_num_stripes; i++) {
+            m_stripes[i].fill(m_aligned_memory, m_chunk_size, i * m_num_chunks / m_num_stripes, (i + 1) * m_num_chunks / m_num_stripes);
+        }
+    }
+
+    void* alloc() {
+        size_t home = this->home_stripe();
+        uint32_t index = m_stripes[home].pop(m_aligned_memory, m_chunk_size);
+        // Our stripe is dry, take one from whoever has some. One at a time,
+        // taking a batch would mean more CASes on someone else's stripe.
+        for (size_t i = 1; index == 0 && i < m_num_stripes; i++) {
+            index = m_stripes[(home + i) % m_num_stripes].pop(m_aligned_memory, m_chunk_size);
+        }
+        if (index == 0) { return nullptr; }
+        return std::memset(m_aligned_memory + (size_t)(index - 1) * m_chunk_size, 0, m_chunk_size);
+    }
+
+    bool free(void *ptr) {
+        if (ptr == nullptr) { return false; }
+
+        uintptr_t chunk = (uintptr_t)ptr;
+        uintptr_t start = (uintptr_t)m_aligned_memory;
+        if (chunk < start || chunk >= start + m_num_chunks * m_chunk_size) { return false; }
+        m_stripes[this->home_stripe()].push(m_aligned_memory, m_chunk_size, (uint32_t)((chunk - start) / m_chunk_size));
+        return true;
+    }
+};
+
+//============================== MPMC QUEUE ==============================//
+
+// Bounded multi-producer/multi-consumer queue of pointers (Dmitry Vyukov's
+// design). Each cell carries a sequence number that says whose turn it is:
+// a producer may fill cell i when its sequence is i, a consumer may empty it
+// when its sequence is i + 1. Producers and consumers only contend with their
+// own kind, each on one counter.
+//
+// Pair it with a ConcurrentPool: producers allocate a message from the pool
+// and enqueue the pointer, consumers dequeue it and free it back to the pool
+// when they're done. No locks and no malloc on either side.
+
+struct MpmcCell {
+    size_t sequence;
+    void *data;
+};
+
+struct MpmcQueue {
+    MpmcCell *m_cells;
+    size_t m_mask;
+    alignas(CACHE_LINE_SIZE) size_t m_enqueue_pos;
+    alignas(CACHE_LINE_SIZE) size_t m_dequeue_pos;
+
+    // `capacity` must be a power of two. The cells come from `arena`.
+    MpmcQueue(bool &valid, Arena &arena, size_t capacity)
+        :   m_cells(nullptr),
+            m_mask(capacity - 1),
+            m_enqueue_pos(0),
+            m_dequeue_pos(0)
+    {
+        valid = false;
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0) return;
+        m_cells = (MpmcCell*)arena.alloc_aligned(capacity * sizeof(MpmcCell), CACHE_LINE_SIZE);
+        if (m_cells == nullptr) return;
+        for (size_t i = 0; i < capacity; i++) { m_cells[i].sequence = i; }
+        valid = true;
+    }
+
+    // Returns false if the queue is full.
+    bool try_enqueue(void *data) {
+        size_t pos = __atomic_load_n(&m_enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+            MpmcCell *cell = &m_cells[pos & m_mask];
+            size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                // Our turn, claim the cell.
+                if (__atomic_compare_exchange_n(&m_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    cell->data = data;
+                    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // Consumer hasn't emptied it from the last lap yet.
+                return false;
+            } else {
+                // Another producer beat us to it.
+                pos = __atomic_load_n(&m_enqueue_pos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Returns null if the queue is empty.
+    void* try_dequeue() {
+        size_t pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+            MpmcCell *cell = &m_cells[pos & m_mask];
+            size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&m_dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    void *data = cell->data;
+                    // Hand the cell to the producer one lap from now.
+                    __atomic_store_n(&cell->sequence, pos + m_mask + 1, __ATOMIC_RELEASE);
+                    return data;
+                }
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Spin (politely) until there's room.
+    void enqueue(void *data) {
+        while (!this->try_enqueue(data)) { std::this_thread::yield(); }
+    }
+
+    // Spin (politely) until there's something to take.
+    void* dequeue() {
+        void *data;
+        while ((data = this->try_dequeue()) == nullptr) { std::this_thread::yield(); }
+        return data;
+    }
+};
+
+//============================== WORK STEALING ==============================//
+
+// Fork/join thread pool. Every worker owns
+//   - a Chase-Lev deque of tasks: the owner pushes and pops at the bottom,
+//     idle workers steal from the top,
+//   - a ConcurrentPool of task objects (a thief that finishes a task frees it
+//     back to the pool it came from, so the pool has to take remote frees),
+//   - a Stack for scratch memory.
+// All of it is carved from one Arena up front. Spawning and running a task
+// never touches the heap.
+//
+// Scratch memory follows the call stack: a task that waits on its children
+// runs other tasks on the same worker in the meantime, and those are nested
+// inside it, so as long as every task frees its scratch before returning the
+// Stack's LIFO order holds.
+
+constexpr size_t TASK_ARGS_SIZE = 96;
+
+struct Worker;
+typedef void (*TaskFn)(Worker &worker, void *args);
+
+struct Task {
+    TaskFn fn;
+    // Decremented when the task is done; whoever spawned it waits on it.
+    uint32_t *counter;
+    ConcurrentPool *pool;
+    alignas(16) unsigned char args[TASK_ARGS_SIZE];
+};
+
+struct TaskDeque {
+    Task **m_buffer;
+    int64_t m_mask;
+    alignas(CACHE_LINE_SIZE) int64_t m_top;
+    alignas(CACHE_LINE_SIZE) int64_t m_bottom;
+
+    // Owner only. Returns false if the deque is full.
+    bool push(Task *task) {
+        int64_t bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED);
+        int64_t top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        if (bottom - top > m_mask) return false;
+        __atomic_store_n(&m_buffer[bottom & m_mask], task, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    // Owner only. Takes the most recently pushed task.
+    Task* pop() {
+        int64_t bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&m_bottom, bottom, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t top = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+        if (top > bottom) {
+            // Empty.
+            __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+        Task *task = __atomic_load_n(&m_buffer[bottom & m_mask], __ATOMIC_RELAXED);
+        if (top == bottom) {
+            // Last one, race the thieves for it.
+            if (!__atomic_compare_exchange_n(&m_top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                task = nullptr;
+            }
+            __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+        return task;
+    }
+
+    // Any thread. Takes the oldest task, null if empty or if we lost a race.
+    Task* steal() {
+        int64_t top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t bottom = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom) return nullptr;
+        Task *task = __atomic_load_n(&m_buffer[top & m_mask], __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&m_top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return nullptr;
+        }
+        return task;
+    }
+};
+
+struct Scheduler;
+
+struct Worker {
+    Scheduler *m_scheduler;
+    uint32_t m_index;
+    uint64_t m_rng;
+    TaskDeque m_deque;
+    ConcurrentPool m_tasks;
+    Stack m_scratch;
+    // Stats, only written by this worker.
+    size_t m_executed;
+    size_t m_stolen;
+
+    Worker(bool &valid, Scheduler *scheduler, uint32_t index, Arena &arena,
+           size_t max_tasks, size_t scratch_size)
+        :   m_scheduler(scheduler),
+            m_index(index),
+            m_rng(0x9e3779b97f4a7c15ull * (index + 1)),
+            m_deque(),
+            m_tasks(valid, arena.alloc_aligned(max_tasks * sizeof(Task), alignof(Task)),
+                    max_tasks * sizeof(Task), sizeof(Task), alignof(Task)),
+            m_scratch(),
+            m_executed(0),
+            m_stolen(0)
+    {
+        if (!valid) return;
+        valid = false;
+        // Deque capacity is the next power of two that fits every task.
+        size_t deque_capacity = 2;
+        while (deque_capacity < max_tasks) { deque_capacity <<= 1; }
+        m_deque.m_buffer = (Task**)arena.alloc_aligned(deque_capacity * sizeof(Task*), CACHE_LINE_SIZE);
+        m_deque.m_mask = deque_capacity - 1;
+        m_scratch.m_memory = (unsigned char*)arena.alloc_aligned(scratch_size, CACHE_LINE_SIZE);
+        m_scratch.m_capacity = scratch_size;
+        if (m_deque.m_buffer == nullptr || m_scratch.m_memory == nullptr) return;
+        valid = true;
+    }
+
+    // Queue `fn` to run with a copy of `args`. `counter` is incremented now
+    // and decremented once the task has run. If we're out of task objects or
+    // deque space the task just runs right here.
+    void spawn(uint32_t *counter, TaskFn fn, const void *args, size_t args_size) {
+        assert(args_size <= TASK_ARGS_SIZE);
+        __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+        Task *task = (Task*)m_tasks.alloc();
+        if (task != nullptr) {
+            task->fn = fn;
+            task->counter = counter;
+            task->pool = &m_tasks;
+            std::memcpy(task->args, args, args_size);
+            if (m_deque.push(task)) return;
+            m_tasks.free(task);
+        }
+
+        alignas(16) unsigned char inline_args[TASK_ARGS_SIZE];
+        std::memcpy(inline_args, args, args_size);
+        fn(*this, inline_args);
+        m_executed++;
+        __atomic_fetch_sub(counter, 1, __ATOMIC_RELEASE);
+    }
+
+    void run(Task *task) {
+        task->fn(*this, task->args);
+        m_executed++;
+        uint32_t *counter = task->counter;
+        task->pool->free(task);
+        __atomic_fetch_sub(counter, 1, __ATOMIC_RELEASE);
+    }
+
+    Task* steal();
+
+    // Grab one task, ours first. Returns false if there was nothing to do.
+    bool run_one() {
+        Task *task = m_deque.pop();
+        if (task == nullptr) {
+            task = this->steal();
+            if (task == nullptr) return false;
+            m_stolen++;
+        }
+        this->run(task);
+        return true;
+    }
+
+    // Help out until everything spawned against `counter` has finished.
+    void wait(uint32_t *counter) {
+        while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != 0) {
+            if (!this->run_one()) { std::this_thread::yield(); }
+        }
+    }
+};
+
+struct Scheduler {
+    Worker **m_workers;
+    std::thread *m_threads;
+    uint32_t m_num_workers;
+    bool m_stop;
+
+    // The calling thread acts as worker 0 during `run`, the other
+    // `num_workers - 1` get their own threads.
+    Scheduler(bool &valid, Arena &arena, uint32_t num_workers, size_t max_tasks_per_worker, size_t scratch_size)
+        :   m_workers(nullptr),
+            m_threads(nullptr),
+            m_num_workers(0),
+            m_stop(false)
+    {
+        valid = false;
+        if (num_workers == 0) return;
+        m_workers = (Worker**)arena.alloc_aligned(num_workers * sizeof(Worker*), alignof(Worker*));
+        if (m_workers == nullptr) return;
+        for (uint32_t i = 0; i < num_workers; i++) {
+            void *memory = arena.alloc_aligned(sizeof(Worker), alignof(Worker));
+            if (memory == nullptr) return;
+            bool worker_is_valid;
+            m_workers[i] = new (memory) Worker(worker_is_valid, this, i, arena, max_tasks_per_worker, scratch_size);
+            if (!worker_is_valid) return;
+        }
+        m_num_workers = num_workers;
+
+        void *threads = arena.alloc_aligned((num_workers - 1) * sizeof(std::thread) + 1, alignof(std::thread));
+        if (threads == nullptr) return;
+        m_threads = (std::thread*)threads;
+        for (uint32_t i = 1; i < num_workers; i++) {
+            new (&m_threads[i - 1]) std::thread(&Scheduler::worker_loop, this, m_workers[i]);
+        }
+        valid = true;
+    }
+
+    void worker_loop(Worker *worker) {
+        uint32_t misses = 0;
+        while (!__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE)) {
+            if (worker->run_one()) {
+                misses = 0;
+            } else if (++misses < 64) {
+                std::this_thread::yield();
+            } else {
+                // Nothing going on, don't burn a core waiting for it.
+                timespec nap = { 0, 50000 };
+                nanosleep(&nap, nullptr);
+            }
+        }
+    }
+
+    // Run `fn` as the root task and return once it and everything it
+    // spawned has finished.
+    void run(TaskFn fn, const void *args, size_t args_size) {
+        uint32_t counter = 0;
+        Worker *worker = m_workers[0];
+        worker->spawn(&counter, fn, args, args_size);
+        worker->wait(&counter);
+    }
+
+    void shutdown() {
+        if (m_threads == nullptr) return;
+        __atomic_store_n(&m_stop, true, __ATOMIC_RELEASE);
+        for (uint32_t i = 1; i < m_num_workers; i++) {
+            m_threads[i - 1].join();
+            m_threads[i - 1].~thread();
+        }
+        m_threads = nullptr;
+    }
+};
+
+inline Task* Worker::steal() {
+    uint32_t num_workers = m_scheduler->m_num_workers;
+    if (num_workers < 2) return nullptr;
+    // Start at a random victim and go around once.
+    m_rng ^= m_rng << 13; m_rng ^= m_rng >> 7; m_rng ^= m_rng << 17;
+    uint32_t start = (uint32_t)(m_rng % num_workers);
+    for (uint32_t i = 0; i < num_workers; i++) {
+        uint32_t victim = (start + i) % num_workers;
+        if (victim == m_index) continue;
+        Task *task = m_scheduler->m_workers[victim]->m_deque.steal();
+        if (task != nullptr) return task;
+    }
+    return nullptr;
+}
+
+//============================== SCAVENGER ==============================//
+
+// Arenas and pools hold on to their high-water mark forever: once a page has
+// been touched it stays resident even after a reset. The Scavenger is a
+// background thread that goes over registered allocators every so often and
+// hands the pages nobody's using back to the OS, so RSS follows the actual
+// load without putting any madvise calls on the allocation path.
+//
+// What counts as unused:
+//   - Arena: everything above the current offset.
+//   - Pool: the chunks at the end of the pool that are all free. They get
+//     pulled off the free list and the pool's bump index is moved down to
+//     them, so nothing lives in their memory anymore. Pages further down
+//     whose chunks all happen to be free are NOT released: the free list
+//     runs through those chunks, and the pool has no way of handing out
+//     chunks above the bump index other than the bump itself. A pool that
+//     gets freed out of order only shrinks as far as its highest live chunk.
+// Both allocators zero memory as they hand it out, so it doesn't matter if
+// the pages come back as zeroes or with old contents.
+//
+// The scavenger never touches an allocator its owner is using. Owners mark
+// their allocator idle when they're done with it for a while and active
+// before they use it again, which waits out a scavenge already in progress:
+//
+//     ACTIVE --mark_idle()--> IDLE --(scavenger)--> SCAVENGING --> IDLE
+//        ^                     |                                     |
+//        +----mark_active()----+-------------------------------------+
+
+enum ScavengeState : uint32_t {
+    SCAVENGE_ACTIVE,
+    SCAVENGE_IDLE,
+    SCAVENGE_SCAVENGING,
+};
+
+enum ScavengeKind : uint32_t {
+    SCAVENGE_ARENA,
+    SCAVENGE_POOL,
+};
+
+struct ScavengeHandle {
+    ScavengeKind kind;
+    void *allocator;
+    uint32_t state;
+    // Set whenever the owner has used the allocator, so the scavenger knows
+    // to look at it again.
+    bool dirty;
+    // Pages in [target, released_from) are still waiting to be released,
+    // everything from released_from up already has been. All page aligned.
+    uintptr_t target;
+    uintptr_t released_from;
+    uintptr_t end;
+    size_t released_bytes;
+    ListLink link;
+
+    void mark_idle() {
+        __atomic_store_n(&state, SCAVENGE_IDLE, __ATOMIC_RELEASE);
+    }
+
+    void mark_active() {
+        uint32_t expected = SCAVENGE_IDLE;
+        while (!__atomic_compare_exchange_n(&state, &expected, SCAVENGE_ACTIVE, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            assert(expected != SCAVENGE_ACTIVE);
+            expected = SCAVENGE_IDLE;
+            std::this_thread::yield();
+        }
+        dirty = true;
+    }
+};
+
+typedef IntrusiveList<ScavengeHandle, offsetof(ScavengeHandle, link)> ScavengeList;
+
+// Move a pool's bump index down over its trailing free chunks and unlink them
+// from the free list. Returns the new end of the live chunks.
+inline uintptr_t pool_trim_tail(Pool &pool) {
+    uintptr_t start = (uintptr_t)pool.m_aligned_memory;
+
+    // Mark which of the chunks in a window just below `low` are free with one
+    // pass over the free list, then move `low` down over the free ones. If
+    // the whole window was free, slide it down and go again.
+    constexpr size_t window = 64 * 1024;
+    uint64_t free_bits[window / 64];
+    size_t low = pool.m_bump;
+    while (low > 0) {
+        size_t base = low > window ? low - window : 0;
+        std::memset(free_bits, 0, sizeof(free_bits));
+        for (PoolFreeNode *node = pool.m_free_list_head; node != nullptr; node = node->next) {
+            size_t index = ((uintptr_t)node - start) / pool.m_chunk_size;
+            if (index >= base && index < low) free_bits[(index - base) / 64] |= 1ull << ((index - base) % 64);
+        }
+        while (low > base && (free_bits[(low - 1 - base) / 64] >> ((low - 1 - base) % 64) & 1)) { low--; }
+        if (low > base) break;
+    }
+
+    if (low < pool.m_bump) {
+        uintptr_t cutoff = start + low * pool.m_chunk_size;
+        PoolFreeNode **link = &pool.m_free_list_head;
+        while (*link != nullptr) {
+            if ((uintptr_t)*link >= cutoff) *link = (*link)->next;
+            else link = &(*link)->next;
+        }
+        pool.m_bump = low;
+    }
+    return start + pool.m_bump * pool.m_chunk_size;
+}
+
+struct Scavenger {
+    ScavengeList m_handles;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::thread m_thread;
+    bool m_running;
+    // How often the thread wakes up, and the most it releases per wakeup so
+    // one pass never holds up owners for long.
+    uint32_t m_interval_ms;
+    size_t m_budget;
+    // MADV_FREE lets the kernel take the pages lazily (cheaper if we end up
+    // reusing them soon), MADV_DONTNEED drops them right away.
+    int m_advice;
+    size_t m_page_size;
+    size_t m_released_bytes;
+    size_t m_passes;
+
+    Scavenger(uint32_t interval_ms, size_t budget, int advice = MADV_FREE)
+        :   m_handles(),
+            m_running(false),
+            m_interval_ms(interval_ms),
+            m_budget(budget),
+            m_advice(advice),
+            m_page_size((size_t)sysconf(_SC_PAGESIZE)),
+            m_released_bytes(0),
+            m_passes(0)
+    {}
+
+    // Registered allocators start out active.
+    void register_arena(ScavengeHandle &handle, Arena &arena) {
+        uintptr_t end = (uintptr_t)arena.m_end;
+        this->register_handle(handle, SCAVENGE_ARENA, &arena, end & ~(uintptr_t)(m_page_size - 1));
+    }
+
+    void register_pool(ScavengeHandle &handle, Pool &pool) {
+        uintptr_t end = (uintptr_t)pool.m_aligned_memory + pool.m_capacity / pool.m_chunk_size * pool.m_chunk_size;
+        this->register_handle(handle, SCAVENGE_POOL, &pool, end & ~(uintptr_t)(m_page_size - 1));
+    }
+
+    void register_handle(ScavengeHandle &handle, ScavengeKind kind, void *allocator, uintptr_t end) {
+        handle.kind = kind;
+        handle.allocator = allocator;
+        handle.state = SCAVENGE_ACTIVE;
+        handle.dirty = true;
+        handle.target = end;
+        handle.released_from = end;
+        handle.end = end;
+        handle.released_bytes = 0;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_handles.push_back(&handle);
+    }
+
+    // Waits out a scavenge in progress, so the allocator can go away after.
+    void unregister(ScavengeHandle &handle) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_handles.remove(&handle);
+    }
+
+    // Work out what an idle allocator doesn't need anymore.
+    void update_target(ScavengeHandle &handle) {
+        uintptr_t live_end;
+        if (handle.kind == SCAVENGE_ARENA) {
+            Arena *arena = (Arena*)handle.allocator;
+            live_end = (uintptr_t)arena->m_current;
+        } else {
+            live_end = pool_trim_tail(*(Pool*)handle.allocator);
+        }
+        // The owner may have touched anything while it was active, so go
+        // over the whole unused range again. release() only counts the pages
+        // that actually came back.
+        handle.target = forward_align(live_end, m_page_size);
+        handle.released_from = handle.end;
+        handle.dirty = false;
+    }
+
+    size_t resident_bytes(uintptr_t start, size_t bytes) {
+        unsigned char vec[1024];
+        size_t resident = 0;
+        while (bytes > 0) {
+            size_t chunk = bytes < sizeof(vec) * m_page_size ? bytes : sizeof(vec) * m_page_size;
+            // If we can't tell, assume it was all there.
+            if (mincore((void*)start, chunk, vec) != 0) return resident + bytes;
+            for (size_t i = 0; i < chunk / m_page_size; i++) { resident += (vec[i] & 1) * m_page_size; }
+            start += chunk;
+            bytes -= chunk;
+        }
+        return resident;
+    }
+
+    // Go over up to `budget` bytes from the top of the handle's unused range.
+    // Returns how much of that was resident and got released.
+    // NOTE: MADV_FREE pages stay resident until the kernel gets around to
+    // reclaiming them, so if the owner goes active and idle again without
+    // touching them they're counted a second time.
+    size_t release(ScavengeHandle &handle, size_t &budget) {
+        if (handle.released_from <= handle.target) return 0;
+        size_t bytes = handle.released_from - handle.target;
+        if (bytes > budget) bytes = budget & ~(m_page_size - 1);
+        if (bytes == 0) return 0;
+        uintptr_t start = handle.released_from - bytes;
+        size_t resident = this->resident_bytes(start, bytes);
+        if (madvise((void*)start, bytes, m_advice) != 0) {
+            // MADV_FREE only works on private anonymous memory.
+            if (m_advice == MADV_DONTNEED || madvise((void*)start, bytes, MADV_DONTNEED) != 0) return 0;
+        }
+        budget -= bytes;
+        handle.released_from = start;
+        handle.released_bytes += resident;
+        return resident;
+    }
+
+    // One pass over every idle allocator. Returns how many bytes were released.
+    size_t scavenge() { return this->scavenge(m_budget); }
+
+    size_t scavenge(size_t budget) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t released = 0;
+        for (ScavengeHandle *handle = m_handles.front(); handle != nullptr && budget >= m_page_size; handle = m_handles.next(handle)) {
+            uint32_t expected = SCAVENGE_IDLE;
+            if (!__atomic_compare_exchange_n(&handle->state, &expected, SCAVENGE_SCAVENGING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            if (handle->dirty) this->update_target(*handle);
+            released += this->release(*handle, budget);
+            __atomic_store_n(&handle->state, SCAVENGE_IDLE, __ATOMIC_RELEASE);
+        }
+        __atomic_fetch_add(&m_released_bytes, released, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&m_passes, 1, __ATOMIC_RELAXED);
+        return released;
+    }
+
+    void start() {
+        m_running = true;
+        m_thread = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_running) {
+                m_wake.wait_for(lock, std::chrono::milliseconds(m_interval_ms));
+                if (!m_running) break;
+                lock.unlock();
+                this->scavenge();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_running) return;
+            m_running = false;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    size_t released_bytes() { return __atomic_load_n(&m_released_bytes, __ATOMIC_RELAXED); }
+};
+
+//============================== MEMORY GOVERNOR ==============================//
+
+// Keeps an eye on how close the process is to its container's memory limit
+// and asks registered allocators to give memory back before the OOM killer
+// shows up. Caches stay warm while there's memory to spare.
+//
+// Two sources, both optional:
+//   - cgroup v2: `memory.current` over `memory.max` is how full we are.
+//   - PSI (/proc/pressure/memory): the share of the last 10s that some or
+//     all tasks spent stalled waiting on memory. This catches pressure even
+//     without a limit, e.g. the whole machine is short on memory.
+// Either one crossing its threshold raises the level, and every shrinker is
+// called with it. Shrinkers free what they can (more for CRITICAL) and
+// report how much that was.
+
+enum ShrinkLevel {
+    SHRINK_NONE,
+    SHRINK_MODERATE,
+    SHRINK_CRITICAL,
+};
+
+typedef size_t (*ShrinkCallback)(void *ctx, ShrinkLevel level);
+
+struct Shrinker {
+    ShrinkCallback callback;
+    void *ctx;
+    ListLink link;
+};
+
+typedef IntrusiveList<Shrinker, offsetof(Shrinker, link)> ShrinkerList;
+
+struct MemoryPressure {
+    // Zero if there's no cgroup limit to go by.
+    size_t current;
+    size_t max;
+    // Percentages, negative if PSI isn't available.
+    double some_avg10;
+    double full_avg10;
+};
+
+constexpr size_t GOVERNOR_PATH_SIZE = 512;
+
+// Read a small text file into `buffer`. Returns false if it's not there.
+inline bool read_small_file(const char *path, char *buffer, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length < 0) return false;
+    buffer[length] = '\0';
+    return true;
+}
+
+// Parse one line of a PSI file, e.g.
+//   some avg10=1.53 avg60=0.87 avg300=0.20 total=3148526
+inline double parse_psi_avg10(const char *text, const char *kind) {
+    const char *line = std::strstr(text, kind);
+    if (line == nullptr) return -1.0;
+    const char *avg10 = std::strstr(line, "avg10=");
+    if (avg10 == nullptr) return -1.0;
+    return strtod(avg10 + 6, nullptr);
+}
+
+struct MemoryGovernor {
+    char m_cgroup_dir[GOVERNOR_PATH_SIZE];
+    char m_psi_path[GOVERNOR_PATH_SIZE];
+    ShrinkerList m_shrinkers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::thread m_thread;
+    bool m_running;
+    uint32_t m_interval_ms;
+
+    // Usage as a fraction of memory.max.
+    double m_moderate_usage;
+    double m_critical_usage;
+    // PSI avg10 percentages.
+    double m_moderate_some;
+    double m_critical_full;
+
+    ShrinkLevel m_last_level;
+    size_t m_shrunk_bytes;
+
+    // `cgroup_dir` is the directory holding memory.current and memory.max,
+    // `psi_path` the pressure file. Null picks the process's own cgroup (from
+    // /proc/self/cgroup) and /proc/pressure/memory, anything else lets tests
+    // point us at files of their own.
+    MemoryGovernor(const char *cgroup_dir = nullptr, const char *psi_path = nullptr)
+        :   m_shrinkers(),
+            m_running(false),
+            m_interval_ms(1000),
+            m_moderate_usage(0.85),
+            m_critical_usage(0.95),
+            m_moderate_some(10.0),
+            m_critical_full(5.0),
+            m_last_level(SHRINK_NONE),
+            m_shrunk_bytes(0)
+    {
+        m_cgroup_dir[0] = '\0';
+        if (cgroup_dir != nullptr) {
+            snprintf(m_cgroup_dir, sizeof(m_cgroup_dir), "%s", cgroup_dir);
+        } else {
+            // The v2 entry is the one with hierarchy 0: "0::/some/path".
+            char text[4096];
+            if (read_small_file("/proc/self/cgroup", text, sizeof(text))) {
+                char *entry = std::strstr(text, "0::");
+                if (entry != nullptr && (entry == text || entry[-1] == '\n')) {
+                    char *path = entry + 3;
+                    char *newline = std::strchr(path, '\n');
+                    if (newline != nullptr) *newline = '\0';
+                    snprintf(m_cgroup_dir, sizeof(m_cgroup_dir), "/sys/fs/cgroup%s", path);
+                }
+            }
+        }
+        snprintf(m_psi_path, sizeof(m_psi_path), "%s", psi_path != nullptr ? psi_path : "/proc/pressure/memory");
+    }
+
+    void register_shrinker(Shrinker &shrinker) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shrinkers.push_back(&shrinker);
+    }
+
+    void unregister_shrinker(Shrinker &shrinker) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shrinkers.remove(&shrinker);
+    }
+
+    MemoryPressure sample() {
+        MemoryPressure pressure = { 0, 0, -1.0, -1.0 };
+        char path[GOVERNOR_PATH_SIZE + 32];
+        char text[256];
+
+        snprintf(path, sizeof(path), "%s/memory.max", m_cgroup_dir);
+        // "max" means no limit, which strtoull turns into 0 for us.
+        if (m_cgroup_dir[0] != '\0' && read_small_file(path, text, sizeof(text))) {
+            pressure.max = (size_t)strtoull(text, nullptr, 10);
+            snprintf(path, sizeof(path), "%s/memory.current", m_cgroup_dir);
+            if (pressure.max != 0 && read_small_file(path, text, sizeof(text))) {
+                pressure.current = (size_t)strtoull(text, nullptr, 10);
+            } else {
+                pressure.max = 0;
+            }
+        }
+
+        if (read_small_file(m_psi_path, text, sizeof(text))) {
+            pressure.some_avg10 = parse_psi_avg10(text, "some");
+            pressure.full_avg10 = parse_psi_avg10(text, "full");
+        }
+        return pressure;
+    }
+
+    ShrinkLevel evaluate(const MemoryPressure &pressure) {
+        double usage = pressure.max != 0 ? (double)pressure.current / (double)pressure.max : 0.0;
+        if (usage >= m_critical_usage || pressure.full_avg10 >= m_critical_full) return SHRINK_CRITICAL;
+        if (usage >= m_moderate_usage || pressure.some_avg10 >= m_moderate_some) return SHRINK_MODERATE;
+        return SHRINK_NONE;
+    }
+
+    // Check the pressure once and shrink if needed. Returns how many bytes
+    // the shrinkers gave back.
+    size_t poll() {
+        ShrinkLevel level = this->evaluate(this->sample());
+        __atomic_store_n(&m_last_level, level, __ATOMIC_RELAXED);
+        if (level == SHRINK_NONE) return 0;
+        return this->shrink(level);
+    }
+
+    size_t shrink(ShrinkLevel level) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t shrunk = 0;
+        for (Shrinker *shrinker = m_shrinkers.front(); shrinker != nullptr; shrinker = m_shrinkers.next(shrinker)) {
+            shrunk += shrinker->callback(shrinker->ctx, level);
+        }
+        __atomic_fetch_add(&m_shrunk_bytes, shrunk, __ATOMIC_RELAXED);
+        return shrunk;
+    }
+
+    void start(uint32_t interval_ms) {
+        m_interval_ms = interval_ms;
+        m_running = true;
+        m_thread = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_running) {
+                m_wake.wait_for(lock, std::chrono::milliseconds(m_interval_ms));
+                if (!m_running) break;
+                lock.unlock();
+                this->poll();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_running) return;
+            m_running = false;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+};
+
+// Shrinker for a Scavenger: release idle allocators' memory right away, with
+// no budget when it's critical.
+inline size_t scavenger_shrink(void *ctx, ShrinkLevel level) {
+    Scavenger *scavenger = (Scavenger*)ctx;
+    return scavenger->scavenge(level == SHRINK_CRITICAL ? SIZE_MAX : scavenger->m_budget);
+}
+
+//============================== FIXED REGIONS ==============================//
+
+// Backing memory at the same addresses every run. With ASLR, malloc'd and
+// mmap'd buffers land somewhere new each time, so alignment padding, how many
+// pool chunks fit, and which cache sets everything maps to all shift around
+// between runs. That's noise in any A/B comparison.
+//
+// Regions are handed out one after another from a fixed base address, each
+// starting on a `region_align` boundary, and the returned pointer sits at a
+// chosen offset into its first page. Same sequence of calls, same addresses.
+// MAP_FIXED_NOREPLACE makes sure we never clobber an existing mapping; if the
+// address is taken the map just fails.
+// +----------------+-----+------------------+-----+----------------+
+// | Region 0       | gap | Region 1         | gap | Region 2       |
+// +----------------+-----+------------------+-----+----------------+
+// ↑ base                  ↑ base + n * region_align
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// Far away from where the heap, the executable and (default) mmaps live.
+constexpr uintptr_t FIXED_REGION_DEFAULT_BASE = 0x100000000000ull;
+constexpr size_t FIXED_REGION_DEFAULT_ALIGN = 2 << 20;
+
+struct FixedRegionProvider {
+    uintptr_t m_base;
+    uintptr_t m_next;
+    size_t m_region_align;
+    size_t m_page_size;
+
+    FixedRegionProvider(uintptr_t base = FIXED_REGION_DEFAULT_BASE, size_t region_align = FIXED_REGION_DEFAULT_ALIGN)
+        :   m_base(base),
+            m_next(base),
+            m_region_align(region_align),
+            m_page_size((size_t)sysconf(_SC_PAGESIZE))
+    {
+        assert(is_power_of_two(region_align) && region_align >= m_page_size);
+    }
+
+    size_t mapping_size(size_t bytes, size_t page_offset) {
+        return forward_align(page_offset + bytes, m_page_size);
+    }
+
+    // Map `bytes` of zeroed memory, returning a pointer `page_offset` bytes
+    // into the region's first page. Returns null if the address is taken.
+    void* map(size_t bytes, size_t page_offset = 0) {
+        assert(page_offset < m_page_size);
+        if (bytes == 0) return nullptr;
+        size_t size = this->mapping_size(bytes, page_offset);
+        void *addr = mmap((void*)m_next, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (addr == MAP_FAILED) return nullptr;
+        // Kernels before 4.17 don't know the flag and treat the address as a hint.
+        if ((uintptr_t)addr != m_next) {
+            munmap(addr, size);
+            return nullptr;
+        }
+        // Leave at least a page unmapped after every region so overruns fault.
+        m_next = forward_align(m_next + size + m_page_size, m_region_align);
+        return (unsigned char*)addr + page_offset;
+    }
+
+    void unmap(void *memory, size_t bytes, size_t page_offset = 0) {
+        if (memory == nullptr) return;
+        munmap((unsigned char*)memory - page_offset, this->mapping_size(bytes, page_offset));
+    }
+
+    // Start handing out addresses from the base again. Everything mapped so
+    // far should be unmapped first or the next maps will fail.
+    void reset() { m_next = m_base; }
+};
+
+#endif // ALLOCATORS_H
@@ -1,319 +1,10 @@
-#include <cassert>
-#include <cstddef>
-#include <cstdint>
-#include <cstdlib>
-#include <cstdio>
-#include <cstring>
-
-inline bool is_power_of_two(uint64_t x) { return ~(x & (x - 1)); }
-
-// Get the next address >= the `base` address aligned to `align` boundary.
-inline uintptr_t forward_align(uintptr_t base, size_t align) {
-    assert(is_power_of_two(align));
-    size_t padding = align - base & (align - 1);
-    return base + padding;
-}
-
-//============================== ARENA ==============================//
-
-struct Arena {
-    unsigned char* m_memory;
-    size_t m_prev_offset;
-    size_t m_offset;
-    size_t m_capacity;
-
-    // Try to allocate some amount of memory with the given alignment.
-    void* alloc_aligned(size_t bytes, size_t align) {
-        if (bytes == 0) return nullptr;
-
-        uintptr_t base_addr = (uintptr_t)m_memory + m_offset;
-        uintptr_t aligned_addr = forward_align(base_addr, align);
-        size_t aligned_offset = aligned_addr - (uintptr_t)m_memory;
-        size_t next_offset = aligned_offset + bytes;
-        if (next_offset > m_capacity) { return nullptr; }
-
-        m_prev_offset = m_offset;
-        m_offset = next_offset;
-        return std::memset((void*)aligned_addr, 0, bytes);
-    }
-
-    // Given an older allocation from the arena, attempt to resize it.
-    // NOTE: This does NOT support changing the _alignment_ of an allocation.
-    void* resize_aligned(void* old_allocation, size_t old_size, size_t new_size, size_t align) {
-        assert(is_power_of_two(align));
-        unsigned char* old_alloc = (unsigned char*)old_allocation;
-        if (old_alloc == nullptr || old_size == 0) return nullptr;
-        if (old_alloc < m_memory || old_alloc > m_memory + m_capacity) return nullptr;
-
-        // Was this the last thing we allocated from the arena?
-        if (m_memory + m_prev_offset == old_alloc) {
-            m_offset = m_prev_offset + new_size;
-            if (new_size > old_size) {
-                // Zero new memory
-                std::memset(m_memory + m_offset, 0, new_size - old_size);
-            }
-            return old_alloc;
-        } else {
-            // If not, allocate new mem from the arena and copy the old data to it.
-            void* new_alloc = this->alloc_aligned(new_size, align);
-            if (new_alloc == nullptr) return nullptr;
-            size_t copy_size = old_size < new_size ? old_size : new_size;
-            std::memmove(new_alloc, old_alloc, copy_size);
-            return new_alloc;
-        }
-    }
-
-    void reset() { m_offset = 0; }
-};
-
-//============================== STACK ==============================//
-
-// This is what our stack memory block looks like.
-// We ensure that there's enough padding between allocations to do two things:
-// 1) Properly align the next allocation to a user-supplied alignment (power of two).
-// 2) Store a header within the padding between allocations.
-// The header stores information that allows us to set our offset back to the start
-// of a previous allocation, in effect freeing memory of the most recent allocations.
-// +----------------+---------+------+----------------+------+
-// | Old Allocation | Padding |Header| New Allocation | Free |
-// +----------------+---------+------+----------------+------+
-//                  ↑                                 ↑
-//          Previous Offset                    Current Offset
-
-// Headers placed within the padding used to align data in our stack.
-// I get the feeling that making the headers essentially a doubly-linked list
-// might not have been the right way to go about things...
-struct StackAllocationHeader {
-    // Num bytes we need to put before the header such that a new allocation can
-    // be properly aligned.
-    size_t padding;
-    size_t prev_offset;
-    StackAllocationHeader *prev_header;
-    StackAllocationHeader *next_header;
-};
-
-// Max alignment bytes = 2^(8 * sizeof(padding) - 1)
-constexpr size_t STACK_MAX_ALIGN = (size_t)1 << (8 * sizeof(StackAllocationHeader::padding) - 1);
-
-// Calculate the amount of padding we need to both
-// A) align our pointer to an `align` byte boundary, and
-// B) fit a header of size `header_size` bytes in the padding.
-size_t calc_padding_with_header(uintptr_t base, size_t align, size_t header_size) {
-    assert(is_power_of_two(align));
-    size_t padding = align - base & (align - 1);
-
-    // If we can't fit our header into the padding we need to bump our
-    // padding up to the next aligned boundary that _can_ fit our header.
-    if (header_size > padding) {
-        size_t space_needed = header_size - padding;
-        // Is the additional space we need to store our header a multiple
-        // of our desired alignment?
-        if ((space_needed & (align - 1)) != 0) {
-            padding += align * (1 + space_needed / align);
-        } else {
-            padding += space_needed;
-        }
-    }
-
-    return padding;
-}
-
-struct Stack {
-    unsigned char* m_memory;
-    size_t m_capacity;
-    size_t m_offset;
-    size_t m_prev_offset;
-    StackAllocationHeader *m_prev_header;
-
-    // Try to allocate some amount of memory with the given alignment.
-    void* alloc_aligned(size_t alloc_size, size_t align) {
-        assert(is_power_of_two(align));
-        // Max align bytes = 2^(8 * sizeof(padding) - 1)
-        // For one byte:
-        if (align > STACK_MAX_ALIGN) { align = STACK_MAX_ALIGN; }
-        uintptr_t base_addr = (uintptr_t)m_memory + m_offset;
-        size_t padding = calc_padding_with_header(base_addr, align, sizeof(StackAllocationHeader));
-        // Check if we're out of memory
-        if (m_offset + alloc_size + padding > m_capacity) { return nullptr; }
-        m_prev_offset = m_offset;
-        m_offset += padding;
-
-        uintptr_t next_aligned_addr = base_addr + padding;
-        StackAllocationHeader* header = (StackAllocationHeader*)(next_aligned_addr - sizeof(StackAllocationHeader));
-        header->padding = (uint8_t)padding;
-        header->prev_header = m_prev_header;
-        header->prev_offset = m_prev_offset;
-        if (m_prev_header != nullptr) {
-            m_prev_header->next_header = header;
-        }
-        m_prev_header = header;
-        m_offset += alloc_size;
-
-        return std::memset((void*)next_aligned_addr, 0, alloc_size);
-    }
-
-    // Given an allocation, free to the start of the previous allocation.
-    // Returns whether the operation was successful.
-    bool free(void* alloc) {
-        if (alloc == nullptr) return false;
-
-        uintptr_t start = (uintptr_t)m_memory;
-        uintptr_t end = start + m_capacity;
-        uintptr_t curr_addr = (uintptr_t)alloc;
-        // Ensure that we're in the bounds of our memory.
-        // Should probably assert here.
-        if (curr_addr < start || curr_addr > end) { return false; }
-        // Allow double-frees
-        if (curr_addr >= start + m_offset) { return false; }
-
-        StackAllocationHeader* header = (StackAllocationHeader*)(curr_addr - sizeof(StackAllocationHeader));
-        // Protect against out-of-order frees
-        if (m_prev_offset != header->prev_offset) { return false; }
-
-        m_offset = m_prev_offset;
-        if (header->prev_header != nullptr) {
-            m_prev_offset = header->prev_header->prev_offset;
-            m_prev_header = header->prev_header;
-        } else {
-            m_prev_offset = 0;
-            m_prev_header = nullptr;
-        }
-
-        return true;
-    }
-
-    // NOTE: This does NOT support changing the _alignment_ of an allocation.
-    void* resize_aligned(void* old_allocation, size_t old_size, size_t new_size, size_t align) {
-        if (old_allocation == nullptr) { return this->alloc_aligned(new_size, align); }
-        if (new_size == 0) {
-            this->free(old_allocation);
-            return nullptr;
-        }
-
-        uintptr_t old_alloc = (uintptr_t)old_allocation;
-        uintptr_t start = (uintptr_t)m_memory;
-        uintptr_t end = start + m_capacity;
-        if (old_alloc < start || old_alloc > end) { return nullptr; }
-        if (old_alloc >= start + m_offset) { return nullptr; }
-
-        StackAllocationHeader* header = (StackAllocationHeader*)(old_alloc - sizeof(StackAllocationHeader));
-
-        // Was this the most recent thing we allocated?
-        if (header == m_prev_header) {
-            if (new_size > old_size) {
-                std::memset((void*)(old_alloc + old_size), 0, new_size);
-            }
-            m_offset = (old_alloc - start) + new_size;
-            return old_allocation;
-        }
-
-        // Is the user trying to resize a non-top block of memory that was
-        // already resized (see below note)?
-        if (header->prev_header == nullptr && header->next_header == nullptr) {
-            return nullptr;
-        }
-
-        uintptr_t resized_alloc = (uintptr_t)this->alloc_aligned(new_size, align);
-        size_t min_size = old_size < new_size ? old_size : new_size;
-        std::memmove((void*)resized_alloc, old_allocation, min_size);
-
-        // Treat this block of memory as if it doesn't exist such that when
-        // the user attempts to free the _next_ block, we free to the
-        // previous offset before _this_ block. This allows the user to
-        // discard the old pointer they were using if they attempted to
-        // resize a non-top allocation.
-        // In short, we're basically making this block of memory invisible
-        // to our stack allocator and treating the next block of memory as
-        // if it just has a lot more padding than usual.
-        //
-        // TODO Actually is this good? Maybe this is confusing from a user
-        // perspective. Now the user has to ensure that they _don't_ use
-        // the old allocation again. Need to think on this.
-        header->next_header->padding += header->padding;
-        header->next_header->prev_offset = header->prev_offset;
-        header->next_header->prev_header = header->prev_header;
-        header->prev_header->next_header = header->next_header;
-        header->prev_header = nullptr;
-        header->next_header = nullptr;
-
-        return (void*)resized_alloc;
-    }
-
-    void reset() {
-        m_offset = 0;
-        m_prev_offset = 0;
-        m_prev_header = nullptr;
-    }
-};
-
-//============================== POOL ==============================//
-
-struct PoolFreeNode {
-    PoolFreeNode *next;
-};
-
-struct Pool {
-    unsigned char *m_memory;
-    unsigned char *m_aligned_memory;
-    PoolFreeNode *m_free_list_head;
-    size_t m_capacity;
-    size_t m_chunk_size;
-
-    Pool(bool &valid, void *memory, size_t capacity, size_t chunk_size, size_t chunk_align)
-        :   m_memory((unsigned char *)memory),
-            m_capacity(capacity),
-            m_chunk_size(chunk_size),
-            m_free_list_head(nullptr)
-    {
-        // chunks need to start at the right alignment
-        m_aligned_memory = (unsigned char *)forward_align((uintptr_t)m_memory, chunk_align);
-        m_capacity -= m_aligned_memory - m_memory;
-        // chunk size should be a multiple of chunk alignment
-        m_chunk_size = forward_align(m_chunk_size, chunk_align);
-
-        // We need to be able to store metadata for free nodes in free chunks.
-        // Obviously we need to enough capacity to store at least one chunk.
-        if (chunk_size < sizeof(PoolFreeNode) || m_capacity < m_chunk_size) {
-            valid = false;
-            return;
-        }
+#include <deque>
+#include <future>
+#include <map>
+#include <malloc.h>
+#include <linux/perf_event.h>
 
-        this->free_all();
-        valid = true;
-    }
-
-    void free_all() {
-        size_t num_chunks = m_capacity / m_chunk_size;
-        for (size_t i = 0; i < num_chunks; i++) {
-            void *chunk = &m_aligned_memory[i * m_chunk_size];
-            PoolFreeNode *node = (PoolFreeNode *)chunk;
-            node->next = m_free_list_head;
-            m_free_list_head = node;
-        }
-    }
-
-    bool free(void *ptr) {
-        if (ptr == nullptr) { return false; }
-
-        uintptr_t chunk = (uintptr_t)ptr;
-        uintptr_t start = (uintptr_t)m_aligned_memory;
-        uintptr_t end = start + m_capacity;
-        if (chunk < start || chunk > end) { return false; }
-
-        PoolFreeNode *node = (PoolFreeNode *)chunk;
-        node->next = m_free_list_head;
-        m_free_list_head = node;
-        return true;
-    }
-
-    void* alloc() {
-        PoolFreeNode *node = m_free_list_head;
-        if (node == nullptr) { return nullptr; }
-        // pop from free list
-        m_free_list_head = m_free_list_head->next;
-        return memset(node, 0, m_chunk_size);
-    }
-};
+#include "allocators.h"
 
 ///////////////////////////////////////////////////////////////////////
 //============================== TESTS ==============================//
@@ -361,7 +52,7 @@ TEST test_forward_align() {
 TEST test_arena() {
     size_t arena_size = 8;
     unsigned char memory[arena_size];
-    Arena arena = { .m_memory = memory, .m_capacity = arena_size };
+    Arena arena(memory, arena_size);
     void* alloc;
 
     // Test general allocations
@@ -490,6 +181,78 @@ TEST test_stack() {
     TEST_END
 }
 
+TEST test_stack_large_align() {
+    size_t page_size = 4096;
+    size_t stack_size = 4 * page_size;
+    unsigned char* buf = (unsigned char*)std::aligned_alloc(page_size, stack_size);
+    Stack stack = { .m_memory = buf, .m_capacity = stack_size };
+    void *alloc_a, *alloc_b;
+
+    // Test: page alignment with more than 255 bytes of padding
+    alloc_a = stack.alloc_aligned(16, 8);
+    alloc_b = stack.alloc_aligned(100, page_size);
+    TEST_ASSERT(alloc_b == buf + page_size);
+    // Padding is big enough for the header, no need to detach it
+    TEST_ASSERT(stack.m_detached_size == 0);
+    TEST_ASSERT(stack.free(alloc_b));
+    TEST_ASSERT(stack.m_offset == 16 + sizeof(StackAllocationHeader));
+    TEST_ASSERT(stack.free(alloc_a));
+    TEST_ASSERT(stack.m_offset == 0);
+
+    // Test: no alignment unit is burned when there's no room for a header
+    alloc_a = stack.alloc_aligned(page_size, page_size);
+    TEST_ASSERT(alloc_a == buf);
+    TEST_ASSERT(stack.m_detached_size == sizeof(StackAllocationHeader));
+    TEST_ASSERT((unsigned char*)stack.m_prev_header >= buf + stack_size - stack.m_detached_size);
+    alloc_b = stack.alloc_aligned(page_size, page_size);
+    TEST_ASSERT(alloc_b == buf + page_size);
+    TEST_ASSERT(stack.m_detached_size == 2 * sizeof(StackAllocationHeader));
+
+    // Test: detached headers are popped when freeing
+    TEST_ASSERT(!stack.free(alloc_a));
+    TEST_ASSERT(stack.free(alloc_b));
+    TEST_ASSERT(stack.m_detached_size == sizeof(StackAllocationHeader));
+    TEST_ASSERT(stack.free(alloc_a));
+    TEST_ASSERT(stack.m_detached_size == 0);
+    TEST_ASSERT(stack.m_offset == 0);
+
+    // Test: allocations can't run into detached headers
+    TEST_ASSERT(stack.alloc_aligned(stack_size, page_size) == nullptr);
+    alloc_a = stack.alloc_aligned(3 * page_size, page_size);
+    TEST_ASSERT(alloc_a != nullptr);
+    TEST_ASSERT(stack.resize_aligned(alloc_a, 3 * page_size, stack_size, page_size) == nullptr);
+    TEST_ASSERT(stack.resize_aligned(alloc_a, 3 * page_size, stack_size - page_size / 2, page_size) == alloc_a);
+    stack.reset();
+    TEST_ASSERT(stack.m_detached_size == 0);
+
+    // Test: resizing a non-top page-aligned alloc
+    alloc_a = stack.alloc_aligned(64, page_size);
+    alloc_b = stack.alloc_aligned(64, page_size);
+    std::memcpy(alloc_a, "hello67", 8);
+    void* alloc_c = stack.resize_aligned(alloc_a, 64, 128, page_size);
+    TEST_ASSERT(alloc_c != nullptr);
+    TEST_ASSERT(((uintptr_t)alloc_c & (page_size - 1)) == 0);
+    TEST_ASSERT(std::strcmp((const char*)alloc_c, "hello67") == 0);
+    TEST_ASSERT(stack.free(alloc_c));
+    TEST_ASSERT(stack.free(alloc_b));
+    TEST_ASSERT(stack.m_offset == 0);
+    TEST_ASSERT(stack.m_detached_size == 0);
+    std::free(buf);
+
+    // Test: huge page alignment
+    size_t huge_page_size = 2 * 1024 * 1024;
+    buf = (unsigned char*)std::aligned_alloc(huge_page_size, 2 * huge_page_size);
+    stack = { .m_memory = buf, .m_capacity = 2 * huge_page_size };
+    TEST_ASSERT(stack.alloc_aligned(1, 1) != nullptr);
+    alloc_a = stack.alloc_aligned(64, huge_page_size);
+    TEST_ASSERT(alloc_a == buf + huge_page_size);
+    TEST_ASSERT(stack.free(alloc_a));
+    TEST_ASSERT(stack.m_offset == 1 + sizeof(StackAllocationHeader));
+    std::free(buf);
+
+    TEST_END
+}
+
 int get_num_free_pool_chunks(Pool &pool) {
     int num_free = 0;
     for (PoolFreeNode *curr = pool.m_free_list_head; curr != nullptr; curr = curr->next) {
@@ -547,15 +310,4108 @@ TEST test_pool() {
     TEST_END
 }
 
-///////////////////////////////////////////////////////////////////////////
-//============================== END TESTS ==============================//
-///////////////////////////////////////////////////////////////////////////
+TEST test_tlab() {
+    size_t arena_size = 4096;
+    unsigned char* memory = (unsigned char*)std::malloc(arena_size);
+    Arena shared(memory, arena_size);
+    Tlab tlab = { .m_shared = &shared, .m_block_size = 256 };
+
+    // Test: first allocation grabs a block from the shared arena
+    void* alloc = tlab.alloc_aligned(8, 8);
+    TEST_ASSERT(alloc != nullptr);
+    TEST_ASSERT(((uintptr_t)alloc & 7) == 0);
+    TEST_ASSERT(tlab.m_block != nullptr);
+    TEST_ASSERT(((uintptr_t)tlab.m_block & (TLAB_BLOCK_ALIGN - 1)) == 0);
+    size_t shared_offset = shared.offset();
+
+    // Test: more allocations come out of the block, not the shared arena
+    TEST_ASSERT(tlab.alloc_aligned(64, 16) != nullptr);
+    TEST_ASSERT(shared.offset() == shared_offset);
+
+    // Test: exhausting the block grabs a new one
+    unsigned char* old_block = tlab.m_block;
+    TEST_ASSERT(tlab.alloc_aligned(100, 8) != nullptr);
+    TEST_ASSERT(tlab.alloc_aligned(100, 8) != nullptr);
+    TEST_ASSERT(tlab.m_block != old_block);
+    TEST_ASSERT(shared.offset() > shared_offset);
+
+    // Test: big allocations bypass the block
+    old_block = tlab.m_block;
+    TEST_ASSERT(tlab.alloc_aligned(1024, 8) != nullptr);
+    TEST_ASSERT(tlab.m_block == old_block);
+
+    // Test: mem is zeroed
+    tlab.reset();
+    shared.reset();
+    *(uint64_t*)tlab.alloc_aligned(8, 8) = ~0ull;
+    tlab.reset();
+    shared.reset();
+    TEST_ASSERT(*(uint64_t*)tlab.alloc_aligned(8, 8) == 0);
+
+    // Test: running the shared arena out of space fails gracefully
+    TEST_ASSERT(tlab.alloc_aligned(arena_size, 8) == nullptr);
+    tlab.reset();
+    shared.reset();
+
+    // Test: several threads appending into one arena don't step on each other
+    constexpr int num_threads = 4;
+    constexpr int allocs_per_thread = 64;
+    uint32_t* allocs[num_threads][allocs_per_thread] = {};
+    std::thread threads[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        threads[t] = std::thread([&shared, &allocs, t]() {
+            Tlab local = { .m_shared = &shared, .m_block_size = 128 };
+            for (int i = 0; i < allocs_per_thread; i++) {
+                uint32_t* alloc = (uint32_t*)local.alloc_aligned(sizeof(uint32_t), alignof(uint32_t));
+                if (alloc != nullptr) { *alloc = t * allocs_per_thread + i; }
+                allocs[t][i] = alloc;
+            }
+        });
+    }
+    for (int t = 0; t < num_threads; t++) { threads[t].join(); }
+    for (int t = 0; t < num_threads; t++) {
+        for (int i = 0; i < allocs_per_thread; i++) {
+            TEST_ASSERT(allocs[t][i] != nullptr);
+            TEST_ASSERT((unsigned char*)allocs[t][i] >= memory);
+            TEST_ASSERT((unsigned char*)allocs[t][i] < memory + shared.offset());
+            TEST_ASSERT(*allocs[t][i] == (uint32_t)(t * allocs_per_thread + i));
+        }
+    }
+
+    std::free(memory);
+    TEST_END
+}
+
+struct PromoteTestNode {
+    int value;
+    PromoteTestNode *next;
+};
+
+struct PromoteGraphNode {
+    int value;
+    PromoteGraphNode *next;
+    PromoteGraphNode *other;
+    int *outside;
+};
+
+void promote_test_visit(ChildPromotion &promotion, void *object, void *ctx) {
+    PromoteGraphNode *node = (PromoteGraphNode*)object;
+    promotion.relocate((void**)&node->next, sizeof(PromoteGraphNode), alignof(PromoteGraphNode));
+    promotion.relocate((void**)&node->other, sizeof(PromoteGraphNode), alignof(PromoteGraphNode));
+    (*(int*)ctx)++;
+}
+
+TEST test_child_arena() {
+    size_t parent_size = 1024;
+    unsigned char memory[parent_size];
+    Arena parent(memory, parent_size);
+    ChildArena child = { .m_parent = &parent, .m_block_size = 128 };
+
+    // Test: child allocations come from the top of the parent
+    void* alloc = child.alloc_aligned(16, 8);
+    TEST_ASSERT(alloc != nullptr);
+    TEST_ASSERT(((uintptr_t)alloc & 7) == 0);
+    TEST_ASSERT(child.owns(alloc));
+    TEST_ASSERT(parent.capacity() <= parent_size - 128);
+    TEST_ASSERT((unsigned char*)alloc >= memory + parent.capacity());
+
+    // Test: parent can keep allocating from the bottom while the child is alive
+    void* parent_alloc = parent.alloc_aligned(16, 8);
+    TEST_ASSERT(parent_alloc != nullptr);
+    TEST_ASSERT(!child.owns(parent_alloc));
+
+    // Test: child takes more blocks once the first one is used up
+    ChildArenaBlock *first_block = child.m_block;
+    TEST_ASSERT(child.alloc_aligned(100, 8) != nullptr);
+    TEST_ASSERT(child.m_block != first_block);
+    TEST_ASSERT(child.m_block->prev == first_block);
+
+    // Test: allocations bigger than a block get a block of their own
+    TEST_ASSERT(child.alloc_aligned(256, 8) != nullptr);
+
+    // Test: child can't eat into the parent's used memory
+    TEST_ASSERT(child.alloc_aligned(parent_size, 8) == nullptr);
+
+    // Test: reset gives every block back to the parent
+    child.reset();
+    TEST_ASSERT(child.m_block == nullptr);
+    TEST_ASSERT(parent.capacity() == parent_size);
+    parent.reset();
+
+    // Test: promoting a linked list out of the child
+    PromoteTestNode *head = nullptr;
+    for (int i = 0; i < 4; i++) {
+        PromoteTestNode *node = (PromoteTestNode*)child.alloc_aligned(sizeof(PromoteTestNode), alignof(PromoteTestNode));
+        node->value = i;
+        node->next = head;
+        head = node;
+    }
+    PromoteTestNode *promoted_head = nullptr;
+    PromoteTestNode **link = &promoted_head;
+    for (PromoteTestNode *node = head; node != nullptr; node = node->next) {
+        TEST_ASSERT(child.owns(node));
+        PromoteTestNode *promoted = (PromoteTestNode*)child.promote(node, sizeof(PromoteTestNode), alignof(PromoteTestNode));
+        TEST_ASSERT(promoted != nullptr);
+        TEST_ASSERT(!child.owns(promoted));
+        *link = promoted;
+        link = &promoted->next;
+    }
+    *link = nullptr;
+    child.reset();
+    // Scribble over where the child used to live to prove we don't depend on it
+    std::memset(memory + parent.offset(), 0xff, parent.capacity() - parent.offset());
+    int expected = 3;
+    for (PromoteTestNode *node = promoted_head; node != nullptr; node = node->next) {
+        TEST_ASSERT(node->value == expected);
+        expected--;
+    }
+    TEST_ASSERT(expected == -1);
+    parent.reset();
+
+    // Test: promoting a graph with a cycle, a shared node, garbage, and a
+    // pointer into the parent. A ring of 5 nodes that all point at node 0,
+    // with unreachable nodes in between so the ring spans several blocks.
+    {
+        size_t graph_parent_size = 8192;
+        unsigned char graph_memory[graph_parent_size];
+        Arena graph_parent(graph_memory, graph_parent_size);
+        ChildArena graph_child = { .m_parent = &graph_parent, .m_block_size = 128 };
+        int *outside = (int*)graph_parent.alloc_aligned(sizeof(int), alignof(int));
+        *outside = 42;
+        PromoteGraphNode *ring[5];
+        for (int i = 0; i < 5; i++) {
+            ring[i] = (PromoteGraphNode*)graph_child.alloc_aligned(sizeof(PromoteGraphNode), alignof(PromoteGraphNode));
+            TEST_ASSERT(ring[i] != nullptr);
+            ring[i]->value = i;
+            ring[i]->outside = nullptr;
+            for (int j = 0; j < 4; j++) {
+                TEST_ASSERT(graph_child.alloc_aligned(sizeof(PromoteGraphNode), alignof(PromoteGraphNode)) != nullptr);
+            }
+        }
+        for (int i = 0; i < 5; i++) {
+            ring[i]->next = ring[(i + 1) % 5];
+            ring[i]->other = ring[0];
+        }
+        ring[3]->outside = outside;
+        int num_visited = 0;
+        ChildPromotion promotion = { .m_child = &graph_child, .m_visit = promote_test_visit, .m_ctx = &num_visited };
+        PromoteGraphNode *root = ring[2];
+        TEST_ASSERT(promotion.relocate((void**)&root, sizeof(PromoteGraphNode), alignof(PromoteGraphNode)));
+        TEST_ASSERT(promotion.finish());
+        TEST_ASSERT(promotion.m_count == 5 && num_visited == 5);
+        TEST_ASSERT(!graph_child.owns(root));
+        graph_child.reset();
+        std::memset(graph_memory + graph_parent.offset(), 0xff, graph_parent.capacity() - graph_parent.offset());
+        PromoteGraphNode *node = root;
+        for (int i = 0; i < 5; i++) {
+            TEST_ASSERT(node->value == (2 + i) % 5);
+            TEST_ASSERT(node->other->value == 0);
+            TEST_ASSERT(node->other == root->next->next->next);
+            TEST_ASSERT(node->outside == (node->value == 3 ? outside : nullptr));
+            node = node->next;
+        }
+        TEST_ASSERT(node == root);
+        TEST_ASSERT(*root->next->outside == 42);
+    }
+
+    // Test: nested children (grandchild borrows from a child's allocation)
+    void* child_memory = child.alloc_aligned(256, 16);
+    Arena child_region((unsigned char*)child_memory, 256);
+    ChildArena grandchild = { .m_parent = &child_region, .m_block_size = 64 };
+    TEST_ASSERT(grandchild.alloc_aligned(8, 8) != nullptr);
+    TEST_ASSERT(child_region.capacity() < 256);
+    grandchild.reset();
+    TEST_ASSERT(child_region.capacity() == 256);
+    child.reset();
+
+    TEST_END
+}
+
+TEST test_arena_split() {
+    size_t arena_size = 4096;
+    unsigned char* memory = (unsigned char*)std::malloc(arena_size);
+    Arena parent(memory, arena_size);
+    constexpr size_t num_subs = 4;
+    Arena subs[num_subs];
+
+    // Test: equal split covers the remaining space without overlap
+    parent.alloc_aligned(100, 8);
+    size_t offset_before_split = parent.offset();
+    TEST_ASSERT(arena_split(parent, subs, num_subs, nullptr, 64));
+    for (size_t i = 0; i < num_subs; i++) {
+        TEST_ASSERT(((uintptr_t)subs[i].m_memory & 63) == 0);
+        TEST_ASSERT(subs[i].m_memory >= memory + offset_before_split);
+        TEST_ASSERT(subs[i].m_memory + subs[i].capacity() <= memory + arena_size);
+        TEST_ASSERT(subs[i].capacity() == subs[0].capacity());
+        if (i > 0) { TEST_ASSERT(subs[i].m_memory >= subs[i - 1].m_memory + subs[i - 1].capacity()); }
+    }
+
+    // Test: parent can't allocate while split
+    TEST_ASSERT(parent.alloc_aligned(1, 1) == nullptr);
+
+    // Test: workers fill their sub-arenas in parallel
+    std::thread threads[num_subs];
+    for (size_t t = 0; t < num_subs; t++) {
+        threads[t] = std::thread([&subs, t]() {
+            for (uint32_t i = 0; i < t + 1; i++) {
+                *(uint32_t*)subs[t].alloc_aligned(sizeof(uint32_t), alignof(uint32_t)) = t;
+            }
+        });
+    }
+    for (size_t t = 0; t < num_subs; t++) { threads[t].join(); }
+
+    // Test: merge moves the parent past the highest used byte
+    uint32_t* last_result = (uint32_t*)(subs[num_subs - 1].m_memory);
+    arena_merge(parent, subs, num_subs);
+    TEST_ASSERT(memory + parent.offset() == subs[num_subs - 1].m_memory + subs[num_subs - 1].offset());
+    TEST_ASSERT(*last_result == num_subs - 1);
+    TEST_ASSERT(parent.alloc_aligned(8, 8) != nullptr);
+    parent.reset();
+
+    // Test: merging untouched sub-arenas gives the parent its space back
+    TEST_ASSERT(arena_split(parent, subs, num_subs, nullptr, 64));
+    arena_merge(parent, subs, num_subs);
+    TEST_ASSERT(parent.offset() < 64);
+    parent.reset();
+
+    // Test: weighted split
+    size_t weights[num_subs] = { 1, 1, 2, 4 };
+    TEST_ASSERT(arena_split(parent, subs, num_subs, weights, 16));
+    // (give or take rounding)
+    TEST_ASSERT(subs[2].capacity() - 2 * subs[0].capacity() + 2 <= 4);
+    TEST_ASSERT(subs[3].capacity() - 4 * subs[0].capacity() + 4 <= 8);
+
+    // Test: compacting merge packs results back to back
+    for (size_t t = 0; t < num_subs; t++) {
+        *(uint64_t*)subs[t].alloc_aligned(sizeof(uint64_t), 8) = t;
+    }
+    unsigned char* bases[num_subs];
+    arena_merge_compact(parent, subs, num_subs, 16, bases);
+    for (size_t t = 0; t < num_subs; t++) {
+        TEST_ASSERT(((uintptr_t)bases[t] & 15) == 0);
+        TEST_ASSERT(*(uint64_t*)bases[t] == t);
+    }
+    TEST_ASSERT(parent.offset() <= num_subs * 16);
+    parent.reset();
+
+    // Test: can't split into more pieces than there is room for
+    TEST_ASSERT(!arena_split(parent, subs, num_subs, nullptr, 2048));
+    TEST_ASSERT(!arena_split(parent, subs, 0, nullptr, 64));
+
+    std::free(memory);
+    TEST_END
+}
+
+struct GcTestNode {
+    int value;
+    GcTestNode *left;
+    GcTestNode *right;
+};
+
+const size_t gc_test_node_refs[] = { offsetof(GcTestNode, left), offsetof(GcTestNode, right) };
+const GcType gc_test_node_type = { sizeof(GcTestNode), 2, gc_test_node_refs };
+
+TEST test_semispace() {
+    size_t space_size = 1024;
+    alignas(GC_ALIGN) unsigned char space_a[space_size];
+    alignas(GC_ALIGN) unsigned char space_b[space_size];
+    Semispace heap = {
+        .m_spaces = {
+            Arena(space_a, space_size),
+            Arena(space_b, space_size),
+        },
+    };
+
+    // Test: allocations are zeroed, aligned and typed
+    GcTestNode *root = (GcTestNode*)heap.alloc(&gc_test_node_type);
+    TEST_ASSERT(root != nullptr);
+    TEST_ASSERT(((uintptr_t)root & (GC_ALIGN - 1)) == 0);
+    TEST_ASSERT(root->value == 0 && root->left == nullptr && root->right == nullptr);
+    TEST_ASSERT(((GcHeader*)root - 1)->type == &gc_test_node_type);
+
+    // Build a small live graph with a cycle and a shared node
+    root->value = 1;
+    root->left = (GcTestNode*)heap.alloc(&gc_test_node_type);
+    root->left->value = 2;
+    root->right = (GcTestNode*)heap.alloc(&gc_test_node_type);
+    root->right->value = 3;
+    root->left->right = root->right; // shared
+    root->right->left = root; // cycle
+    GcTestNode external = { .value = 4 };
+    root->left->left = &external;
+
+    // Test: without roots registered, alloc just fails when full
+    while (heap.alloc(&gc_test_node_type) != nullptr) {}
+    TEST_ASSERT(heap.m_collections == 0);
+
+    // Test: collection keeps the live graph intact and reclaims garbage
+    void **roots[] = { (void**)&root };
+    size_t used_before = heap.m_spaces[heap.m_active].offset();
+    TEST_ASSERT(heap.collect(roots, 1));
+    TEST_ASSERT(heap.m_collections == 1);
+    Arena &space = heap.m_spaces[heap.m_active];
+    TEST_ASSERT(space.offset() == 3 * (sizeof(GcHeader) + forward_align(sizeof(GcTestNode), GC_ALIGN)));
+    TEST_ASSERT(space.offset() < used_before);
+    TEST_ASSERT(heap.in_space(space, root));
+    TEST_ASSERT(root->value == 1);
+    TEST_ASSERT(root->left->value == 2);
+    TEST_ASSERT(root->right->value == 3);
+    TEST_ASSERT(root->left->right == root->right);
+    TEST_ASSERT(root->right->left == root);
+    TEST_ASSERT(root->left->left == &external);
+
+    // Test: with roots registered, alloc collects by itself
+    heap.m_roots = roots;
+    heap.m_num_roots = 1;
+    for (int i = 0; i < 200; i++) {
+        GcTestNode *garbage = (GcTestNode*)heap.alloc(&gc_test_node_type);
+        TEST_ASSERT(garbage != nullptr);
+        garbage->value = -1;
+    }
+    TEST_ASSERT(heap.m_collections > 1);
+    TEST_ASSERT(root->value == 1 && root->left->value == 2 && root->right->value == 3);
+    TEST_ASSERT(root->right->left == root);
+
+    // Test: alloc fails once the live set fills the whole space
+    for (;;) {
+        GcTestNode *node = (GcTestNode*)heap.alloc(&gc_test_node_type);
+        if (node == nullptr) break;
+        node->right = root->right;
+        root->right = node;
+    }
+    TEST_ASSERT(root->value == 1);
+
+    TEST_END
+}
+
+TEST test_direct_io() {
+    char path[] = "/tmp/alloc_direct_io_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    unlink(path);
+
+    // Test: alignment requirements are sane powers of two
+    DirectIoAlignment alignment;
+    bool supported = query_direct_io_alignment(fd, alignment);
+    if (supported) {
+        TEST_ASSERT(alignment.mem_align > 0 && (alignment.mem_align & (alignment.mem_align - 1)) == 0);
+        TEST_ASSERT(alignment.offset_align > 0 && (alignment.offset_align & (alignment.offset_align - 1)) == 0);
+    }
+    alignment = { .mem_align = 512, .offset_align = 4096 };
+
+    // Test: sizes get rounded up to the offset alignment
+    TEST_ASSERT(direct_io_size(1, alignment) == 4096);
+    TEST_ASSERT(direct_io_size(4096, alignment) == 4096);
+    TEST_ASSERT(direct_io_size(4097, alignment) == 8192);
+
+    // Test: arena buffers are aligned and rounded up
+    size_t arena_size = 4 * 4096;
+    unsigned char* memory = (unsigned char*)std::malloc(arena_size);
+    Arena arena(memory, arena_size);
+    arena.alloc_aligned(1, 1);
+    size_t size = 0;
+    void* buffer = alloc_direct_io_buffer(arena, 100, alignment, &size);
+    TEST_ASSERT(buffer != nullptr);
+    TEST_ASSERT(((uintptr_t)buffer & 511) == 0);
+    TEST_ASSERT(size == 4096);
+    TEST_ASSERT(alloc_direct_io_buffer(arena, arena_size, alignment, nullptr) == nullptr);
+
+    // Test: pool buffers are aligned and sized to block multiples
+    bool pool_is_valid;
+    Pool pool = make_direct_io_pool(pool_is_valid, memory, arena_size, 100, alignment);
+    TEST_ASSERT(pool_is_valid);
+    TEST_ASSERT(pool.m_chunk_size == 4096);
+    void* chunk = pool.alloc();
+    TEST_ASSERT(chunk != nullptr);
+    TEST_ASSERT(((uintptr_t)chunk & 4095) == 0);
+
+    // Test: an O_DIRECT read into one of our buffers works (if the filesystem supports it)
+    if (supported) {
+        unsigned char block[8192];
+        std::memset(block, 'x', sizeof(block));
+        TEST_ASSERT(write(fd, block, sizeof(block)) == (ssize_t)sizeof(block));
+        char fd_path[64];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        int direct_fd = open(fd_path, O_RDONLY | O_DIRECT);
+        if (direct_fd >= 0) {
+            TEST_ASSERT(query_direct_io_alignment(direct_fd, alignment));
+            arena.reset();
+            buffer = alloc_direct_io_buffer(arena, 8192, alignment, &size);
+            TEST_ASSERT(buffer != nullptr);
+            TEST_ASSERT(pread(direct_fd, buffer, size, 0) == 8192);
+            TEST_ASSERT(((unsigned char*)buffer)[8191] == 'x');
+            close(direct_fd);
+        }
+    }
+
+    std::free(memory);
+    close(fd);
+    TEST_END
+}
+
+TEST test_io_buffer_pool() {
+    bool ring_is_valid;
+    IoUring ring(ring_is_valid, 8);
+    // Nothing to test if io_uring is unavailable (old kernel, seccomp...)
+    if (!ring_is_valid) {
+        ring.destroy();
+        TEST_END
+    }
+
+    size_t buffer_size = 4096;
+    size_t pool_size = 9 * buffer_size;
+    unsigned char* memory = (unsigned char*)std::malloc(pool_size);
+    bool pool_is_valid;
+    IoBufferPool pool(pool_is_valid, ring, memory, pool_size, buffer_size, 4096);
+    TEST_ASSERT(pool_is_valid);
+    TEST_ASSERT(pool.num_buffers() == 8);
+    TEST_ASSERT(pool.register_buffers() == 0);
+
+    // Test: WRITE_FIXED then READ_FIXED round trip through a file
+    char path[] = "/tmp/alloc_io_uring_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    unlink(path);
+    unsigned char *out = (unsigned char*)pool.alloc();
+    unsigned char *in = (unsigned char*)pool.alloc();
+    std::memset(out, 'z', buffer_size);
+    io_uring_sqe *sqe = ring.get_sqe();
+    TEST_ASSERT(sqe != nullptr);
+    pool.prep_write_fixed(sqe, fd, out, buffer_size, 0);
+    sqe->user_data = 1;
+    TEST_ASSERT(ring.submit(1) == 1);
+    io_uring_cqe *cqe = ring.wait_cqe();
+    TEST_ASSERT(cqe != nullptr);
+    TEST_ASSERT(cqe->user_data == 1);
+    TEST_ASSERT(cqe->res == (int)buffer_size);
+    ring.cqe_seen();
+
+    sqe = ring.get_sqe();
+    pool.prep_read_fixed(sqe, fd, in, buffer_size, 0);
+    sqe->user_data = 2;
+    TEST_ASSERT(ring.submit(1) == 1);
+    cqe = ring.wait_cqe();
+    TEST_ASSERT(cqe->user_data == 2);
+    TEST_ASSERT(cqe->res == (int)buffer_size);
+    ring.cqe_seen();
+    TEST_ASSERT(std::memcmp(in, out, buffer_size) == 0);
+    pool.free(in);
+    pool.free(out);
+    close(fd);
+
+    // Test: multishot receive into kernel-picked buffers from the pool
+    unsigned char ring_memory[2 * 4096];
+    Arena ring_arena(ring_memory, sizeof(ring_memory));
+    int ret = pool.register_buf_ring(ring_arena, 4, 7);
+    // Provided buffer rings need Linux 5.19+
+    if (ret == 0) {
+        TEST_ASSERT(pool.provide_from_pool(4) == 4);
+        TEST_ASSERT(get_num_free_pool_chunks(pool.m_pool) == 4);
+
+        int sockets[2];
+        TEST_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+        sqe = ring.get_sqe();
+        pool.prep_recv_multishot(sqe, sockets[0]);
+        sqe->user_data = 3;
+        TEST_ASSERT(ring.submit(0) == 1);
+
+        const char *messages[] = { "one", "two", "three" };
+        for (int i = 0; i < 3; i++) {
+            TEST_ASSERT(write(sockets[1], messages[i], std::strlen(messages[i])) == (ssize_t)std::strlen(messages[i]));
+            cqe = ring.wait_cqe();
+            TEST_ASSERT(cqe->user_data == 3);
+            // Multishot recv needs Linux 6.0+
+            if (cqe->res == -EINVAL) { ring.cqe_seen(); break; }
+            TEST_ASSERT(cqe->res == (int)std::strlen(messages[i]));
+            TEST_ASSERT(cqe->flags & IORING_CQE_F_MORE);
+            unsigned char *buffer = (unsigned char*)pool.cqe_buffer(cqe);
+            TEST_ASSERT(buffer >= pool.m_pool.m_aligned_memory);
+            TEST_ASSERT(buffer < pool.m_pool.m_aligned_memory + pool.num_buffers() * buffer_size);
+            TEST_ASSERT(std::memcmp(buffer, messages[i], cqe->res) == 0);
+            ring.cqe_seen();
+            pool.provide(buffer);
+        }
+        close(sockets[1]);
+        close(sockets[0]);
+    }
+
+    ring.destroy();
+    std::free(memory);
+    TEST_END
+}
+
+TEST test_scatter_gather() {
+    size_t parent_size = 64 * 1024;
+    unsigned char* memory = (unsigned char*)std::malloc(parent_size);
+    Arena parent(memory, parent_size);
+    ChildArena child = { .m_parent = &parent, .m_block_size = 256 };
+    iovec iovecs[8];
+
+    // Test: empty arena has nothing to write
+    ChildArenaBlock *cursor = child.m_first_block;
+    TEST_ASSERT(child.to_iovecs(iovecs, 8, cursor) == 0);
+
+    // Serialize a byte stream that spills over lots of blocks
+    size_t stream_size = 0;
+    for (int i = 0; i < 200; i++) {
+        unsigned char* record = (unsigned char*)child.alloc_aligned(100, 1);
+        TEST_ASSERT(record != nullptr);
+        for (int j = 0; j < 100; j++) { record[j] = (unsigned char)(stream_size + j); }
+        stream_size += 100;
+    }
+    size_t num_blocks = child.num_blocks();
+    TEST_ASSERT(num_blocks > SCATTER_GATHER_BATCH);
+
+    // Test: iovecs come out oldest block first
+    cursor = child.m_first_block;
+    TEST_ASSERT(child.to_iovecs(iovecs, 8, cursor) == 8);
+    TEST_ASSERT(((unsigned char*)iovecs[0].iov_base)[0] == 0);
+    TEST_ASSERT(((unsigned char*)iovecs[1].iov_base)[0] == (unsigned char)iovecs[0].iov_len);
+    // Test: the cursor picks up where the last batch left off, in order,
+    // until every block has been described
+    size_t described_blocks = 8;
+    size_t described_bytes = 0;
+    for (size_t i = 0; i < 8; i++) { described_bytes += iovecs[i].iov_len; }
+    while (size_t count = child.to_iovecs(iovecs, 8, cursor)) {
+        TEST_ASSERT(((unsigned char*)iovecs[0].iov_base)[0] == (unsigned char)described_bytes);
+        for (size_t i = 0; i < count; i++) { described_bytes += iovecs[i].iov_len; }
+        described_blocks += count;
+    }
+    TEST_ASSERT(described_blocks == num_blocks && described_bytes == stream_size);
+    TEST_ASSERT(cursor == nullptr);
+    TEST_ASSERT(child.to_iovecs(iovecs, 8, cursor) == 0);
+
+    // Test: writing the blocks produces the stream in order
+    char path[] = "/tmp/alloc_scatter_gather_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    unlink(path);
+    TEST_ASSERT(write_arena_blocks(fd, child, -1, 0) == (ssize_t)stream_size);
+    // Test: explicit offsets work too
+    TEST_ASSERT(write_arena_blocks(fd, child, stream_size, 0) == (ssize_t)stream_size);
+
+    unsigned char* readback = (unsigned char*)std::malloc(2 * stream_size);
+    TEST_ASSERT(pread(fd, readback, 2 * stream_size, 0) == (ssize_t)(2 * stream_size));
+    for (size_t i = 0; i < 2 * stream_size; i++) {
+        TEST_ASSERT(readback[i] == (unsigned char)(i % stream_size));
+    }
+
+    // Test: bad fd reports the error
+    TEST_ASSERT(write_arena_blocks(-1, child, -1, 0) == -EBADF);
+
+    close(fd);
+    std::free(readback);
+    std::free(memory);
+    TEST_END
+}
+
+struct FlatTestFill {
+    double price;
+    uint32_t quantity;
+};
+
+struct FlatTestTrader {
+    uint32_t id;
+    FlatRef<FlatString> name;
+};
+
+struct FlatTestOrder {
+    uint64_t id;
+    FlatRef<FlatString> symbol;
+    FlatRef<FlatVector<FlatTestFill>> fills;
+    FlatRef<FlatTestTrader> trader;
+    FlatRef<FlatVector<uint8_t>> flags;
+};
+
+TEST test_flat_buffers() {
+    size_t arena_size = 4096;
+    alignas(FLAT_ALIGN) unsigned char memory[arena_size];
+    Arena arena(memory, arena_size);
+    FlatBuilder builder = { .m_arena = &arena };
+
+    // Build a message straight into the arena
+    TEST_ASSERT(builder.begin());
+    FlatRef<FlatTestOrder> order_ref;
+    FlatTestOrder *order = builder.add_table(order_ref);
+    TEST_ASSERT(order != nullptr);
+    order->id = 42;
+    order->symbol = builder.add_string("ACME", 4);
+    FlatTestFill *fills = builder.add_vector(order->fills, 3);
+    TEST_ASSERT(fills != nullptr);
+    for (int i = 0; i < 3; i++) { fills[i] = { .price = 10.5 + i, .quantity = (uint32_t)(100 * (i + 1)) }; }
+    FlatTestTrader *trader = builder.add_table(order->trader);
+    trader->id = 7;
+    trader->name = builder.add_string("wile e.", 7);
+    size_t message_size = builder.finish(order_ref);
+
+    // Test: the message is exactly the arena's used bytes
+    TEST_ASSERT(message_size == arena.offset());
+    TEST_ASSERT(builder.m_base == memory);
+
+    // Test: write it out, map it back in and read it in place
+    char path[] = "/tmp/alloc_flat_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT(write(fd, memory, message_size) == (ssize_t)message_size);
+    close(fd);
+    alignas(FLAT_ALIGN) unsigned char corrupt[arena_size];
+    std::memcpy(corrupt, memory, message_size);
+    // Trash the arena to make sure the reader doesn't depend on it
+    std::memset(memory, 0xff, arena_size);
+
+    FlatFile file;
+    FlatReader reader;
+    TEST_ASSERT(file.open(path, reader));
+    unlink(path);
+    const FlatTestOrder *read_order = reader.root<FlatTestOrder>();
+    TEST_ASSERT(read_order != nullptr);
+    TEST_ASSERT(read_order->id == 42);
+    size_t length;
+    const char *symbol = reader.string(read_order->symbol, &length);
+    TEST_ASSERT(length == 4 && std::strcmp(symbol, "ACME") == 0);
+    size_t count;
+    const FlatTestFill *read_fills = reader.vector(read_order->fills, &count);
+    TEST_ASSERT(count == 3);
+    TEST_ASSERT(read_fills[2].price == 12.5 && read_fills[2].quantity == 300);
+    const FlatTestTrader *read_trader = reader.get(read_order->trader);
+    TEST_ASSERT(read_trader->id == 7);
+    TEST_ASSERT(std::strcmp(reader.string(read_trader->name, nullptr), "wile e.") == 0);
+    // Test: unset references read as null
+    TEST_ASSERT(reader.vector(read_order->flags, &count) == nullptr);
+
+    // Test: corrupt references are rejected instead of read out of bounds
+    TEST_ASSERT(reader.get(FlatRef<FlatTestTrader> { (uint32_t)message_size }) == nullptr);
+    TEST_ASSERT(reader.get(FlatRef<FlatTestTrader> { 0xfffffff0 }) == nullptr);
+    TEST_ASSERT(reader.get(FlatRef<FlatTestTrader> { 17 }) == nullptr);
+    FlatRef<FlatString> symbol_ref = read_order->symbol;
+    file.close();
+
+    // Test: a string that lost its terminator is rejected instead of read
+    // past the end as a C string
+    FlatReader corrupt_reader;
+    TEST_ASSERT(corrupt_reader.open(corrupt, message_size));
+    TEST_ASSERT(corrupt_reader.string(symbol_ref, nullptr) != nullptr);
+    corrupt[symbol_ref.offset + sizeof(FlatString) + 4] = 'X';
+    TEST_ASSERT(corrupt_reader.string(symbol_ref, nullptr) == nullptr);
+
+    // Test: bad headers are rejected
+    alignas(FLAT_ALIGN) unsigned char bad[sizeof(FlatHeader)] = {};
+    TEST_ASSERT(!reader.open(bad, sizeof(bad)));
+    ((FlatHeader*)bad)->magic = FLAT_MAGIC;
+    ((FlatHeader*)bad)->size = 4096;
+    TEST_ASSERT(!reader.open(bad, sizeof(bad)));
+
+    // Test: running out of arena space fails the whole message
+    arena.reset();
+    TEST_ASSERT(builder.begin());
+    FlatRef<FlatVector<uint8_t>> big;
+    TEST_ASSERT(builder.add_vector(big, arena_size) == nullptr);
+    TEST_ASSERT(builder.finish(big) == 0);
+
+    TEST_END
+}
+
+TEST test_spill_arena() {
+    size_t capacity = 1024 * 1024;
+
+    // Test: file-backed and memfd-backed arenas both work like a regular arena
+    const char *dirs[] = { "/tmp", nullptr };
+    for (const char *dir : dirs) {
+        bool valid;
+        SpillArena arena(valid, dir, capacity);
+        TEST_ASSERT(valid);
+
+        uint64_t *values = (uint64_t*)arena.alloc_aligned(capacity / 2, 64);
+        TEST_ASSERT(values != nullptr);
+        TEST_ASSERT(((uintptr_t)values & 63) == 0);
+        TEST_ASSERT(values[0] == 0 && values[capacity / 16 - 1] == 0);
+        for (size_t i = 0; i < capacity / 16; i++) { values[i] = i; }
+        TEST_ASSERT(arena.alloc_aligned(capacity, 1) == nullptr);
+
+        // Test: hints don't disturb the data
+        TEST_ASSERT(arena.page_out(values, capacity / 2));
+        TEST_ASSERT(arena.advise_sequential((unsigned char*)values + 1, capacity / 4));
+        TEST_ASSERT(arena.prefetch(values, capacity / 2));
+        for (size_t i = 0; i < capacity / 16; i++) {
+            TEST_ASSERT(values[i] == i);
+        }
+
+        // Test: trimming keeps everything below the offset
+        TEST_ASSERT(arena.trim());
+        TEST_ASSERT(values[capacity / 16 - 1] == capacity / 16 - 1);
+
+        // Test: reset and reuse
+        arena.reset();
+        TEST_ASSERT(arena.trim());
+        values = (uint64_t*)arena.alloc_aligned(capacity, 8);
+        TEST_ASSERT(values != nullptr);
+        TEST_ASSERT(values[1] == 0);
+
+        arena.destroy();
+    }
+
+    TEST_END
+}
+
+struct IntrusiveTestItem {
+    int key;
+    ListLink list_link;
+    RbLink tree_link;
+    SkipLink skip_link;
+};
+
+struct IntrusiveTestCompare {
+    static int compare(const IntrusiveTestItem &a, const IntrusiveTestItem &b) {
+        return a.key < b.key ? -1 : a.key > b.key ? 1 : 0;
+    }
+};
+
+typedef IntrusiveList<IntrusiveTestItem, offsetof(IntrusiveTestItem, list_link)> IntrusiveTestList;
+typedef IntrusiveRbTree<IntrusiveTestItem, offsetof(IntrusiveTestItem, tree_link), IntrusiveTestCompare> IntrusiveTestTree;
+typedef IntrusiveSkipList<IntrusiveTestItem, offsetof(IntrusiveTestItem, skip_link), IntrusiveTestCompare> IntrusiveTestSkipList;
+
+// Returns the black height of the subtree, or -1 if it breaks a red-black rule.
+int check_rb_subtree(RbLink *node, RbLink *parent) {
+    if (node == nullptr) return 1;
+    if (node->parent != parent) return -1;
+    if (node->red && ((node->left && node->left->red) || (node->right && node->right->red))) return -1;
+    int left = check_rb_subtree(node->left, node);
+    int right = check_rb_subtree(node->right, node);
+    if (left < 0 || left != right) return -1;
+    return left + (node->red ? 0 : 1);
+}
+
+uint32_t intrusive_test_random(uint32_t &state) {
+    state = state * 1664525 + 1013904223;
+    return state >> 8;
+}
+
+TEST test_intrusive_containers() {
+    constexpr int num_items = 1000;
+    size_t pool_size = (num_items + 1) * sizeof(IntrusiveTestItem);
+    unsigned char* memory = (unsigned char*)std::malloc(pool_size);
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, pool_size, sizeof(IntrusiveTestItem), alignof(IntrusiveTestItem));
+    TEST_ASSERT(pool_is_valid);
+    IntrusiveTestItem *items[num_items];
+    uint32_t rng = 1;
+    for (int i = 0; i < num_items; i++) {
+        items[i] = (IntrusiveTestItem*)pool.alloc();
+        TEST_ASSERT(items[i] != nullptr);
+        items[i]->key = intrusive_test_random(rng) % 500; // plenty of duplicates
+    }
+
+    // Test: list push/pop/insert/remove keep order
+    IntrusiveTestList list = {};
+    TEST_ASSERT(list.empty() && list.front() == nullptr);
+    list.push_back(items[1]);
+    list.push_front(items[0]);
+    list.push_back(items[3]);
+    list.insert_after(items[1], items[2]);
+    TEST_ASSERT(list.m_size == 4);
+    TEST_ASSERT(list.front() == items[0] && list.back() == items[3]);
+    TEST_ASSERT(list.next(items[0]) == items[1] && list.next(items[1]) == items[2] && list.next(items[2]) == items[3]);
+    TEST_ASSERT(list.prev(items[3]) == items[2]);
+    list.remove(items[2]);
+    TEST_ASSERT(list.next(items[1]) == items[3]);
+    list.remove(items[3]);
+    TEST_ASSERT(list.back() == items[1]);
+    TEST_ASSERT(list.pop_front() == items[0]);
+    TEST_ASSERT(list.pop_front() == items[1]);
+    TEST_ASSERT(list.empty() && list.back() == nullptr && list.m_size == 0);
+
+    // Test: tree stays sorted and balanced through inserts and removes
+    IntrusiveTestTree tree = {};
+    for (int i = 0; i < num_items; i++) { tree.insert(items[i]); }
+    TEST_ASSERT(tree.m_size == num_items);
+    TEST_ASSERT(!tree.m_root->red && check_rb_subtree(tree.m_root, nullptr) > 0);
+    int count = 0;
+    for (IntrusiveTestItem *item = tree.first(); item != nullptr; item = tree.next(item)) {
+        IntrusiveTestItem *next = tree.next(item);
+        if (next != nullptr) { TEST_ASSERT(item->key <= next->key); TEST_ASSERT(tree.prev(next) == item); }
+        count++;
+    }
+    TEST_ASSERT(count == num_items);
+    for (int i = 0; i < num_items; i += 2) { tree.remove(items[i]); }
+    TEST_ASSERT(tree.m_size == num_items / 2);
+    TEST_ASSERT(check_rb_subtree(tree.m_root, nullptr) > 0);
+    for (int i = 1; i < num_items; i += 2) {
+        IntrusiveTestItem *found = tree.find(*items[i]);
+        TEST_ASSERT(found != nullptr && found->key == items[i]->key);
+    }
+    IntrusiveTestItem probe = { .key = 1000 };
+    TEST_ASSERT(tree.find(probe) == nullptr);
+    TEST_ASSERT(tree.lower_bound(probe) == nullptr);
+    probe.key = -1;
+    TEST_ASSERT(tree.lower_bound(probe) == tree.first());
+    for (int i = 1; i < num_items; i += 2) { tree.remove(items[i]); }
+    TEST_ASSERT(tree.empty() && tree.m_size == 0);
+
+    // Test: skip list stays sorted through inserts and removes
+    IntrusiveTestSkipList skip_list = {};
+    for (int i = 0; i < num_items; i++) { skip_list.insert(items[i]); }
+    TEST_ASSERT(skip_list.m_size == num_items);
+    TEST_ASSERT(skip_list.m_height > 1);
+    count = 0;
+    for (IntrusiveTestItem *item = skip_list.first(); item != nullptr; item = skip_list.next(item)) {
+        IntrusiveTestItem *next = skip_list.next(item);
+        if (next != nullptr) { TEST_ASSERT(item->key <= next->key); }
+        count++;
+    }
+    TEST_ASSERT(count == num_items);
+    for (int i = 0; i < num_items; i += 2) { skip_list.remove(items[i]); }
+    TEST_ASSERT(skip_list.m_size == num_items / 2);
+    for (int i = 1; i < num_items; i += 2) {
+        IntrusiveTestItem *found = skip_list.find(*items[i]);
+        TEST_ASSERT(found != nullptr && found->key == items[i]->key);
+    }
+    for (int i = 1; i < num_items; i += 2) { skip_list.remove(items[i]); }
+    TEST_ASSERT(skip_list.empty() && skip_list.m_height == 0);
+
+    // Test: the same element can be in all three at once
+    list.push_back(items[0]);
+    tree.insert(items[0]);
+    skip_list.insert(items[0]);
+    TEST_ASSERT(list.front() == items[0] && tree.first() == items[0] && skip_list.first() == items[0]);
+
+    std::free(memory);
+    TEST_END
+}
+
+TEST test_btree() {
+    TEST_ASSERT(btree_rank((const int32_t[]){ 1, 3, 3, 5, 7, 9 }, 6, 3, false) == 1);
+    TEST_ASSERT(btree_rank((const int32_t[]){ 1, 3, 3, 5, 7, 9 }, 6, 3, true) == 3);
+    TEST_ASSERT(btree_rank((const int32_t[]){ 1, 3, 3, 5, 7, 9 }, 6, 10, true) == 6);
+    TEST_ASSERT(btree_rank((const int32_t[]){ 1, 3, 3, 5, 7, 9 }, 5, 10, false) == 5);
+    TEST_ASSERT(btree_rank((const int32_t[]){ 1, 3, 3, 5, 7, 9 }, 6, 0, false) == 0);
+
+    constexpr int num_keys = 20000;
+    size_t arena_size = 4 * 1024 * 1024;
+    unsigned char *memory = (unsigned char*)std::malloc(arena_size);
+    Arena arena(memory, arena_size);
+    bool pool_is_valid;
+    Pool pool = make_btree_pool(pool_is_valid, arena, arena_size / BTREE_NODE_SIZE - 1);
+    TEST_ASSERT(pool_is_valid);
+    BTree tree = { .m_pool = &pool };
+
+    // Test: empty tree
+    TEST_ASSERT(!tree.find(1, nullptr));
+    TEST_ASSERT(!tree.lower_bound(1).valid());
+
+    // Test: random inserts (even keys only) can all be found again
+    uint32_t rng = 7;
+    for (int i = 0; i < num_keys; i++) {
+        rng = rng * 1664525 + 1013904223;
+        int32_t key = (int32_t)(rng >> 1) & ~1;
+        TEST_ASSERT(tree.insert(key, (uint64_t)key * 3));
+    }
+    TEST_ASSERT(tree.m_height > 2);
+    rng = 7;
+    for (int i = 0; i < num_keys; i++) {
+        rng = rng * 1664525 + 1013904223;
+        int32_t key = (int32_t)(rng >> 1) & ~1;
+        uint64_t value;
+        TEST_ASSERT(tree.find(key, &value));
+        TEST_ASSERT(value == (uint64_t)key * 3);
+        TEST_ASSERT(!tree.find(key + 1, nullptr));
+    }
+
+    // Test: iteration is sorted and sees every key once
+    size_t count = 0;
+    int32_t last_key = INT32_MIN;
+    for (BTree::Cursor it = tree.lower_bound(INT32_MIN); it.valid(); it.next()) {
+        TEST_ASSERT(count == 0 || it.key() > last_key);
+        last_key = it.key();
+        count++;
+    }
+    TEST_ASSERT(count == tree.m_size);
+
+    // Test: updates don't add keys
+    size_t size = tree.m_size;
+    TEST_ASSERT(tree.insert(last_key, 1));
+    TEST_ASSERT(tree.m_size == size);
+    uint64_t value;
+    TEST_ASSERT(tree.find(last_key, &value) && value == 1);
+
+    // Test: lower_bound lands on the next key up
+    BTree::Cursor it = tree.lower_bound(last_key - 1);
+    TEST_ASSERT(it.valid() && it.key() == last_key);
+    it.next();
+    TEST_ASSERT(!it.valid());
+
+    // Test: sequential keys and removes
+    BTree seq = { .m_pool = &pool };
+    for (int32_t key = 0; key < 1000; key++) { TEST_ASSERT(seq.insert(key, key)); }
+    for (int32_t key = 0; key < 1000; key += 2) { TEST_ASSERT(seq.remove(key)); }
+    TEST_ASSERT(!seq.remove(0));
+    TEST_ASSERT(seq.m_size == 500);
+    count = 0;
+    for (BTree::Cursor it = seq.lower_bound(0); it.valid(); it.next()) {
+        TEST_ASSERT(it.key() % 2 == 1);
+        count++;
+    }
+    TEST_ASSERT(count == 500);
+    TEST_ASSERT(seq.lower_bound(0).key() == 1);
+
+    // Test: running out of nodes fails cleanly
+    size_t small_arena_size = 8 * BTREE_NODE_SIZE;
+    Arena small_arena(memory, small_arena_size);
+    Pool small_pool = make_btree_pool(pool_is_valid, small_arena, 4);
+    BTree small = { .m_pool = &small_pool };
+    int32_t inserted = 0;
+    while (small.insert(inserted, 0)) { inserted++; }
+    TEST_ASSERT(inserted > BTREE_LEAF_KEYS);
+    for (int32_t key = 0; key < inserted; key++) { TEST_ASSERT(small.find(key, nullptr)); }
+
+    std::free(memory);
+    TEST_END
+}
+
+struct TimerTestState {
+    TimerWheel *wheel;
+    uint64_t fired_at[16];
+    int num_fired;
+};
+
+void timer_test_record(Timer *timer, void *ctx) {
+    TimerTestState *state = (TimerTestState*)ctx;
+    state->fired_at[state->num_fired++] = state->wheel->m_now;
+}
+
+void timer_test_reschedule(Timer *timer, void *ctx) {
+    TimerTestState *state = (TimerTestState*)ctx;
+    timer_test_record(timer, ctx);
+    if (state->num_fired < 3) { state->wheel->schedule(10, timer_test_reschedule, ctx); }
+}
+
+TEST test_timer_wheel() {
+    constexpr int num_timers = 16;
+    size_t pool_size = (num_timers + 1) * sizeof(Timer);
+    unsigned char *memory = (unsigned char*)std::malloc(pool_size);
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, pool_size, sizeof(Timer), alignof(Timer));
+    TEST_ASSERT(pool_is_valid);
+    TimerWheel *wheel = (TimerWheel*)std::calloc(1, sizeof(TimerWheel));
+    wheel->m_pool = &pool;
+    wheel->m_now = 1000;
+    TimerTestState state = { .wheel = wheel };
+
+    // Test: timers in every level fire exactly on time
+    const uint64_t delays[] = { 1, 255, 256, 300, 65535, 70000, (1ull << 24) + 5 };
+    constexpr int num_delays = sizeof(delays) / sizeof(delays[0]);
+    for (int i = 0; i < num_delays; i++) {
+        TEST_ASSERT(wheel->schedule(delays[i], timer_test_record, &state) != nullptr);
+    }
+    TEST_ASSERT(wheel->m_count == num_delays);
+    for (int i = 0; i < num_delays; i++) {
+        wheel->advance(1000 + delays[i] - 1);
+        TEST_ASSERT(state.num_fired == i);
+        TEST_ASSERT(wheel->advance(1000 + delays[i]) == 1);
+        TEST_ASSERT(state.fired_at[i] == 1000 + delays[i]);
+    }
+    TEST_ASSERT(wheel->m_count == 0);
+
+    // Test: cancelled timers don't fire and go back to the pool
+    state.num_fired = 0;
+    Timer *cancelled = wheel->schedule(5, timer_test_record, &state);
+    wheel->schedule(5, timer_test_record, &state);
+    int free_before = get_num_free_pool_chunks(pool);
+    wheel->cancel(cancelled);
+    TEST_ASSERT(get_num_free_pool_chunks(pool) == free_before + 1);
+    TEST_ASSERT(wheel->advance(wheel->m_now + 10) == 1);
+
+    // Test: idle wheel jumps straight to now
+    wheel->advance(wheel->m_now + (1ull << 40));
+    TEST_ASSERT(wheel->m_now > (1ull << 40));
+
+    // Test: timers beyond the last wheel get parked in it
+    Timer *far = wheel->schedule((1ull << 40), timer_test_record, &state);
+    TEST_ASSERT(far->bucket / TIMER_WHEEL_SLOTS == TIMER_WHEEL_LEVELS - 1);
+    TEST_ASSERT(far->expires == wheel->m_now + (1ull << 40));
+    wheel->cancel(far);
+
+    // Test: callbacks can schedule more timers
+    state.num_fired = 0;
+    wheel->schedule(10, timer_test_reschedule, &state);
+    wheel->advance(wheel->m_now + 100);
+    TEST_ASSERT(state.num_fired == 3);
+    TEST_ASSERT(state.fired_at[2] - state.fired_at[0] == 20);
+
+    // Test: running out of timers
+    int scheduled = 0;
+    while (wheel->schedule(1, timer_test_record, &state) != nullptr) { scheduled++; }
+    TEST_ASSERT(scheduled == (int)(pool.m_capacity / pool.m_chunk_size));
+
+    std::free(wheel);
+    std::free(memory);
+    TEST_END
+}
+
+struct MpmcTestMessage {
+    uint32_t producer;
+    uint32_t sequence;
+};
+
+TEST test_mpmc_queue() {
+    // Test: concurrent pool basics
+    constexpr size_t num_chunks = 64;
+    size_t pool_size = (num_chunks + 1) * CACHE_LINE_SIZE;
+    unsigned char *pool_memory = (unsigned char*)std::malloc(pool_size);
+    bool pool_is_valid;
+    ConcurrentPool pool(pool_is_valid, pool_memory, pool_size, sizeof(MpmcTestMessage), CACHE_LINE_SIZE);
+    TEST_ASSERT(pool_is_valid);
+    size_t pool_chunks = pool.m_num_chunks;
+    TEST_ASSERT(pool_chunks >= num_chunks);
+    void *chunk = pool.alloc();
+    TEST_ASSERT(chunk != nullptr && ((uintptr_t)chunk & (CACHE_LINE_SIZE - 1)) == 0);
+    TEST_ASSERT(pool.free(chunk));
+    TEST_ASSERT(!pool.free(nullptr));
+    TEST_ASSERT(!pool.free(pool_memory + pool_size + CACHE_LINE_SIZE));
+    for (size_t i = 0; i < pool_chunks; i++) { TEST_ASSERT(pool.alloc() != nullptr); }
+    TEST_ASSERT(pool.alloc() == nullptr);
+    pool.free_all();
+
+    // Test: queue basics
+    unsigned char arena_memory[4096];
+    Arena arena(arena_memory, sizeof(arena_memory));
+    bool queue_is_valid;
+    MpmcQueue bad_queue(queue_is_valid, arena, 3);
+    TEST_ASSERT(!queue_is_valid);
+    MpmcQueue queue(queue_is_valid, arena, 4);
+    TEST_ASSERT(queue_is_valid);
+    int values[5];
+    TEST_ASSERT(queue.try_dequeue() == nullptr);
+    for (int i = 0; i < 4; i++) { TEST_ASSERT(queue.try_enqueue(&values[i])); }
+    TEST_ASSERT(!queue.try_enqueue(&values[4]));
+    for (int i = 0; i < 4; i++) { TEST_ASSERT(queue.try_dequeue() == &values[i]); }
+    TEST_ASSERT(queue.try_dequeue() == nullptr);
+
+    // Test: producers and consumers passing pool-allocated messages around.
+    // Every message arrives exactly once, in order per producer.
+    constexpr uint32_t num_producers = 3;
+    constexpr uint32_t num_consumers = 3;
+    constexpr uint32_t messages_per_producer = 20000;
+    MpmcQueue channel(queue_is_valid, arena, 16);
+    TEST_ASSERT(queue_is_valid);
+    uint32_t last_seen[num_consumers][num_producers];
+    uint32_t received[num_consumers] = {};
+    bool in_order = true;
+    std::thread threads[num_producers + num_consumers];
+    for (uint32_t p = 0; p < num_producers; p++) {
+        threads[p] = std::thread([&pool, &channel, p]() {
+            for (uint32_t i = 1; i <= messages_per_producer; i++) {
+                MpmcTestMessage *message;
+                while ((message = (MpmcTestMessage*)pool.alloc()) == nullptr) { std::this_thread::yield(); }
+                message->producer = p;
+                message->sequence = i;
+                channel.enqueue(message);
+            }
+        });
+    }
+    std::memset(last_seen, 0, sizeof(last_seen));
+    for (uint32_t c = 0; c < num_consumers; c++) {
+        threads[num_producers + c] = std::thread([&, c]() {
+            for (;;) {
+                MpmcTestMessage *message = (MpmcTestMessage*)channel.dequeue();
+                // Null messages can't be queued, so a stop signal is a pointer to the channel.
+                if ((void*)message == (void*)&channel) break;
+                if (message->sequence <= last_seen[c][message->producer]) { in_order = false; }
+                last_seen[c][message->producer] = message->sequence;
+                received[c]++;
+                pool.free(message);
+            }
+        });
+    }
+    for (uint32_t p = 0; p < num_producers; p++) { threads[p].join(); }
+    for (uint32_t c = 0; c < num_consumers; c++) { channel.enqueue(&channel); }
+    for (uint32_t c = 0; c < num_consumers; c++) { threads[num_producers + c].join(); }
+
+    uint32_t total = 0;
+    for (uint32_t c = 0; c < num_consumers; c++) { total += received[c]; }
+    TEST_ASSERT(total == num_producers * messages_per_producer);
+    TEST_ASSERT(in_order);
+    // Every message made it back to the pool.
+    size_t free_chunks = 0;
+    while (pool.alloc() != nullptr) { free_chunks++; }
+    TEST_ASSERT(free_chunks == pool_chunks);
+
+    std::free(pool_memory);
+    TEST_END
+}
+
+struct FibTaskArgs {
+    uint32_t n;
+    uint64_t *result;
+};
+
+// Each task keeps its children's results in scratch memory. Helping out while
+// waiting can nest tasks arbitrarily deep, so scratch can run out; then the
+// children just run right here, one after the other.
+void fib_task(Worker &worker, void *args) {
+    FibTaskArgs *fib = (FibTaskArgs*)args;
+    if (fib->n < 2) {
+        *fib->result = fib->n;
+        return;
+    }
+    uint64_t *results = (uint64_t*)worker.m_scratch.alloc_aligned(2 * sizeof(uint64_t), alignof(uint64_t));
+    if (results == nullptr) {
+        uint64_t inline_results[2];
+        FibTaskArgs left = { fib->n - 1, &inline_results[0] };
+        FibTaskArgs right = { fib->n - 2, &inline_results[1] };
+        fib_task(worker, &left);
+        fib_task(worker, &right);
+        *fib->result = inline_results[0] + inline_results[1];
+        return;
+    }
+    uint32_t counter = 0;
+    FibTaskArgs left = { fib->n - 1, &results[0] };
+    FibTaskArgs right = { fib->n - 2, &results[1] };
+    worker.spawn(&counter, fib_task, &left, sizeof(left));
+    worker.spawn(&counter, fib_task, &right, sizeof(right));
+    worker.wait(&counter);
+    *fib->result = results[0] + results[1];
+    worker.m_scratch.free(results);
+}
+
+struct SumTaskArgs {
+    const uint32_t *values;
+    size_t count;
+    uint64_t *result;
+};
+
+void sum_task(Worker &worker, void *args) {
+    SumTaskArgs *sum = (SumTaskArgs*)args;
+    if (sum->count <= 256) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < sum->count; i++) { total += sum->values[i]; }
+        *sum->result = total;
+        return;
+    }
+    size_t half = sum->count / 2;
+    uint64_t *results = (uint64_t*)worker.m_scratch.alloc_aligned(2 * sizeof(uint64_t), alignof(uint64_t));
+    if (results == nullptr) {
+        uint64_t inline_results[2];
+        SumTaskArgs left = { sum->values, half, &inline_results[0] };
+        SumTaskArgs right = { sum->values + half, sum->count - half, &inline_results[1] };
+        sum_task(worker, &left);
+        sum_task(worker, &right);
+        *sum->result = inline_results[0] + inline_results[1];
+        return;
+    }
+    uint32_t counter = 0;
+    SumTaskArgs left = { sum->values, half, &results[0] };
+    SumTaskArgs right = { sum->values + half, sum->count - half, &results[1] };
+    worker.spawn(&counter, sum_task, &left, sizeof(left));
+    worker.spawn(&counter, sum_task, &right, sizeof(right));
+    worker.wait(&counter);
+    *sum->result = results[0] + results[1];
+    worker.m_scratch.free(results);
+}
+
+TEST test_work_stealing() {
+    constexpr size_t arena_size = 1 << 20;
+    unsigned char *arena_memory = (unsigned char*)std::malloc(arena_size);
+
+    // Test: parallel recursion
+    {
+        Arena arena(arena_memory, arena_size);
+        bool is_valid;
+        Scheduler scheduler(is_valid, arena, 4, 1024, 16 * 1024);
+        TEST_ASSERT(is_valid);
+        uint64_t result = 0;
+        FibTaskArgs args = { 20, &result };
+        scheduler.run(fib_task, &args, sizeof(args));
+        TEST_ASSERT(result == 6765);
+        scheduler.shutdown();
+
+        // fib(20) makes 2 * fib(21) - 1 calls.
+        size_t executed = 0;
+        for (uint32_t i = 0; i < scheduler.m_num_workers; i++) {
+            Worker *worker = scheduler.m_workers[i];
+            executed += worker->m_executed;
+            // All scratch and task objects came back.
+            TEST_ASSERT(worker->m_scratch.m_offset == 0);
+            size_t free_tasks = 0;
+            while (worker->m_tasks.alloc() != nullptr) { free_tasks++; }
+            TEST_ASSERT(free_tasks == worker->m_tasks.m_num_chunks);
+        }
+        TEST_ASSERT(executed == 2 * 10946 - 1);
+    }
+
+    // Test: parallel reduction
+    {
+        Arena arena(arena_memory, arena_size);
+        bool is_valid;
+        Scheduler scheduler(is_valid, arena, 3, 256, 4096);
+        TEST_ASSERT(is_valid);
+        constexpr size_t count = 100000;
+        uint32_t *values = (uint32_t*)std::malloc(count * sizeof(uint32_t));
+        uint64_t expected = 0;
+        for (size_t i = 0; i < count; i++) { values[i] = (uint32_t)(i * 2654435761u); expected += values[i]; }
+        uint64_t result = 0;
+        SumTaskArgs args = { values, count, &result };
+        scheduler.run(sum_task, &args, sizeof(args));
+        TEST_ASSERT(result == expected);
+        // Schedulers can be reused.
+        result = 0;
+        scheduler.run(sum_task, &args, sizeof(args));
+        TEST_ASSERT(result == expected);
+        scheduler.shutdown();
+        std::free(values);
+    }
+
+    // Test: out of task objects, tasks run inline instead
+    {
+        Arena arena(arena_memory, arena_size);
+        bool is_valid;
+        Scheduler scheduler(is_valid, arena, 2, 2, 16 * 1024);
+        TEST_ASSERT(is_valid);
+        uint64_t result = 0;
+        FibTaskArgs args = { 15, &result };
+        scheduler.run(fib_task, &args, sizeof(args));
+        TEST_ASSERT(result == 610);
+        scheduler.shutdown();
+    }
+
+    // Test: out of scratch, children run inline instead
+    {
+        Arena arena(arena_memory, arena_size);
+        bool is_valid;
+        Scheduler scheduler(is_valid, arena, 3, 1024, 64);
+        TEST_ASSERT(is_valid);
+        uint64_t result = 0;
+        FibTaskArgs args = { 20, &result };
+        scheduler.run(fib_task, &args, sizeof(args));
+        TEST_ASSERT(result == 6765);
+        constexpr size_t count = 10000;
+        uint32_t values[count];
+        for (size_t i = 0; i < count; i++) { values[i] = (uint32_t)i; }
+        SumTaskArgs sum_args = { values, count, &result };
+        scheduler.run(sum_task, &sum_args, sizeof(sum_args));
+        TEST_ASSERT(result == count * (count - 1) / 2);
+        scheduler.shutdown();
+    }
+
+    // Test: not enough memory
+    {
+        Arena arena(arena_memory, 1024);
+        bool is_valid;
+        Scheduler scheduler(is_valid, arena, 2, 1024, 4096);
+        TEST_ASSERT(!is_valid);
+    }
+
+    std::free(arena_memory);
+    TEST_END
+}
+
+size_t count_resident_pages(void *memory, size_t bytes) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t num_pages = bytes / page_size;
+    unsigned char vec[256];
+    assert(num_pages <= sizeof(vec));
+    if (mincore(memory, num_pages * page_size, vec) != 0) return (size_t)-1;
+    size_t resident = 0;
+    for (size_t i = 0; i < num_pages; i++) { resident += vec[i] & 1; }
+    return resident;
+}
+
+TEST test_scavenger() {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    constexpr size_t num_pages = 64;
+    size_t memory_size = num_pages * page_size;
+
+    // Test: arena pages above the offset are released, budget caps each pass
+    {
+        unsigned char *memory = (unsigned char*)mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        TEST_ASSERT(memory != MAP_FAILED);
+        Arena arena(memory, memory_size);
+        TEST_ASSERT(arena.alloc_aligned(memory_size, 1) != nullptr);
+        TEST_ASSERT(count_resident_pages(memory, memory_size) == num_pages);
+        arena.reset();
+        unsigned char *keep = (unsigned char*)arena.alloc_aligned(page_size + 1, 1);
+        keep[page_size] = 42;
+
+        Scavenger scavenger(1, 16 * page_size, MADV_DONTNEED);
+        ScavengeHandle handle;
+        scavenger.register_arena(handle, arena);
+        // Active allocators are left alone.
+        TEST_ASSERT(scavenger.scavenge() == 0);
+        handle.mark_idle();
+        TEST_ASSERT(scavenger.scavenge() == 16 * page_size);
+        TEST_ASSERT(count_resident_pages(memory, memory_size) == num_pages - 16);
+        for (int pass = 0; pass < 4; pass++) { scavenger.scavenge(); }
+        TEST_ASSERT(handle.released_bytes == (num_pages - 2) * page_size);
+        TEST_ASSERT(scavenger.released_bytes() == (num_pages - 2) * page_size);
+        TEST_ASSERT(count_resident_pages(memory, memory_size) == 2);
+        TEST_ASSERT(keep[page_size] == 42);
+
+        // Test: the arena works as before once it's active again
+        handle.mark_active();
+        unsigned char *more = (unsigned char*)arena.alloc_aligned(4 * page_size, 1);
+        TEST_ASSERT(more != nullptr && more[0] == 0 && more[4 * page_size - 1] == 0);
+        // Still in use, nothing to release.
+        handle.mark_idle();
+        for (int pass = 0; pass < 4; pass++) { TEST_ASSERT(scavenger.scavenge() == 0); }
+        // Only the pages the arena grew back into get released again.
+        handle.mark_active();
+        arena.reset();
+        handle.mark_idle();
+        size_t released = 0;
+        for (int pass = 0; pass < 4; pass++) { released += scavenger.scavenge(); }
+        TEST_ASSERT(released == 6 * page_size);
+        TEST_ASSERT(count_resident_pages(memory, memory_size) == 0);
+
+        scavenger.unregister(handle);
+        munmap(memory, memory_size);
+    }
+
+    // Test: pool chunks at the end that are all free get released
+    {
+        unsigned char *memory = (unsigned char*)mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        TEST_ASSERT(memory != MAP_FAILED);
+        size_t chunk_size = 256;
+        bool pool_is_valid;
+        Pool pool(pool_is_valid, memory, memory_size, chunk_size, 64);
+        TEST_ASSERT(pool_is_valid);
+        size_t num_chunks = memory_size / chunk_size;
+        unsigned char **chunks = (unsigned char**)std::malloc(num_chunks * sizeof(unsigned char*));
+        for (size_t i = 0; i < num_chunks; i++) { chunks[i] = (unsigned char*)pool.alloc(); }
+        // Keep every 5th chunk in the first 8 pages, free everything else.
+        size_t kept = 0;
+        size_t live_end = 0;
+        for (size_t i = 0; i < num_chunks; i++) {
+            if (chunks[i] < memory + 8 * page_size && i % 5 == 0) {
+                kept++;
+                size_t end = chunks[i] + chunk_size - memory;
+                if (end > live_end) live_end = end;
+            } else {
+                pool.free(chunks[i]);
+            }
+        }
+        size_t live_pages = (live_end + page_size - 1) / page_size;
+
+        Scavenger scavenger(1, memory_size, MADV_DONTNEED);
+        ScavengeHandle handle;
+        scavenger.register_pool(handle, pool);
+        handle.mark_idle();
+        TEST_ASSERT(scavenger.scavenge() == (num_pages - live_pages) * page_size);
+        TEST_ASSERT(count_resident_pages(memory, memory_size) == live_pages);
+        TEST_ASSERT(pool.m_bump * chunk_size == live_end);
+
+        // Test: every chunk can still be allocated
+        handle.mark_active();
+        size_t allocated = 0;
+        while (unsigned char *chunk = (unsigned char*)pool.alloc()) {
+            TEST_ASSERT(chunk[0] == 0 && chunk[chunk_size - 1] == 0);
+            allocated++;
+        }
+        TEST_ASSERT(allocated + kept == num_chunks);
+
+        scavenger.unregister(handle);
+        std::free(chunks);
+        munmap(memory, memory_size);
+    }
+
+    // Test: trimming a free run longer than one search window, and free
+    // chunks below a live one staying put
+    {
+        size_t chunk_size = 16;
+        size_t num_chunks = 140000;
+        size_t pool_memory_size = num_chunks * chunk_size;
+        unsigned char *memory = (unsigned char*)mmap(nullptr, pool_memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        TEST_ASSERT(memory != MAP_FAILED);
+        bool pool_is_valid;
+        Pool pool(pool_is_valid, memory, pool_memory_size, chunk_size, 16);
+        TEST_ASSERT(pool_is_valid);
+        void **chunks = (void**)std::malloc(num_chunks * sizeof(void*));
+        for (size_t i = 0; i < num_chunks; i++) { chunks[i] = pool.alloc(); }
+        unsigned char *low_chunk = memory + 50 * chunk_size;
+        unsigned char *high_chunk = memory + 70000 * chunk_size;
+        for (size_t i = 0; i < num_chunks; i++) {
+            if (chunks[i] != low_chunk && chunks[i] != high_chunk) pool.free(chunks[i]);
+        }
+        pool_trim_tail(pool);
+        TEST_ASSERT(pool.m_bump == 70001);
+        pool.free(high_chunk);
+        pool_trim_tail(pool);
+        TEST_ASSERT(pool.m_bump == 51);
+        TEST_ASSERT(get_num_free_pool_chunks(pool) == 50);
+        std::free(chunks);
+        munmap(memory, pool_memory_size);
+    }
+
+    // Test: background thread picks up idle allocators on its own
+    {
+        unsigned char *memory = (unsigned char*)mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        TEST_ASSERT(memory != MAP_FAILED);
+        Arena arena(memory, memory_size);
+        TEST_ASSERT(arena.alloc_aligned(memory_size, 1) != nullptr);
+        arena.reset();
+
+        Scavenger scavenger(1, 8 * page_size);
+        ScavengeHandle handle;
+        scavenger.register_arena(handle, arena);
+        scavenger.start();
+        handle.mark_idle();
+        for (int i = 0; i < 2000 && scavenger.released_bytes() < memory_size; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        handle.mark_active();
+        scavenger.stop();
+        TEST_ASSERT(scavenger.released_bytes() == memory_size);
+        TEST_ASSERT(scavenger.m_passes >= num_pages / 8);
+
+        scavenger.unregister(handle);
+        munmap(memory, memory_size);
+    }
+
+    TEST_END
+}
+
+bool write_small_file(const char *dir, const char *name, const char *text) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, text, strlen(text)) == (ssize_t)strlen(text);
+    close(fd);
+    return ok;
+}
+
+struct ShrinkTestCache {
+    size_t cached;
+    ShrinkLevel last_level;
+    int calls;
+};
+
+// Drop half the cache when it's getting tight, all of it when it's critical.
+size_t shrink_test_cache(void *ctx, ShrinkLevel level) {
+    ShrinkTestCache *cache = (ShrinkTestCache*)ctx;
+    size_t freed = level == SHRINK_CRITICAL ? cache->cached : cache->cached / 2;
+    cache->cached -= freed;
+    cache->last_level = level;
+    cache->calls++;
+    return freed;
+}
+
+TEST test_memory_governor() {
+    char dir[] = "/tmp/alloc_governor_XXXXXX";
+    TEST_ASSERT(mkdtemp(dir) != nullptr);
+    char psi_path[64];
+    snprintf(psi_path, sizeof(psi_path), "%s/pressure", dir);
+    const char *calm_psi =
+        "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+        "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+
+    MemoryGovernor governor(dir, psi_path);
+    ShrinkTestCache cache = { 1000, SHRINK_NONE, 0 };
+    Shrinker shrinker = { .callback = shrink_test_cache, .ctx = &cache };
+    governor.register_shrinker(shrinker);
+
+    // Test: plenty of room, caches are left alone
+    TEST_ASSERT(write_small_file(dir, "memory.max", "1000000\n"));
+    TEST_ASSERT(write_small_file(dir, "memory.current", "500000\n"));
+    TEST_ASSERT(write_small_file(dir, "pressure", calm_psi));
+    MemoryPressure pressure = governor.sample();
+    TEST_ASSERT(pressure.current == 500000 && pressure.max == 1000000);
+    TEST_ASSERT(pressure.some_avg10 == 0.0 && pressure.full_avg10 == 0.0);
+    TEST_ASSERT(governor.poll() == 0);
+    TEST_ASSERT(cache.calls == 0);
+
+    // Test: close to the limit, moderate shrink
+    TEST_ASSERT(write_small_file(dir, "memory.current", "900000\n"));
+    TEST_ASSERT(governor.poll() == 500);
+    TEST_ASSERT(cache.last_level == SHRINK_MODERATE && cache.cached == 500);
+
+    // Test: at the limit, critical shrink
+    TEST_ASSERT(write_small_file(dir, "memory.current", "990000\n"));
+    TEST_ASSERT(governor.poll() == 500);
+    TEST_ASSERT(cache.last_level == SHRINK_CRITICAL && cache.cached == 0);
+    TEST_ASSERT(governor.m_shrunk_bytes == 1000);
+
+    // Test: no limit, PSI alone decides
+    cache.cached = 1000;
+    TEST_ASSERT(write_small_file(dir, "memory.max", "max\n"));
+    TEST_ASSERT(governor.poll() == 0);
+    TEST_ASSERT(write_small_file(dir, "pressure",
+        "some avg10=25.31 avg60=10.00 avg300=2.00 total=123456\n"
+        "full avg10=1.20 avg60=0.50 avg300=0.10 total=23456\n"));
+    pressure = governor.sample();
+    TEST_ASSERT(pressure.max == 0);
+    TEST_ASSERT(pressure.some_avg10 > 25.3 && pressure.some_avg10 < 25.32);
+    TEST_ASSERT(governor.evaluate(pressure) == SHRINK_MODERATE);
+    TEST_ASSERT(write_small_file(dir, "pressure",
+        "some avg10=60.00 avg60=10.00 avg300=2.00 total=123456\n"
+        "full avg10=30.00 avg60=0.50 avg300=0.10 total=23456\n"));
+    TEST_ASSERT(governor.poll() == 1000);
+    TEST_ASSERT(cache.last_level == SHRINK_CRITICAL);
+
+    // Test: missing files mean no pressure
+    MemoryGovernor missing("/nonexistent/cgroup", "/nonexistent/pressure");
+    pressure = missing.sample();
+    TEST_ASSERT(pressure.max == 0 && pressure.some_avg10 < 0 && pressure.full_avg10 < 0);
+    TEST_ASSERT(missing.evaluate(pressure) == SHRINK_NONE);
+
+    // Test: scavenger as a shrinker
+    {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t memory_size = 32 * page_size;
+        unsigned char *memory = (unsigned char*)mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        TEST_ASSERT(memory != MAP_FAILED);
+        Arena arena(memory, memory_size);
+        TEST_ASSERT(arena.alloc_aligned(memory_size, 1) != nullptr);
+        arena.reset();
+        // Budget so small the scavenger would never get anywhere by itself.
+        Scavenger scavenger(1000, page_size, MADV_DONTNEED);
+        ScavengeHandle handle;
+        scavenger.register_arena(handle, arena);
+        handle.mark_idle();
+        Shrinker scavenge = { .callback = scavenger_shrink, .ctx = &scavenger };
+        governor.unregister_shrinker(shrinker);
+        governor.register_shrinker(scavenge);
+        TEST_ASSERT(governor.poll() == memory_size);
+        TEST_ASSERT(count_resident_pages(memory, memory_size) == 0);
+        governor.unregister_shrinker(scavenge);
+        scavenger.unregister(handle);
+        munmap(memory, memory_size);
+    }
+
+    // Test: background polling
+    governor.register_shrinker(shrinker);
+    cache.cached = 1000;
+    cache.calls = 0;
+    governor.start(1);
+    for (int i = 0; i < 2000 && __atomic_load_n(&cache.calls, __ATOMIC_RELAXED) == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    governor.stop();
+    TEST_ASSERT(cache.calls > 0 && cache.cached == 0);
+
+    const char *files[] = { "memory.max", "memory.current", "pressure" };
+    for (const char *file : files) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s", dir, file);
+        unlink(path);
+    }
+    rmdir(dir);
+    TEST_END
+}
+
+struct BudgetTestLog {
+    int soft;
+    int hard;
+    MemoryTag *last_tag;
+};
+
+void budget_test_callback(MemoryTag *tag, BudgetEvent event, size_t bytes, void *ctx) {
+    BudgetTestLog *log = (BudgetTestLog*)ctx;
+    if (event == BUDGET_SOFT_EXCEEDED) log->soft++;
+    else log->hard++;
+    log->last_tag = tag;
+}
+
+// Stands in for another thread bumping the arena while a charge is being refused.
+void budget_race_callback(MemoryTag *tag, BudgetEvent event, size_t bytes, void *ctx) {
+    if (event != BUDGET_HARD_EXCEEDED) return;
+    Arena *arena = (Arena*)ctx;
+    __atomic_store_n(&arena->m_current, arena->m_current + 64, __ATOMIC_RELAXED);
+    MemoryTag::transfer(nullptr, tag, 64);
+}
+
+TEST test_memory_tags() {
+    BudgetTestLog log = {};
+    MemoryTag subsystem = {
+        .m_name = "subsystem", .m_hard_limit = 8192,
+        .m_on_exceeded = budget_test_callback, .m_ctx = &log,
+    };
+    MemoryTag component_a = {
+        .m_name = "a", .m_parent = &subsystem, .m_soft_limit = 1024,
+        .m_on_exceeded = budget_test_callback, .m_ctx = &log,
+    };
+    MemoryTag component_b = { .m_name = "b", .m_parent = &subsystem, .m_hard_limit = 4096 };
+
+    // Test: arena usage rolls up the tree
+    unsigned char arena_memory[16384];
+    Arena arena(arena_memory, sizeof(arena_memory));
+    arena.m_tag = &component_a;
+    TEST_ASSERT(arena.alloc_aligned(1000, 1) != nullptr);
+    TEST_ASSERT(component_a.m_used == 1000 && subsystem.m_used == 1000);
+    TEST_ASSERT(log.soft == 0);
+
+    // Test: soft limit only reports, once per crossing
+    TEST_ASSERT(arena.alloc_aligned(100, 1) != nullptr);
+    TEST_ASSERT(log.soft == 1 && log.last_tag == &component_a);
+    TEST_ASSERT(arena.alloc_aligned(100, 1) != nullptr);
+    TEST_ASSERT(log.soft == 1);
+
+    // Test: hard limit of an ancestor refuses the allocation and charges nothing
+    TEST_ASSERT(arena.alloc_aligned(8000, 1) == nullptr);
+    TEST_ASSERT(log.hard == 1 && log.last_tag == &subsystem && subsystem.m_refused == 1);
+    TEST_ASSERT(component_a.m_used == 1200 && subsystem.m_used == 1200);
+    TEST_ASSERT(arena.offset() == 1200);
+
+    // Test: resizing the last allocation charges and refunds the difference
+    void *last = arena.alloc_aligned(64, 1);
+    TEST_ASSERT(arena.resize_aligned(last, 64, 264, 1) == last);
+    TEST_ASSERT(component_a.m_used == 1464);
+    TEST_ASSERT(arena.resize_aligned(last, 264, 32, 1) == last);
+    TEST_ASSERT(component_a.m_used == 1232);
+
+    // Test: child arena blocks count against the parent's tag
+    ChildArena child = { .m_parent = &arena, .m_block_size = 1024 };
+    TEST_ASSERT(child.alloc_aligned(100, 8) != nullptr);
+    size_t borrowed = child.m_parent_capacity - arena.capacity();
+    TEST_ASSERT(component_a.m_used == 1232 + borrowed);
+    child.reset();
+    TEST_ASSERT(component_a.m_used == 1232);
+
+    // Test: split charges the whole region, merge gives back the unused part
+    unsigned char split_memory[2048];
+    Arena split_arena(split_memory, sizeof(split_memory));
+    split_arena.m_tag = &component_b;
+    TEST_ASSERT(split_arena.alloc_aligned(100, 1) != nullptr);
+    Arena subs[2];
+    TEST_ASSERT(arena_split(split_arena, subs, 2, nullptr, 64));
+    TEST_ASSERT(component_b.m_used == sizeof(split_memory));
+    TEST_ASSERT(subs[0].alloc_aligned(100, 1) != nullptr);
+    arena_merge(split_arena, subs, 2);
+    TEST_ASSERT(component_b.m_used == split_arena.offset());
+    // Limits can be changed on the fly, and a split that doesn't fit fails.
+    component_b.m_hard_limit = split_arena.offset() + 100;
+    TEST_ASSERT(!arena_split(split_arena, subs, 2, nullptr, 64));
+    component_b.m_hard_limit = 4096;
+    split_arena.reset();
+    TEST_ASSERT(component_b.m_used == 0);
+
+    // Test: reset gives everything back
+    arena.reset();
+    TEST_ASSERT(component_a.m_used == 0 && subsystem.m_used == 0);
+    TEST_ASSERT(component_a.m_peak >= 1464 && subsystem.m_peak >= component_a.m_peak);
+
+    // Test: stack allocations and frees, including detached headers
+    unsigned char stack_memory[8192];
+    Stack stack = { .m_memory = stack_memory, .m_capacity = sizeof(stack_memory), .m_tag = &component_b };
+    void *first = stack.alloc_aligned(100, 8);
+    TEST_ASSERT(first != nullptr && component_b.m_used == stack.used());
+    void *big = stack.alloc_aligned(100, 256);
+    TEST_ASSERT(big != nullptr && component_b.m_used == stack.used());
+    TEST_ASSERT(stack.resize_aligned(big, 100, 500, 256) == big);
+    TEST_ASSERT(component_b.m_used == stack.used());
+    TEST_ASSERT(stack.alloc_aligned(4096, 8) == nullptr);
+    TEST_ASSERT(component_b.m_refused == 2 && component_b.m_used == stack.used());
+    TEST_ASSERT(stack.free(big));
+    TEST_ASSERT(component_b.m_used == stack.used());
+    TEST_ASSERT(subsystem.m_used == component_b.m_used);
+    stack.reset();
+    TEST_ASSERT(component_b.m_used == 0);
+
+    // Test: pool chunks
+    unsigned char pool_memory[64 * 80];
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, pool_memory, sizeof(pool_memory), 64, 64);
+    TEST_ASSERT(pool_is_valid);
+    void *chunks[3];
+    for (int i = 0; i < 3; i++) { chunks[i] = pool.alloc(); }
+    // Tagged after the fact: what's already in use moves over.
+    pool.set_tag(&component_b);
+    TEST_ASSERT(component_b.m_used == 3 * 64);
+    TEST_ASSERT(pool.free(chunks[0]));
+    TEST_ASSERT(component_b.m_used == 2 * 64);
+    size_t allocated = 2;
+    while (pool.alloc() != nullptr) { allocated++; }
+    // Stopped by the 4096 byte limit, not by running out of chunks.
+    TEST_ASSERT(allocated == 4096 / 64);
+    TEST_ASSERT(pool.num_in_use() == allocated);
+    pool.free_all();
+    TEST_ASSERT(component_b.m_used == 0);
+
+    // Test: moving a tag
+    TEST_ASSERT(arena.alloc_aligned(500, 1) != nullptr);
+    arena.set_tag(&component_b);
+    TEST_ASSERT(component_a.m_used == 0 && component_b.m_used == 500 && subsystem.m_used == 500);
+    arena.set_tag(nullptr);
+    TEST_ASSERT(subsystem.m_used == 0);
+
+    // Test: a refused atomic block that can't be handed back (someone bumped
+    // past it) stays charged, so reset uncharges exactly what was charged
+    unsigned char race_memory[4096];
+    Arena race_arena(race_memory, sizeof(race_memory));
+    MemoryTag racy = { .m_name = "racy", .m_hard_limit = 1024, .m_on_exceeded = budget_race_callback, .m_ctx = &race_arena };
+    race_arena.m_tag = &racy;
+    TEST_ASSERT(race_arena.alloc_block_atomic(512, 8) != nullptr);
+    TEST_ASSERT(race_arena.alloc_block_atomic(1024, 8) == nullptr);
+    TEST_ASSERT(race_arena.offset() == 512 + 1024 + 64);
+    TEST_ASSERT(racy.m_used == race_arena.offset());
+    race_arena.reset();
+    TEST_ASSERT(racy.m_used == 0);
+    // Without the race the block is simply given back.
+    racy.m_on_exceeded = nullptr;
+    TEST_ASSERT(race_arena.alloc_block_atomic(2048, 8) == nullptr);
+    TEST_ASSERT(race_arena.offset() == 0 && racy.m_used == 0);
+
+    // Test: report
+    char *report = nullptr;
+    size_t report_size = 0;
+    FILE *out = open_memstream(&report, &report_size);
+    MemoryTag *tags[] = { &subsystem, &component_a, &component_b };
+    memory_tags_report(out, tags, 3);
+    fclose(out);
+    TEST_ASSERT(std::strstr(report, "subsystem") != nullptr && std::strstr(report, "\n  a ") != nullptr);
+    std::free(report);
+
+    TEST_END
+}
+
+TEST test_stats_segment() {
+    char path[] = "/tmp/alloc_stats_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    close(fd);
+
+    StatsSegment segment = {};
+    TEST_ASSERT(segment.create(path, 3));
+
+    unsigned char arena_memory[1024];
+    Arena arena(arena_memory, sizeof(arena_memory));
+    arena.m_stats = segment.add("test arena", STATS_ARENA, arena.capacity());
+    unsigned char stack_memory[1024];
+    Stack stack = { .m_memory = stack_memory, .m_capacity = sizeof(stack_memory) };
+    stack.m_stats = segment.add("test stack", STATS_STACK, stack.m_capacity);
+    unsigned char pool_memory[64 * 5];
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, pool_memory, sizeof(pool_memory), 64, 64);
+    pool.m_stats = segment.add("test pool", STATS_POOL, pool.m_capacity / pool.m_chunk_size * pool.m_chunk_size);
+    TEST_ASSERT(arena.m_stats != nullptr && stack.m_stats != nullptr && pool.m_stats != nullptr);
+    // Test: out of entries
+    TEST_ASSERT(segment.add("one too many", STATS_ARENA, 0) == nullptr);
+
+    // A reader maps the file on its own, like the CLI in another process would.
+    StatsSegment reader = {};
+    TEST_ASSERT(reader.open_readonly(path));
+    TEST_ASSERT(reader.m_header->num_entries == 3 && reader.m_header->pid == (uint32_t)getpid());
+    StatsEntry *arena_stats = &reader.m_entries[0];
+    StatsEntry *stack_stats = &reader.m_entries[1];
+    StatsEntry *pool_stats = &reader.m_entries[2];
+    TEST_ASSERT(std::strcmp(arena_stats->name, "test arena") == 0 && arena_stats->kind == STATS_ARENA);
+
+    // Test: arena numbers
+    arena.alloc_aligned(100, 1);
+    arena.alloc_aligned(300, 1);
+    TEST_ASSERT(arena.alloc_aligned(1000, 1) == nullptr);
+    TEST_ASSERT(arena_stats->used == 400 && arena_stats->peak == 400);
+    TEST_ASSERT(arena_stats->allocs == 2 && arena_stats->failures == 1);
+    arena.reset();
+    arena.alloc_aligned(10, 1);
+    TEST_ASSERT(arena_stats->used == 10 && arena_stats->peak == 400 && arena_stats->frees == 1);
+
+    // Test: stack numbers
+    void *a = stack.alloc_aligned(100, 8);
+    void *b = stack.alloc_aligned(200, 8);
+    size_t peak = stack.used();
+    TEST_ASSERT(stack_stats->used == peak && stack_stats->allocs == 2);
+    stack.free(b);
+    TEST_ASSERT(stack_stats->used == stack.used() && stack_stats->peak == peak && stack_stats->frees == 1);
+    TEST_ASSERT(stack.alloc_aligned(2000, 8) == nullptr && stack_stats->failures == 1);
+    void *top = stack.alloc_aligned(16, 8);
+    TEST_ASSERT(stack.resize_aligned(top, 16, 2000, 8) == nullptr && stack_stats->failures == 2);
+    stack.free(top);
+    stack.free(a);
+    TEST_ASSERT(stack_stats->used == 0);
+
+    // Test: pool numbers
+    void *chunks[5];
+    size_t num_chunks = 0;
+    while (void *chunk = pool.alloc()) { chunks[num_chunks++] = chunk; }
+    TEST_ASSERT(pool_stats->used == num_chunks * 64 && pool_stats->failures == 1);
+    pool.free(chunks[0]);
+    TEST_ASSERT(pool_stats->used == (num_chunks - 1) * 64 && pool_stats->frees == 1);
+    pool.free_all();
+    TEST_ASSERT(pool_stats->used == 0 && pool_stats->peak == num_chunks * 64);
+
+    // Test: stats attached to a pool that already has chunks in use
+    pool.m_stats = nullptr;
+    void *early = pool.alloc();
+    TEST_ASSERT(pool.alloc() != nullptr);
+    StatsEntry late = {};
+    pool.m_stats = &late;
+    pool.free(early);
+    TEST_ASSERT(late.used == 64 && late.frees == 1);
+    pool.m_stats = nullptr;
+
+    // Test: removed entries drop out of the listing
+    char *text = nullptr;
+    size_t text_size = 0;
+    FILE *out = open_memstream(&text, &text_size);
+    stats_print(out, reader);
+    fclose(out);
+    TEST_ASSERT(std::strstr(text, "test stack") != nullptr);
+    std::free(text);
+    segment.remove(stack.m_stats);
+    out = open_memstream(&text, &text_size);
+    stats_print(out, reader);
+    fclose(out);
+    TEST_ASSERT(std::strstr(text, "test arena") != nullptr && std::strstr(text, "test stack") == nullptr);
+    std::free(text);
+
+    // Test: not a stats file
+    StatsSegment bogus = {};
+    TEST_ASSERT(!bogus.open_readonly("/proc/self/status"));
+
+    reader.close();
+    segment.close();
+    unlink(path);
+    TEST_END
+}
+
+TEST test_fixed_regions() {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    FixedRegionProvider provider;
+
+    // Test: regions land exactly where they should, at the page offset asked for
+    unsigned char *first = (unsigned char*)provider.map(100, 0);
+    TEST_ASSERT((uintptr_t)first == FIXED_REGION_DEFAULT_BASE);
+    first[99] = 1;
+    unsigned char *second = (unsigned char*)provider.map(3 * FIXED_REGION_DEFAULT_ALIGN, 64);
+    TEST_ASSERT((uintptr_t)second == FIXED_REGION_DEFAULT_BASE + FIXED_REGION_DEFAULT_ALIGN + 64);
+    TEST_ASSERT(second[0] == 0 && second[3 * FIXED_REGION_DEFAULT_ALIGN - 1] == 0);
+    unsigned char *third = (unsigned char*)provider.map(page_size, 0);
+    TEST_ASSERT((uintptr_t)third == FIXED_REGION_DEFAULT_BASE + 5 * FIXED_REGION_DEFAULT_ALIGN);
+
+    // Test: never maps over something that's already there
+    FixedRegionProvider clash;
+    TEST_ASSERT(clash.map(page_size) == nullptr);
+
+    // Test: same calls after a reset, same addresses
+    provider.unmap(first, 100, 0);
+    provider.unmap(second, 3 * FIXED_REGION_DEFAULT_ALIGN, 64);
+    provider.unmap(third, page_size, 0);
+    provider.reset();
+    TEST_ASSERT(provider.map(100, 0) == first);
+    TEST_ASSERT(provider.map(3 * FIXED_REGION_DEFAULT_ALIGN, 64) == second);
+    provider.unmap(first, 100, 0);
+    provider.unmap(second, 3 * FIXED_REGION_DEFAULT_ALIGN, 64);
+
+    // Test: allocator layout no longer depends on where the buffer landed.
+    // Same setup as test_pool, but now it's always exactly 4 chunks plus the
+    // padding we asked for.
+    provider.reset();
+    void *memory = provider.map(320, 32);
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, 320, 64, 64);
+    TEST_ASSERT(pool_is_valid);
+    TEST_ASSERT(pool.m_aligned_memory - pool.m_memory == 32);
+    TEST_ASSERT(pool.m_capacity / pool.m_chunk_size == 4);
+    provider.unmap(memory, 320, 32);
+
+    TEST_END
+}
+
+TEST test_prefetch() {
+    // Prefetching is only a hint, so the results must be exactly the same as
+    // without it, including at the ends of the free list and the arena.
+    constexpr size_t num_chunks = 8;
+    alignas(64) unsigned char pool_memory[num_chunks * 64];
+    alignas(64) unsigned char arena_memory[256];
+
+    // Test: pools hand out the same chunks in the same order at every distance
+    void *expected[num_chunks + 1];
+    for (uint32_t distance = 0; distance <= 2; distance++) {
+        bool pool_is_valid;
+        Pool pool(pool_is_valid, pool_memory, sizeof(pool_memory), 64, 64);
+        TEST_ASSERT(pool_is_valid);
+        pool.m_prefetch_distance = distance;
+        // Scramble the free list so it isn't just address order.
+        void *chunks[num_chunks];
+        for (size_t i = 0; i < num_chunks; i++) { chunks[i] = pool.alloc(); }
+        for (size_t i = 0; i < num_chunks; i++) { pool.free(chunks[(i * 3) % num_chunks]); }
+
+        for (size_t i = 0; i <= num_chunks; i++) {
+            void *chunk = pool.alloc();
+            if (distance == 0) expected[i] = chunk;
+            TEST_ASSERT(chunk == expected[i]);
+        }
+        TEST_ASSERT(expected[num_chunks] == nullptr);
+    }
+
+    // Test: arena prefetching runs right up to (and past) the end
+    Arena arena(arena_memory, sizeof(arena_memory));
+    arena.m_prefetch_ahead = 512;
+    for (size_t i = 0; i < sizeof(arena_memory) / 16; i++) {
+        TEST_ASSERT(arena.alloc_aligned(16, 16) == arena_memory + i * 16);
+    }
+    TEST_ASSERT(arena.alloc_aligned(16, 16) == nullptr);
+
+    TEST_END
+}
+
+TEST test_striped_pool() {
+    constexpr size_t num_chunks = 64;
+    constexpr size_t num_stripes = 4;
+    size_t pool_size = (num_chunks + 1) * CACHE_LINE_SIZE;
+    unsigned char *pool_memory = (unsigned char*)std::malloc(pool_size);
+    alignas(CACHE_LINE_SIZE) unsigned char arena_memory[num_stripes * CACHE_LINE_SIZE];
+    Arena arena(arena_memory, sizeof(arena_memory));
+    bool pool_is_valid;
+    StripedPool bad_pool(pool_is_valid, pool_memory, pool_size, CACHE_LINE_SIZE, CACHE_LINE_SIZE, arena, 0);
+    TEST_ASSERT(!pool_is_valid);
+    StripedPool pool(pool_is_valid, pool_memory, pool_size, CACHE_LINE_SIZE, CACHE_LINE_SIZE, arena, num_stripes);
+    TEST_ASSERT(pool_is_valid);
+    size_t pool_chunks = pool.m_num_chunks;
+    TEST_ASSERT(pool_chunks >= num_chunks);
+
+    // Test: one thread gets every chunk exactly once, stealing once its own
+    // stripe is dry
+    unsigned char *seen = (unsigned char*)std::calloc(pool_chunks, 1);
+    for (size_t i = 0; i < pool_chunks; i++) {
+        unsigned char *chunk = (unsigned char*)pool.alloc();
+        TEST_ASSERT(chunk != nullptr && ((uintptr_t)chunk & (CACHE_LINE_SIZE - 1)) == 0);
+        size_t index = (chunk - pool.m_aligned_memory) / pool.m_chunk_size;
+        TEST_ASSERT(seen[index] == 0);
+        seen[index] = 1;
+    }
+    TEST_ASSERT(pool.alloc() == nullptr);
+    std::free(seen);
+    TEST_ASSERT(!pool.free(nullptr));
+    TEST_ASSERT(!pool.free(pool_memory + pool_size + CACHE_LINE_SIZE));
+
+    // Test: everything freed lands on our stripe and comes back from it
+    for (size_t i = 0; i < pool_chunks; i++) { TEST_ASSERT(pool.free(pool.m_aligned_memory + i * pool.m_chunk_size)); }
+    size_t home = pool.home_stripe();
+    for (size_t i = 0; i < num_stripes; i++) {
+        TEST_ASSERT(((uint32_t)pool.m_stripes[i].m_head == 0) == (i != home));
+    }
+    pool.free_all();
+
+    // Test: more threads than stripes. Nobody is ever handed a chunk someone
+    // else is still using.
+    constexpr uint32_t num_threads = 6;
+    constexpr uint32_t iterations = 20000;
+    bool intact[num_threads];
+    std::thread threads[num_threads];
+    for (uint32_t t = 0; t < num_threads; t++) {
+        threads[t] = std::thread([&pool, &intact, t]() {
+            intact[t] = true;
+            void *held[4] = {};
+            for (uint32_t i = 0; i < iterations; i++) {
+                void *&slot = held[i % 4];
+                if (slot != nullptr) {
+                    if (*(uint32_t*)slot != t * iterations + i - 4) intact[t] = false;
+                    pool.free(slot);
+                }
+                while ((slot = pool.alloc()) == nullptr) { std::this_thread::yield(); }
+                *(uint32_t*)slot = t * iterations + i;
+            }
+            for (void *chunk : held) { pool.free(chunk); }
+        });
+    }
+    for (std::thread &thread : threads) { thread.join(); }
+    for (uint32_t t = 0; t < num_threads; t++) { TEST_ASSERT(intact[t]); }
+    size_t count = 0;
+    while (pool.alloc() != nullptr) { count++; }
+    TEST_ASSERT(count == pool_chunks);
+
+    std::free(pool_memory);
+    TEST_END
+}
+
+TEST test_pool_reset() {
+    constexpr size_t chunk_size = 32;
+    constexpr size_t num_chunks = 8;
+    alignas(chunk_size) unsigned char memory[num_chunks * chunk_size];
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, sizeof(memory), chunk_size, chunk_size);
+    TEST_ASSERT(pool_is_valid);
+    MemoryTag tag = { .m_name = "pool" };
+    pool.set_tag(&tag);
+
+    // Test: reset forgets everything at once, in use or on the free list
+    void *chunks[num_chunks];
+    for (size_t i = 0; i < num_chunks; i++) { chunks[i] = pool.alloc(); }
+    pool.free(chunks[2]);
+    pool.free(chunks[5]);
+    TEST_ASSERT(tag.m_used == (num_chunks - 2) * chunk_size);
+    TEST_ASSERT(pool.num_in_use() == num_chunks - 2);
+    // Nothing in the chunks is looked at, the free list included, even with
+    // a tag to uncharge.
+    std::memset(memory, 0xff, sizeof(memory));
+    pool.reset();
+    TEST_ASSERT(tag.m_used == 0);
+    TEST_ASSERT(pool.num_in_use() == 0);
+    TEST_ASSERT(pool.num_untouched() == num_chunks);
+
+    // Test: chunks come back in address order, zeroed, and then we run dry
+    // like after free_all
+    pool.set_tag(nullptr);
+    for (size_t i = 0; i < num_chunks; i++) {
+        unsigned char *chunk = (unsigned char*)pool.alloc();
+        TEST_ASSERT(chunk == memory + i * chunk_size);
+        TEST_ASSERT(chunk[0] == 0 && chunk[chunk_size - 1] == 0);
+    }
+    TEST_ASSERT(pool.alloc() == nullptr);
+
+    // Test: after a reset, freed chunks are reused before untouched ones
+    pool.reset();
+    void *first = pool.alloc();
+    void *second = pool.alloc();
+    pool.free(first);
+    TEST_ASSERT(pool.alloc() == first);
+    TEST_ASSERT(pool.alloc() == memory + 2 * chunk_size);
+    TEST_ASSERT(pool.num_in_use() == 3 && second != nullptr);
+
+    // Test: what's in use carries over to a tag attached later
+    pool.set_tag(&tag);
+    TEST_ASSERT(tag.m_used == 3 * chunk_size);
+    pool.reset();
+    TEST_ASSERT(tag.m_used == 0);
+
+    TEST_END
+}
+
+///////////////////////////////////////////////////////////////////////////
+//============================== END TESTS ==============================//
+///////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+//============================== BENCHMARKS ==============================//
+////////////////////////////////////////////////////////////////////////////
+
+// Run with `make bench` (optimized build) or `./build/main bench [filter]`.
+
+#define RUN_BENCH(label, bench) if (filter == nullptr || std::strstr(label, filter) != nullptr) { \
+    printf("bench: %s\n", label); \
+    if (bench_fixed_regions != nullptr) bench_fixed_regions->reset(); \
+    bench(); \
+};
+
+// Set ALLOC_FIXED_BASE (e.g. 0x100000000000) to give the allocators under
+// test backing memory at fixed addresses, and ALLOC_FIXED_PAGE_OFFSET to
+// pick where in the page it starts. Every benchmark starts over from the
+// base, so it sees the same addresses whatever else ran before it.
+FixedRegionProvider *bench_fixed_regions = nullptr;
+size_t bench_fixed_page_offset = 0;
+
+void* bench_backing_alloc(size_t bytes) {
+    if (bench_fixed_regions == nullptr) return std::malloc(bytes);
+    return bench_fixed_regions->map(bytes, bench_fixed_page_offset);
+}
+
+void bench_backing_free(void *memory, size_t bytes) {
+    if (bench_fixed_regions == nullptr) return std::free(memory);
+    bench_fixed_regions->unmap(memory, bytes, bench_fixed_page_offset);
+}
+
+uint64_t bench_now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void bench_report(const char* label, uint64_t ns, size_t bytes) {
+    double seconds = (double)ns / 1e9;
+    printf("  %-32s %10.2f ms %10.1f MiB/s\n", label, seconds * 1e3, (double)bytes / (1024.0 * 1024.0) / seconds);
+}
+
+size_t bench_env_size(const char* name, size_t fallback) {
+    const char* value = getenv(name);
+    if (value == nullptr) return fallback;
+    return (size_t)strtoull(value, nullptr, 0);
+}
+
+// Sequentially read a file into arena memory through the page cache vs. with
+// O_DIRECT. The page cache is dropped before every buffered run so both sides
+// actually hit the device.
+// DIO_BENCH_FILE picks where the scratch file goes (it needs to be on a
+// filesystem that supports O_DIRECT, so not tmpfs), DIO_BENCH_SIZE its size.
+void bench_direct_io() {
+    const char* path = getenv("DIO_BENCH_FILE");
+    if (path == nullptr) path = "build/dio_bench.bin";
+    size_t file_size = bench_env_size("DIO_BENCH_SIZE", 256ull * 1024 * 1024);
+    size_t chunk_size = 1024 * 1024;
+    file_size = forward_align(file_size, chunk_size);
+
+    size_t arena_size = 2 * chunk_size + DIRECT_IO_FALLBACK_ALIGN;
+    unsigned char* memory = (unsigned char*)bench_backing_alloc(arena_size);
+    if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); return; }
+    Arena arena(memory, arena_size);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { printf("  skipped: can't create %s\n", path); bench_backing_free(memory, arena_size); return; }
+    unsigned char* chunk = (unsigned char*)arena.alloc_aligned(chunk_size, 64);
+    if (chunk == nullptr) { printf("  skipped: couldn't allocate a buffer\n"); close(fd); unlink(path); bench_backing_free(memory, arena_size); return; }
+    std::memset(chunk, 0xab, chunk_size);
+    for (size_t written = 0; written < file_size; written += chunk_size) {
+        if (write(fd, chunk, chunk_size) != (ssize_t)chunk_size) { printf("  skipped: write failed\n"); close(fd); unlink(path); bench_backing_free(memory, arena_size); return; }
+    }
+    fsync(fd);
+    arena.reset();
+
+    constexpr int runs = 3;
+    for (int run = 0; run < runs; run++) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        unsigned char* buffer = (unsigned char*)arena.alloc_aligned(chunk_size, 64);
+        if (buffer == nullptr) { printf("  skipped buffered read: couldn't allocate a buffer\n"); break; }
+        uint64_t start = bench_now_ns();
+        size_t total = 0;
+        for (;;) {
+            ssize_t n = pread(fd, buffer, chunk_size, total);
+            if (n <= 0) break;
+            total += n;
+        }
+        bench_report("buffered read", bench_now_ns() - start, total);
+        arena.reset();
+    }
+
+    int direct_fd = open(path, O_RDONLY | O_DIRECT);
+    DirectIoAlignment alignment;
+    if (direct_fd < 0 || !query_direct_io_alignment(direct_fd, alignment)) {
+        printf("  skipped O_DIRECT: not supported for %s\n", path);
+    } else {
+        for (int run = 0; run < runs; run++) {
+            size_t size = 0;
+            unsigned char* buffer = (unsigned char*)alloc_direct_io_buffer(arena, chunk_size, alignment, &size);
+            if (buffer == nullptr) { printf("  skipped O_DIRECT read: couldn't allocate an aligned buffer\n"); break; }
+            uint64_t start = bench_now_ns();
+            size_t total = 0;
+            for (;;) {
+                ssize_t n = pread(direct_fd, buffer, size, total);
+                if (n <= 0) break;
+                total += n;
+            }
+            bench_report("O_DIRECT read", bench_now_ns() - start, total);
+            arena.reset();
+        }
+    }
+
+    if (direct_fd >= 0) close(direct_fd);
+    close(fd);
+    unlink(path);
+    bench_backing_free(memory, arena_size);
+}
+
+// Read a local file and stream data over a local socket, plain read() into
+// malloc'd buffers vs. io_uring with the registered/provided IoBufferPool.
+// IO_URING_BENCH_SIZE picks how many bytes to move.
+// Move `total_size` bytes between `fd` and the pool's registered buffers with
+// READ_FIXED or WRITE_FIXED, keeping `queue_depth` requests in flight. Every
+// request has to move a whole buffer; on the first one that doesn't we say
+// why, wait for the rest to come back and don't report a number.
+bool bench_io_fixed(IoUring &ring, IoBufferPool &pool, int fd, bool write, size_t total_size, size_t buffer_size, unsigned queue_depth, const char *label) {
+    uint64_t start = bench_now_ns();
+    size_t total = 0;
+    size_t next_offset = 0;
+    unsigned in_flight = 0;
+    bool failed = false;
+    while (total < total_size && !failed) {
+        while (in_flight < queue_depth && next_offset < total_size) {
+            io_uring_sqe *sqe = ring.get_sqe();
+            void *buffer = pool.alloc();
+            if (write) { pool.prep_write_fixed(sqe, fd, buffer, buffer_size, next_offset); }
+            else { pool.prep_read_fixed(sqe, fd, buffer, buffer_size, next_offset); }
+            sqe->user_data = (uint64_t)(uintptr_t)buffer;
+            next_offset += buffer_size;
+            in_flight++;
+        }
+        int submitted = ring.submit(1);
+        if (submitted < 0) {
+            printf("  %s: submit failed: %s\n", label, strerror(-submitted));
+            failed = true;
+            break;
+        }
+        io_uring_cqe *cqe;
+        while ((cqe = ring.peek_cqe()) != nullptr) {
+            if (cqe->res != (int)buffer_size && !failed) {
+                printf("  %s: %s\n", label, cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+                failed = true;
+            }
+            if (cqe->res > 0) { total += cqe->res; }
+            pool.free((void*)(uintptr_t)cqe->user_data);
+            ring.cqe_seen();
+            in_flight--;
+        }
+    }
+    // The buffers have to come back before anyone else can use the pool.
+    while (in_flight > 0) {
+        io_uring_cqe *cqe = ring.wait_cqe();
+        if (cqe == nullptr) break;
+        pool.free((void*)(uintptr_t)cqe->user_data);
+        ring.cqe_seen();
+        in_flight--;
+    }
+    if (failed) return false;
+    bench_report(label, bench_now_ns() - start, total);
+    return true;
+}
+
+void bench_io_buffer_pool() {
+    bool ring_is_valid;
+    IoUring ring(ring_is_valid, 64);
+    if (!ring_is_valid) { printf("  skipped: io_uring unavailable\n"); ring.destroy(); return; }
+
+    size_t total_size = bench_env_size("IO_URING_BENCH_SIZE", 256ull * 1024 * 1024);
+    size_t buffer_size = 128 * 1024;
+    constexpr size_t num_buffers = 16;
+    constexpr unsigned queue_depth = 8;
+    total_size = forward_align(total_size, buffer_size);
+
+    size_t pool_size = (num_buffers + 1) * buffer_size;
+    unsigned char* memory = (unsigned char*)bench_backing_alloc(pool_size);
+    if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); ring.destroy(); return; }
+    bool pool_is_valid;
+    IoBufferPool pool(pool_is_valid, ring, memory, pool_size, buffer_size, 4096);
+    if (!pool_is_valid || pool.register_buffers() != 0) { printf("  skipped: can't register buffers\n"); ring.destroy(); bench_backing_free(memory, pool_size); return; }
+
+    char path[] = "/tmp/alloc_io_uring_bench_XXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    unsigned char* plain = (unsigned char*)std::malloc(buffer_size);
+    std::memset(plain, 0x5a, buffer_size);
+    for (size_t written = 0; written < total_size; written += buffer_size) {
+        if (write(fd, plain, buffer_size) != (ssize_t)buffer_size) break;
+    }
+
+    // File: pread, one buffer at a time.
+    uint64_t start = bench_now_ns();
+    size_t total = 0;
+    for (;;) {
+        ssize_t n = pread(fd, plain, buffer_size, total);
+        if (n <= 0) break;
+        total += n;
+    }
+    bench_report("file pread (malloc)", bench_now_ns() - start, total);
+
+    bench_io_fixed(ring, pool, fd, false, total_size, buffer_size, queue_depth, "file READ_FIXED (pool)");
+
+    // File: the same again the other way, overwriting what's there.
+    start = bench_now_ns();
+    total = 0;
+    while (total < total_size) {
+        ssize_t n = pwrite(fd, plain, buffer_size, total);
+        if (n <= 0) break;
+        total += n;
+    }
+    bench_report("file pwrite (malloc)", bench_now_ns() - start, total);
+    bench_io_fixed(ring, pool, fd, true, total_size, buffer_size, queue_depth, "file WRITE_FIXED (pool)");
+    close(fd);
+
+    // Socket: plain read() vs multishot recv into provided buffers. A writer
+    // thread pushes the same amount of data through a socketpair both times.
+    auto run_writer = [total_size](int fd) {
+        return std::thread([fd, total_size]() {
+            unsigned char chunk[64 * 1024];
+            std::memset(chunk, 0x33, sizeof(chunk));
+            for (size_t sent = 0; sent < total_size;) {
+                ssize_t n = write(fd, chunk, sizeof(chunk));
+                if (n <= 0) break;
+                sent += n;
+            }
+            shutdown(fd, SHUT_WR);
+        });
+    };
+
+    int sockets[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+    start = bench_now_ns();
+    std::thread writer = run_writer(sockets[1]);
+    total = 0;
+    for (;;) {
+        ssize_t n = read(sockets[0], plain, buffer_size);
+        if (n <= 0) break;
+        total += n;
+    }
+    writer.join();
+    bench_report("socket read (malloc)", bench_now_ns() - start, total);
+    close(sockets[0]);
+    close(sockets[1]);
+
+    unsigned char* ring_memory = (unsigned char*)std::malloc(2 * 4096);
+    Arena ring_arena(ring_memory, 2 * 4096);
+    if (pool.register_buf_ring(ring_arena, num_buffers, 1) != 0) {
+        printf("  skipped multishot recv: provided buffer rings unsupported\n");
+    } else {
+        pool.provide_from_pool(num_buffers);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+        start = bench_now_ns();
+        writer = run_writer(sockets[1]);
+        total = 0;
+        bool armed = false;
+        bool done = false;
+        while (!done) {
+            if (!armed) {
+                pool.prep_recv_multishot(ring.get_sqe(), sockets[0]);
+                armed = true;
+            }
+            ring.submit(1);
+            io_uring_cqe *cqe;
+            while ((cqe = ring.peek_cqe()) != nullptr) {
+                void *buffer = pool.cqe_buffer(cqe);
+                if (cqe->res > 0) { total += cqe->res; }
+                else if (cqe->res != -ENOBUFS) { done = true; }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) { armed = false; }
+                if (buffer != nullptr) { pool.provide(buffer); }
+                ring.cqe_seen();
+            }
+        }
+        writer.join();
+        bench_report("socket multishot recv (pool)", bench_now_ns() - start, total);
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    ring.destroy();
+    std::free(ring_memory);
+    std::free(plain);
+    bench_backing_free(memory, pool_size);
+}
+
+// Fill a spill arena with records and scan it back, at 0.5x, 1x and 2x of a
+// RAM budget. To actually see the spilling, run it somewhere that only has
+// that much memory, e.g.
+//     systemd-run --user --scope -p MemoryMax=256M ./build/main_bench bench spill
+// SPILL_BENCH_RAM sets the budget (default 256 MiB) and SPILL_BENCH_DIR where
+// the backing file goes (default build/, which should be on a real disk).
+void bench_spill_arena() {
+    size_t ram = bench_env_size("SPILL_BENCH_RAM", 256ull * 1024 * 1024);
+    const char *dir = getenv("SPILL_BENCH_DIR");
+    if (dir == nullptr) dir = "build";
+    size_t record_size = 4096;
+    size_t window = 16 * 1024 * 1024;
+
+    const double factors[] = { 0.5, 1.0, 2.0 };
+    for (double factor : factors) {
+        size_t size = forward_align((size_t)(ram * factor), record_size);
+        bool valid;
+        SpillArena arena(valid, dir, size);
+        if (!valid) { printf("  skipped: can't create spill arena in %s\n", dir); arena.destroy(); return; }
+
+        uint64_t start = bench_now_ns();
+        unsigned char *first = nullptr;
+        size_t records = 0;
+        size_t page_out_failures = 0;
+        for (;;) {
+            uint64_t *record = (uint64_t*)arena.alloc_aligned(record_size, 64);
+            if (record == nullptr) break;
+            if (first == nullptr) { first = (unsigned char*)record; }
+            record[0] = records;
+            record[record_size / sizeof(uint64_t) - 1] = records;
+            records++;
+            // The window of records before this one is cold now.
+            if (records % (window / record_size) == 0) {
+                unsigned char *cold = (unsigned char*)record + record_size - window;
+                if (!arena.page_out(cold, window - record_size)) { page_out_failures++; }
+            }
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "%.1fx fill", factor);
+        bench_report(label, bench_now_ns() - start, records * record_size);
+        if (page_out_failures > 0) { printf("  page_out failed %zu times, fill numbers include cold pages\n", page_out_failures); }
+
+        start = bench_now_ns();
+        arena.advise_sequential(first, records * record_size);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < records; i++) {
+            // Keep the next window on its way in while we chew on this one.
+            size_t ahead = (i * record_size) + window;
+            if (i % (window / record_size) == 0 && ahead < records * record_size) {
+                size_t remaining = records * record_size - ahead;
+                arena.prefetch(first + ahead, remaining < window ? remaining : window);
+            }
+            sum += *(uint64_t*)(first + i * record_size);
+        }
+        snprintf(label, sizeof(label), "%.1fx sequential scan", factor);
+        bench_report(label, bench_now_ns() - start, records * record_size);
+        if (sum != records * (records - 1) / 2) { printf("  bad checksum!\n"); }
+
+        arena.destroy();
+    }
+}
+
+struct BenchOrderLevel {
+    int64_t price;
+    int64_t quantity;
+    RbLink link;
+};
+
+struct BenchOrderLevelCompare {
+    static int compare(const BenchOrderLevel &a, const BenchOrderLevel &b) {
+        return a.price < b.price ? -1 : a.price > b.price ? 1 : 0;
+    }
+};
+
+// Order-book style churn: add price levels, look them up, drop them again.
+// Pool-backed intrusive red-black tree vs. std::map.
+void bench_intrusive_containers() {
+    constexpr size_t num_levels = 100000;
+    constexpr int rounds = 10;
+    int64_t *prices = (int64_t*)std::malloc(num_levels * sizeof(int64_t));
+    uint64_t rng = 88172645463325252ull;
+    for (size_t i = 0; i < num_levels; i++) {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        prices[i] = (int64_t)(rng % (num_levels * 16));
+    }
+
+    size_t pool_size = (num_levels + 1) * sizeof(BenchOrderLevel);
+    unsigned char *memory = (unsigned char*)bench_backing_alloc(pool_size);
+    if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); std::free(prices); return; }
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, pool_size, sizeof(BenchOrderLevel), alignof(BenchOrderLevel));
+    typedef IntrusiveRbTree<BenchOrderLevel, offsetof(BenchOrderLevel, link), BenchOrderLevelCompare> LevelTree;
+
+    int64_t checksum = 0;
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < rounds; round++) {
+        LevelTree tree = {};
+        for (size_t i = 0; i < num_levels; i++) {
+            BenchOrderLevel probe = { .price = prices[i] };
+            BenchOrderLevel *level = tree.find(probe);
+            if (level == nullptr) {
+                level = (BenchOrderLevel*)pool.alloc();
+                level->price = prices[i];
+                tree.insert(level);
+            }
+            level->quantity += 1;
+        }
+        for (size_t i = 0; i < num_levels; i++) {
+            BenchOrderLevel probe = { .price = prices[i] };
+            BenchOrderLevel *level = tree.find(probe);
+            if (level != nullptr) {
+                checksum += level->quantity;
+                tree.remove(level);
+                pool.free(level);
+            }
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+    printf("  %-32s %10.2f ms %10.1f ns/op\n", "intrusive rb tree + pool", ns / 1e6, (double)ns / (rounds * num_levels * 2));
+
+    int64_t map_checksum = 0;
+    start = bench_now_ns();
+    for (int round = 0; round < rounds; round++) {
+        std::map<int64_t, int64_t> tree;
+        for (size_t i = 0; i < num_levels; i++) { tree[prices[i]] += 1; }
+        for (size_t i = 0; i < num_levels; i++) {
+            auto level = tree.find(prices[i]);
+            if (level != tree.end()) {
+                map_checksum += level->second;
+                tree.erase(level);
+            }
+        }
+    }
+    ns = bench_now_ns() - start;
+    printf("  %-32s %10.2f ms %10.1f ns/op\n", "std::map", ns / 1e6, (double)ns / (rounds * num_levels * 2));
+    if (checksum != map_checksum) { printf("  checksums don't match!\n"); }
+
+    bench_backing_free(memory, pool_size);
+    std::free(prices);
+}
+
+// Build a sorted index of random keys and look every key up again, at a few
+// sizes. Arena-backed B+tree vs. std::map.
+void bench_btree() {
+    const size_t sizes[] = { 10000, 100000, 1000000 };
+    for (size_t num_keys : sizes) {
+        int32_t *keys = (int32_t*)std::malloc(num_keys * sizeof(int32_t));
+        uint64_t rng = 88172645463325252ull;
+        for (size_t i = 0; i < num_keys; i++) {
+            rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+            keys[i] = (int32_t)rng;
+        }
+
+        // Worst case every node is half full.
+        size_t arena_size = (2 * num_keys / BTREE_LEAF_KEYS + 64) * 2 * BTREE_NODE_SIZE;
+        unsigned char *memory = (unsigned char*)bench_backing_alloc(arena_size);
+        if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); std::free(keys); continue; }
+        Arena arena(memory, arena_size);
+        bool pool_is_valid;
+        Pool pool = make_btree_pool(pool_is_valid, arena, arena_size / BTREE_NODE_SIZE - 2);
+        BTree tree = { .m_pool = &pool };
+
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < num_keys; i++) { tree.insert(keys[i], i); }
+        uint64_t insert_ns = bench_now_ns() - start;
+        uint64_t checksum = 0;
+        start = bench_now_ns();
+        for (size_t i = 0; i < num_keys; i++) {
+            uint64_t value;
+            if (tree.find(keys[i], &value)) { checksum += value; }
+        }
+        uint64_t find_ns = bench_now_ns() - start;
+        printf("  %7zu keys  btree     insert %6.1f ns/key  find %6.1f ns/key\n",
+            num_keys, (double)insert_ns / num_keys, (double)find_ns / num_keys);
+
+        std::map<int32_t, uint64_t> map;
+        start = bench_now_ns();
+        for (size_t i = 0; i < num_keys; i++) { map[keys[i]] = i; }
+        insert_ns = bench_now_ns() - start;
+        uint64_t map_checksum = 0;
+        start = bench_now_ns();
+        for (size_t i = 0; i < num_keys; i++) {
+            auto it = map.find(keys[i]);
+            if (it != map.end()) { map_checksum += it->second; }
+        }
+        find_ns = bench_now_ns() - start;
+        printf("  %7zu keys  std::map  insert %6.1f ns/key  find %6.1f ns/key\n",
+            num_keys, (double)insert_ns / num_keys, (double)find_ns / num_keys);
+        if (checksum != map_checksum) { printf("  checksums don't match!\n"); }
+
+        // Throwing the whole tree away is just this.
+        arena.reset();
+        bench_backing_free(memory, arena_size);
+        std::free(keys);
+    }
+}
+
+void bench_timer_callback(Timer *timer, void *ctx) {
+    (*(size_t*)ctx)++;
+}
+
+// Connection-timeout style load: a million timers with random timeouts,
+// cancel half of them (the connections that finished in time), and run the
+// clock forward until the rest expire.
+void bench_timer_wheel() {
+    constexpr size_t num_timers = 1000000;
+    constexpr uint64_t max_timeout = 30000;
+    size_t pool_size = (num_timers + 1) * sizeof(Timer);
+    unsigned char *memory = (unsigned char*)bench_backing_alloc(pool_size);
+    if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); return; }
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, pool_size, sizeof(Timer), alignof(Timer));
+    TimerWheel *wheel = (TimerWheel*)std::calloc(1, sizeof(TimerWheel));
+    wheel->m_pool = &pool;
+    Timer **timers = (Timer**)std::malloc(num_timers * sizeof(Timer*));
+    size_t fired = 0;
+
+    constexpr int rounds = 3;
+    for (int round = 0; round < rounds; round++) {
+        uint64_t rng = 88172645463325252ull + round;
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < num_timers; i++) {
+            rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+            timers[i] = wheel->schedule(1 + rng % max_timeout, bench_timer_callback, &fired);
+        }
+        uint64_t insert_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        for (size_t i = 0; i < num_timers; i += 2) { wheel->cancel(timers[i]); }
+        uint64_t cancel_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        size_t expired = wheel->advance(wheel->m_now + max_timeout);
+        uint64_t expire_ns = bench_now_ns() - start;
+
+        printf("  insert %6.1f M/s  cancel %6.1f M/s  expire %6.1f M/s\n",
+            num_timers / (insert_ns / 1e3), (num_timers / 2) / (cancel_ns / 1e3), expired / (expire_ns / 1e3));
+    }
+    if (fired != rounds * num_timers / 2) { printf("  wrong number of timers fired!\n"); }
+
+    std::free(timers);
+    std::free(wheel);
+    bench_backing_free(memory, pool_size);
+}
+
+// The usual baseline: std::deque behind a mutex, condition variables for
+// full/empty, and every message malloc'd by the producer and freed by the
+// consumer.
+struct LockedQueue {
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<void*> items;
+    size_t capacity;
+
+    void enqueue(void *data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(data);
+        not_empty.notify_one();
+    }
+
+    void* dequeue() {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return !items.empty(); });
+        void *data = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return data;
+    }
+};
+
+// Producers send 64 byte messages to consumers. MPMC_BENCH_THREADS sets how
+// many of each (default 2), MPMC_BENCH_MESSAGES the total message count.
+void bench_mpmc_queue() {
+    constexpr size_t message_size = 64;
+    constexpr size_t queue_capacity = 1024;
+    size_t num_threads = bench_env_size("MPMC_BENCH_THREADS", 2);
+    size_t num_messages = bench_env_size("MPMC_BENCH_MESSAGES", 2000000);
+    size_t per_producer = num_messages / num_threads;
+    num_messages = per_producer * num_threads;
+    std::thread *threads = new std::thread[num_threads * 2];
+    // One stop message per consumer, recognizable by its first byte.
+    constexpr unsigned char stop = 0xff;
+
+    // Lock-free queue + concurrent pool
+    size_t pool_size = (queue_capacity * 4 + 1) * message_size;
+    size_t arena_size = queue_capacity * sizeof(MpmcCell) + CACHE_LINE_SIZE;
+    unsigned char *pool_memory = (unsigned char*)bench_backing_alloc(pool_size);
+    unsigned char *arena_memory = (unsigned char*)bench_backing_alloc(arena_size);
+    if (pool_memory == nullptr || arena_memory == nullptr) {
+        printf("  skipped mpmc + concurrent pool: couldn't allocate backing memory\n");
+    } else {
+        Arena arena(arena_memory, arena_size);
+        bool is_valid;
+        ConcurrentPool pool(is_valid, pool_memory, pool_size, message_size, CACHE_LINE_SIZE);
+        MpmcQueue queue(is_valid, arena, queue_capacity);
+
+        uint64_t start = bench_now_ns();
+        for (size_t t = 0; t < num_threads; t++) {
+            threads[t] = std::thread([&]() {
+                for (size_t i = 0; i < per_producer; i++) {
+                    unsigned char *message;
+                    while ((message = (unsigned char*)pool.alloc()) == nullptr) { std::this_thread::yield(); }
+                    message[0] = 1;
+                    queue.enqueue(message);
+                }
+            });
+            threads[num_threads + t] = std::thread([&]() {
+                for (;;) {
+                    unsigned char *message = (unsigned char*)queue.dequeue();
+                    bool done = message[0] == stop;
+                    pool.free(message);
+                    if (done) break;
+                }
+            });
+        }
+        for (size_t t = 0; t < num_threads; t++) { threads[t].join(); }
+        for (size_t t = 0; t < num_threads; t++) {
+            unsigned char *message;
+            while ((message = (unsigned char*)pool.alloc()) == nullptr) { std::this_thread::yield(); }
+            message[0] = stop;
+            queue.enqueue(message);
+        }
+        for (size_t t = 0; t < num_threads; t++) { threads[num_threads + t].join(); }
+        uint64_t ns = bench_now_ns() - start;
+        printf("  mpmc + concurrent pool  %6.1f M msg/s\n", num_messages / (ns / 1e3));
+    }
+    if (arena_memory != nullptr) bench_backing_free(arena_memory, arena_size);
+    if (pool_memory != nullptr) bench_backing_free(pool_memory, pool_size);
+
+    // Mutex + condvar + malloc
+    {
+        LockedQueue queue;
+        queue.capacity = queue_capacity;
+
+        uint64_t start = bench_now_ns();
+        for (size_t t = 0; t < num_threads; t++) {
+            threads[t] = std::thread([&]() {
+                for (size_t i = 0; i < per_producer; i++) {
+                    unsigned char *message = (unsigned char*)std::calloc(1, message_size);
+                    message[0] = 1;
+                    queue.enqueue(message);
+                }
+            });
+            threads[num_threads + t] = std::thread([&]() {
+                for (;;) {
+                    unsigned char *message = (unsigned char*)queue.dequeue();
+                    bool done = message[0] == stop;
+                    std::free(message);
+                    if (done) break;
+                }
+            });
+        }
+        for (size_t t = 0; t < num_threads; t++) { threads[t].join(); }
+        for (size_t t = 0; t < num_threads; t++) {
+            unsigned char *message = (unsigned char*)std::calloc(1, message_size);
+            message[0] = stop;
+            queue.enqueue(message);
+        }
+        for (size_t t = 0; t < num_threads; t++) { threads[num_threads + t].join(); }
+        uint64_t ns = bench_now_ns() - start;
+        printf("  mutex queue + malloc    %6.1f M msg/s\n", num_messages / (ns / 1e3));
+    }
+
+    delete[] threads;
+}
+
+uint64_t bench_fib_serial(uint32_t n) {
+    return n < 2 ? n : bench_fib_serial(n - 1) + bench_fib_serial(n - 2);
+}
+
+// std::async can't take millions of tasks (it's a thread each), so it only
+// forks down to `depth` and recurses serially below that.
+uint64_t bench_fib_async(uint32_t n, uint32_t depth) {
+    if (n < 2 || depth == 0) return bench_fib_serial(n);
+    std::future<uint64_t> left = std::async(std::launch::async, bench_fib_async, n - 1, depth - 1);
+    uint64_t right = bench_fib_async(n - 2, depth - 1);
+    return left.get() + right;
+}
+
+uint64_t bench_sum_async(const uint32_t *values, size_t count, uint32_t depth) {
+    if (depth == 0) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; i++) { total += values[i]; }
+        return total;
+    }
+    size_t half = count / 2;
+    std::future<uint64_t> left = std::async(std::launch::async, bench_sum_async, values, half, depth - 1);
+    uint64_t right = bench_sum_async(values + half, count - half, depth - 1);
+    return left.get() + right;
+}
+
+// Fork/join on the work-stealing scheduler: fib (one task per call, so it's
+// all overhead) and a reduction over an array (256 element leaves), at 1, 2,
+// 4, ... workers up to the core count. std::async is given the same problems
+// cut off a few levels down. WS_BENCH_FIB sets n (default 27).
+void bench_work_stealing() {
+    uint32_t fib_n = (uint32_t)bench_env_size("WS_BENCH_FIB", 27);
+    constexpr size_t sum_count = 1 << 24;
+    uint32_t *values = (uint32_t*)std::malloc(sum_count * sizeof(uint32_t));
+    uint64_t expected_sum = 0;
+    for (size_t i = 0; i < sum_count; i++) { values[i] = (uint32_t)i; expected_sum += i; }
+    uint64_t expected_fib = bench_fib_serial(fib_n);
+
+    uint32_t max_workers = std::thread::hardware_concurrency();
+    if (max_workers < 4) max_workers = 4;
+    constexpr size_t arena_size = 64 << 20;
+    unsigned char *arena_memory = (unsigned char*)bench_backing_alloc(arena_size);
+    if (arena_memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); std::free(values); return; }
+
+    for (uint32_t num_workers = 1; num_workers <= max_workers; num_workers *= 2) {
+        Arena arena(arena_memory, arena_size);
+        bool is_valid;
+        Scheduler scheduler(is_valid, arena, num_workers, 4096, 64 * 1024);
+        if (!is_valid) { printf("  couldn't create scheduler\n"); break; }
+
+        uint64_t result = 0;
+        FibTaskArgs fib_args = { fib_n, &result };
+        uint64_t start = bench_now_ns();
+        scheduler.run(fib_task, &fib_args, sizeof(fib_args));
+        uint64_t fib_ns = bench_now_ns() - start;
+        if (result != expected_fib) printf("  wrong fib!\n");
+
+        size_t executed = 0, stolen = 0;
+        for (uint32_t i = 0; i < num_workers; i++) {
+            executed += scheduler.m_workers[i]->m_executed;
+            stolen += scheduler.m_workers[i]->m_stolen;
+        }
+
+        SumTaskArgs sum_args = { values, sum_count, &result };
+        start = bench_now_ns();
+        scheduler.run(sum_task, &sum_args, sizeof(sum_args));
+        uint64_t sum_ns = bench_now_ns() - start;
+        if (result != expected_sum) printf("  wrong sum!\n");
+        scheduler.shutdown();
+
+        printf("  %2u workers  fib %8.2f ms (%6.1f M tasks/s, %zu stolen)  sum %8.2f ms\n",
+            num_workers, fib_ns / 1e6, executed / (fib_ns / 1e3), stolen, sum_ns / 1e6);
+    }
+
+    uint32_t depth = 6;
+    uint64_t start = bench_now_ns();
+    uint64_t fib = bench_fib_async(fib_n, depth);
+    uint64_t fib_ns = bench_now_ns() - start;
+    if (fib != expected_fib) printf("  wrong fib!\n");
+    start = bench_now_ns();
+    uint64_t sum = bench_sum_async(values, sum_count, depth);
+    uint64_t sum_ns = bench_now_ns() - start;
+    if (sum != expected_sum) printf("  wrong sum!\n");
+    printf("  std::async  fib %8.2f ms (%zu threads)                    sum %8.2f ms\n",
+        fib_ns / 1e6, ((size_t)1 << depth) - 1, sum_ns / 1e6);
+
+    bench_backing_free(arena_memory, arena_size);
+    std::free(values);
+}
+
+size_t bench_rss_bytes() {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr) return 0;
+    size_t pages = 0, resident = 0;
+    if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) resident = 0;
+    fclose(statm);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// A bursty arena: fill 256 MiB, reset, go idle, repeat. Shows RSS once idle
+// with no scavenger and with a scavenger using each advice, and how long a
+// pass takes. MADV_FREE pages still count towards RSS until the kernel
+// actually needs them, so only MADV_DONTNEED shows up here right away.
+void bench_scavenger() {
+    size_t arena_size = bench_env_size("SCAVENGE_BENCH_SIZE", 256 << 20);
+    unsigned char *memory = (unsigned char*)mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { printf("  mmap failed\n"); return; }
+    Arena arena(memory, arena_size);
+
+    const char *labels[] = { "no scavenger", "MADV_FREE", "MADV_DONTNEED" };
+    int advice[] = { -1, MADV_FREE, MADV_DONTNEED };
+    for (int run = 0; run < 3; run++) {
+        Scavenger scavenger(10, arena_size, advice[run] < 0 ? MADV_DONTNEED : advice[run]);
+        ScavengeHandle handle;
+        scavenger.register_arena(handle, arena);
+        handle.mark_idle();
+
+        uint64_t fill_ns = 0, scavenge_ns = 0;
+        size_t busy_rss = 0;
+        for (int burst = 0; burst < 4; burst++) {
+            handle.mark_active();
+            uint64_t start = bench_now_ns();
+            while (arena.alloc_aligned(64 * 1024, 64) != nullptr) {}
+            fill_ns += bench_now_ns() - start;
+            busy_rss = bench_rss_bytes();
+            arena.reset();
+            handle.mark_idle();
+            if (advice[run] >= 0) {
+                start = bench_now_ns();
+                while (scavenger.scavenge() != 0) {}
+                scavenge_ns += bench_now_ns() - start;
+            }
+        }
+        size_t idle_rss = bench_rss_bytes();
+        printf("  %-14s busy %6zu MiB  idle %6zu MiB  fill %8.2f ms  scavenge %6.2f ms  released %zu MiB\n",
+            labels[run], busy_rss >> 20, idle_rss >> 20, fill_ns / 4e6, scavenge_ns / 4e6, scavenger.released_bytes() >> 20);
+        scavenger.unregister(handle);
+    }
+    munmap(memory, arena_size);
+}
+
+// What publishing stats costs on the allocation path: small arena and pool
+// allocations with and without a stats entry. The segment goes to
+// STATS_BENCH_FILE (default /tmp/alloc_bench.stats) and is left there, so
+// `./build/main stats <file>` can watch a run or look at it afterwards.
+void bench_stats_segment() {
+    const char *path = getenv("STATS_BENCH_FILE");
+    if (path == nullptr) path = "/tmp/alloc_bench.stats";
+    StatsSegment segment = {};
+    if (!segment.create(path, 4)) { printf("  couldn't create %s\n", path); return; }
+
+    constexpr size_t arena_size = 64 << 20;
+    constexpr size_t alloc_size = 16;
+    constexpr size_t pool_chunks = 1 << 16;
+    unsigned char *memory = (unsigned char*)bench_backing_alloc(arena_size);
+    if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); segment.close(); return; }
+    // Fault it in first so the first run isn't paying for that.
+    std::memset(memory, 1, arena_size);
+    StatsEntry *arena_entry = segment.add("bench arena", STATS_ARENA, arena_size);
+    StatsEntry *pool_entry = segment.add("bench pool", STATS_POOL, pool_chunks * 64);
+    void **chunks = (void**)std::malloc(pool_chunks * sizeof(void*));
+
+    for (int with_stats = 0; with_stats < 2; with_stats++) {
+        Arena arena(memory, arena_size);
+        arena.m_stats = with_stats ? arena_entry : nullptr;
+        uint64_t start = bench_now_ns();
+        size_t count = 0;
+        while (arena.alloc_aligned(alloc_size, 8) != nullptr) { count++; }
+        uint64_t arena_ns = bench_now_ns() - start;
+
+        bool pool_is_valid;
+        Pool pool(pool_is_valid, memory, pool_chunks * 64, 64, 64);
+        pool.m_stats = with_stats ? pool_entry : nullptr;
+        start = bench_now_ns();
+        for (int round = 0; round < 64; round++) {
+            for (size_t i = 0; i < pool_chunks; i++) { chunks[i] = pool.alloc(); }
+            for (size_t i = 0; i < pool_chunks; i++) { pool.free(chunks[i]); }
+        }
+        uint64_t pool_ns = bench_now_ns() - start;
+
+        printf("  %-14s arena %6.2f ns/alloc  pool %6.2f ns/alloc+free\n",
+            with_stats ? "with stats" : "without stats", (double)arena_ns / count, (double)pool_ns / (64.0 * pool_chunks));
+    }
+    printf("  stats left in %s\n", path);
+
+    std::free(chunks);
+    bench_backing_free(memory, arena_size);
+    segment.close();
+}
+
+// The allocation fast paths on their own, one small allocation per call.
+// Each probe is kept out of line so `make disasm` has something to show:
+// it should be a few loads, compares and a store with the slow path off in
+// a cold function. Instructions are counted with perf_event_open where the
+// kernel lets us (perf_event_paranoid, containers), and include the few
+// instructions of the loop calling the probe.
+__attribute__((noinline)) void* alloc_probe_arena(Arena &arena) { return arena.alloc_aligned(16, 8); }
+__attribute__((noinline)) void* alloc_probe_tlab(Tlab &tlab) { return tlab.alloc_aligned(16, 8); }
+__attribute__((noinline)) void* alloc_probe_pool(Pool &pool) { return pool.alloc(); }
+
+// -1 if we can't count instructions here.
+int bench_open_instruction_counter() {
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void bench_counter_start(int fd) {
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+uint64_t bench_counter_stop(int fd) {
+    if (fd < 0) return 0;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count = 0;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+    return count;
+}
+
+void bench_report_fast_path(const char *label, uint64_t ns, uint64_t instructions, size_t count, int counter_fd) {
+    if (counter_fd < 0) {
+        printf("  %-10s %6.2f ns/alloc\n", label, (double)ns / count);
+    } else {
+        printf("  %-10s %6.2f ns/alloc %6.1f instructions/alloc\n", label, (double)ns / count, (double)instructions / count);
+    }
+}
+
+void bench_fast_path() {
+    constexpr size_t arena_size = 64 << 20;
+    constexpr size_t alloc_size = 16;
+    constexpr size_t pool_chunks = 1 << 16;
+    constexpr int rounds = 16;
+    int counter_fd = bench_open_instruction_counter();
+    if (counter_fd < 0) printf("  (can't count instructions here: %s)\n", strerror(errno));
+
+    unsigned char *memory = (unsigned char*)bench_backing_alloc(arena_size);
+    if (memory == nullptr) {
+        printf("  skipped: couldn't allocate backing memory\n");
+        if (counter_fd >= 0) close(counter_fd);
+        return;
+    }
+    // Fault it in first so we time the allocator and not the kernel.
+    std::memset(memory, 1, arena_size);
+
+    uint64_t ns = 0, instructions = 0;
+    size_t count = 0;
+    for (int round = 0; round < rounds; round++) {
+        Arena arena(memory, arena_size);
+        bench_counter_start(counter_fd);
+        uint64_t start = bench_now_ns();
+        while (alloc_probe_arena(arena) != nullptr) { count++; }
+        ns += bench_now_ns() - start;
+        instructions += bench_counter_stop(counter_fd);
+    }
+    bench_report_fast_path("arena", ns, instructions, count, counter_fd);
+
+    ns = 0, instructions = 0, count = 0;
+    for (int round = 0; round < rounds; round++) {
+        Arena shared(memory, arena_size);
+        Tlab tlab = { .m_shared = &shared, .m_block_size = 64 << 10 };
+        bench_counter_start(counter_fd);
+        uint64_t start = bench_now_ns();
+        while (alloc_probe_tlab(tlab) != nullptr) { count++; }
+        ns += bench_now_ns() - start;
+        instructions += bench_counter_stop(counter_fd);
+    }
+    bench_report_fast_path("tlab", ns, instructions, count, counter_fd);
+
+    // free_all() puts every chunk on the free list, so these are all pops
+    // and never bump chunks.
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, pool_chunks * alloc_size, alloc_size, 8);
+    ns = 0, instructions = 0, count = 0;
+    for (int round = 0; round < rounds; round++) {
+        pool.free_all();
+        bench_counter_start(counter_fd);
+        uint64_t start = bench_now_ns();
+        while (alloc_probe_pool(pool) != nullptr) { count++; }
+        ns += bench_now_ns() - start;
+        instructions += bench_counter_stop(counter_fd);
+    }
+    bench_report_fast_path("pool", ns, instructions, count, counter_fd);
+
+    if (counter_fd >= 0) close(counter_fd);
+    bench_backing_free(memory, arena_size);
+}
+
+// Allocation from cold memory with and without prefetching. The pool's free
+// list is freed in random order and then pushed out of cache, so every pop
+// misses on the head's next pointer unless it was prefetched. Walking a list
+// is serial however you prefetch it, so what prefetching buys is overlapping
+// the miss with whatever the caller does between allocations; each object
+// gets a bit of made-up initialization work to stand in for that. The arena
+// streams through memory that's faulted in but not cached. Hardware
+// prefetchers already do well on sequential bumps, so expect a much smaller
+// difference there than for the pool.
+void bench_prefetch() {
+    constexpr size_t chunk_size = 64;
+    constexpr size_t num_chunks = 1 << 20;
+    constexpr size_t memory_size = num_chunks * chunk_size;
+    constexpr size_t flush_size = 64 << 20;
+    unsigned char *memory = (unsigned char*)bench_backing_alloc(memory_size);
+    if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); return; }
+    unsigned char *flush = (unsigned char*)std::malloc(flush_size);
+    void **chunks = (void**)std::malloc(num_chunks * sizeof(void*));
+    std::memset(memory, 1, memory_size);
+
+    bool pool_is_valid;
+    Pool pool(pool_is_valid, memory, memory_size, chunk_size, chunk_size);
+    for (uint32_t distance = 0; distance <= 2; distance++) {
+        pool.m_prefetch_distance = 0;
+        pool.free_all();
+        for (size_t i = 0; i < num_chunks; i++) { chunks[i] = pool.alloc(); }
+        uint64_t rng = 88172645463325252ull;
+        for (size_t i = num_chunks - 1; i > 0; i--) {
+            rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+            size_t j = rng % (i + 1);
+            void *swap = chunks[i]; chunks[i] = chunks[j]; chunks[j] = swap;
+        }
+        for (size_t i = 0; i < num_chunks; i++) { pool.free(chunks[i]); }
+        std::memset(flush, (int)distance, flush_size);
+
+        pool.m_prefetch_distance = distance;
+        uint64_t start = bench_now_ns();
+        uint64_t value = 1;
+        while (uint64_t *object = (uint64_t*)pool.alloc()) {
+            for (int i = 0; i < 64; i++) { value = value * 6364136223846793005ull + 1442695040888963407ull; }
+            *object = value;
+        }
+        uint64_t ns = bench_now_ns() - start;
+        printf("  cold pool   prefetch distance %u  %6.2f ns/alloc\n", distance, (double)ns / num_chunks);
+    }
+
+    const size_t ahead[] = { 0, 256, 1024 };
+    for (size_t prefetch_ahead : ahead) {
+        std::memset(flush, 2, flush_size);
+        Arena arena(memory, memory_size);
+        arena.m_prefetch_ahead = prefetch_ahead;
+        size_t count = 0;
+        uint64_t start = bench_now_ns();
+        while (arena.alloc_aligned(48, 16) != nullptr) { count++; }
+        uint64_t ns = bench_now_ns() - start;
+        printf("  cold arena  prefetch ahead %5zu  %6.2f ns/alloc\n", prefetch_ahead, (double)ns / count);
+    }
+
+    std::free(chunks);
+    std::free(flush);
+    bench_backing_free(memory, memory_size);
+}
+
+// The obvious baseline: one Pool behind one mutex.
+struct LockedPool {
+    Pool *pool;
+    std::mutex mutex;
+
+    void* alloc() { std::lock_guard<std::mutex> lock(mutex); return pool->alloc(); }
+    bool free(void *ptr) { std::lock_guard<std::mutex> lock(mutex); return pool->free(ptr); }
+};
+
+// Every thread keeps a few chunks live and swaps the oldest for a new one,
+// so allocs and frees are interleaved the way a request handler would do it.
+template <typename P>
+uint64_t bench_pool_churn(P &pool, size_t num_threads, size_t ops_per_thread) {
+    std::thread *threads = new std::thread[num_threads];
+    uint64_t start = bench_now_ns();
+    for (size_t t = 0; t < num_threads; t++) {
+        threads[t] = std::thread([&pool, ops_per_thread]() {
+            void *held[8] = {};
+            for (size_t i = 0; i < ops_per_thread; i++) {
+                void *&slot = held[i % 8];
+                if (slot != nullptr) pool.free(slot);
+                while ((slot = pool.alloc()) == nullptr) { std::this_thread::yield(); }
+            }
+            for (void *chunk : held) { pool.free(chunk); }
+        });
+    }
+    for (size_t t = 0; t < num_threads; t++) { threads[t].join(); }
+    uint64_t ns = bench_now_ns() - start;
+    delete[] threads;
+    return ns;
+}
+
+// Alloc/free churn at increasing thread counts: mutex Pool vs. the single
+// lock-free stack of ConcurrentPool vs. StripedPool with a stripe per thread
+// (up to STRIPED_BENCH_STRIPES, default 16). Run it on a machine with at
+// least as many cores as threads, otherwise there's little to contend on.
+void bench_striped_pool() {
+    constexpr size_t chunk_size = 64;
+    constexpr size_t num_chunks = 1 << 14;
+    constexpr size_t pool_size = (num_chunks + 1) * chunk_size;
+    size_t max_stripes = bench_env_size("STRIPED_BENCH_STRIPES", 16);
+    size_t total_ops = bench_env_size("STRIPED_BENCH_OPS", 4000000);
+    unsigned char *pool_memory = (unsigned char*)bench_backing_alloc(pool_size);
+    size_t arena_size = max_stripes * sizeof(ConcurrentFreeStack) + CACHE_LINE_SIZE;
+    unsigned char *arena_memory = (unsigned char*)bench_backing_alloc(arena_size);
+    if (pool_memory == nullptr || arena_memory == nullptr) {
+        printf("  skipped: couldn't allocate backing memory\n");
+        if (arena_memory != nullptr) bench_backing_free(arena_memory, arena_size);
+        if (pool_memory != nullptr) bench_backing_free(pool_memory, pool_size);
+        return;
+    }
+
+    const size_t thread_counts[] = { 1, 2, 4, 8, 16 };
+    for (size_t num_threads : thread_counts) {
+        size_t ops_per_thread = total_ops / num_threads;
+        double ops = (double)ops_per_thread * num_threads;
+        bool is_valid;
+
+        Pool pool(is_valid, pool_memory, pool_size, chunk_size, chunk_size);
+        LockedPool locked = { .pool = &pool };
+        uint64_t locked_ns = bench_pool_churn(locked, num_threads, ops_per_thread);
+
+        ConcurrentPool concurrent(is_valid, pool_memory, pool_size, chunk_size, chunk_size);
+        uint64_t concurrent_ns = bench_pool_churn(concurrent, num_threads, ops_per_thread);
+
+        Arena arena(arena_memory, arena_size);
+        size_t num_stripes = num_threads < max_stripes ? num_threads : max_stripes;
+        StripedPool striped(is_valid, pool_memory, pool_size, chunk_size, chunk_size, arena, num_stripes);
+        uint64_t striped_ns = bench_pool_churn(striped, num_threads, ops_per_thread);
+
+        printf("  %2zu threads  mutex %6.1f  concurrent %6.1f  striped %6.1f  M ops/s\n",
+            num_threads, ops / (locked_ns / 1e3), ops / (concurrent_ns / 1e3), ops / (striped_ns / 1e3));
+    }
+
+    bench_backing_free(arena_memory, arena_size);
+    bench_backing_free(pool_memory, pool_size);
+}
+
+// How long the loop stalls to free everything in a big pool: free_all()
+// pushing every chunk vs. reset() moving the bump cursor, and what the next
+// round of allocations costs after each (bumping vs. popping).
+void bench_pool_reset() {
+    constexpr size_t chunk_size = 64;
+    const size_t sizes[] = { 1 << 14, 1 << 18, 1 << 22 };
+    for (size_t num_chunks : sizes) {
+        size_t pool_size = num_chunks * chunk_size;
+        unsigned char *memory = (unsigned char*)bench_backing_alloc(pool_size);
+        if (memory == nullptr) { printf("  skipped: couldn't allocate backing memory\n"); continue; }
+        bool pool_is_valid;
+        Pool pool(pool_is_valid, memory, pool_size, chunk_size, chunk_size);
+
+        for (int eager = 1; eager >= 0; eager--) {
+            while (pool.alloc() != nullptr) {}
+            uint64_t start = bench_now_ns();
+            if (eager) pool.free_all();
+            else pool.reset();
+            uint64_t reset_ns = bench_now_ns() - start;
+            start = bench_now_ns();
+            while (pool.alloc() != nullptr) {}
+            uint64_t alloc_ns = bench_now_ns() - start;
+            printf("  %8zu chunks  %-8s %10.3f ms  then %6.2f ns/alloc\n",
+                num_chunks, eager ? "free_all" : "reset", reset_ns / 1e6, (double)alloc_ns / num_chunks);
+        }
+
+        bench_backing_free(memory, pool_size);
+    }
+}
+
+//============================== WORKLOADS ==============================//
+
+// Whole-program style workloads instead of allocation loops: parsing JSON
+// into a DOM, building/folding/evaluating expression trees, BFS over a graph
+// built from edge nodes, an LRU cache with churn, and HTTP-ish request
+// handling. Each one runs over every allocator and reports throughput, peak
+// RSS and how many allocations and frees it made.
+//
+// WORKLOAD_SCALE multiplies how much work each one does (default 1) and
+// WORKLOAD picks workloads by name, e.g. `WORKLOAD=lru make bench FILTER=workloads`.
+
+// Workloads allocate through one of these so the same code runs over every
+// allocator. Counting happens here so no allocator needs stats attached.
+// Sizes are passed back on free because size-class pools need them.
+struct WorkloadAllocator {
+    void *ctx;
+    void* (*alloc_fn)(void *ctx, size_t bytes, size_t align);
+    void (*free_fn)(void *ctx, void *ptr, size_t bytes);
+    // Called at the end of every unit of work (a document, a request...),
+    // after everything it allocated has been freed.
+    void (*reset_fn)(void *ctx);
+    size_t allocs;
+    size_t frees;
+    size_t failures;
+
+    void* alloc(size_t bytes, size_t align = 8) {
+        void *ptr = alloc_fn(ctx, bytes, align);
+        if (ptr == nullptr) { failures++; return nullptr; }
+        allocs++;
+        return ptr;
+    }
+
+    void free(void *ptr, size_t bytes) {
+        if (ptr == nullptr) return;
+        frees++;
+        free_fn(ctx, ptr, bytes);
+    }
+
+    void reset() { reset_fn(ctx); }
+};
+
+// Everything else hands out zeroed memory, so malloc gets to as well.
+void* workload_malloc_alloc(void *ctx, size_t bytes, size_t align) { return std::calloc(1, bytes); }
+void workload_malloc_free(void *ctx, void *ptr, size_t bytes) { std::free(ptr); }
+void workload_nop_reset(void *ctx) {}
+
+void* workload_arena_alloc(void *ctx, size_t bytes, size_t align) { return ((Arena*)ctx)->alloc_aligned(bytes, align); }
+void workload_arena_free(void *ctx, void *ptr, size_t bytes) {}
+void workload_arena_reset(void *ctx) { ((Arena*)ctx)->reset(); }
+
+// Out-of-order frees are refused and only come back on reset.
+void* workload_stack_alloc(void *ctx, size_t bytes, size_t align) { return ((Stack*)ctx)->alloc_aligned(bytes, align); }
+void workload_stack_free(void *ctx, void *ptr, size_t bytes) { ((Stack*)ctx)->free(ptr); }
+void workload_stack_reset(void *ctx) { ((Stack*)ctx)->reset(); }
+
+// Size classes of 16, 32, ... 512 bytes, one Pool each. Anything bigger, or
+// anything that doesn't fit once a class is full, goes to malloc or, when
+// there's an overflow arena, to the arena until the end of the unit.
+constexpr size_t WORKLOAD_NUM_CLASSES = 6;
+constexpr size_t WORKLOAD_MAX_CLASS = 16 << (WORKLOAD_NUM_CLASSES - 1);
+
+struct WorkloadPools {
+    Pool *classes;
+    Arena *overflow;
+};
+
+size_t workload_size_class(size_t bytes) { return bytes <= 16 ? 0 : 64 - __builtin_clzll(bytes - 1) - 4; }
+
+void* workload_pools_alloc(void *ctx, size_t bytes, size_t align) {
+    WorkloadPools *pools = (WorkloadPools*)ctx;
+    if (bytes <= WORKLOAD_MAX_CLASS) {
+        void *chunk = pools->classes[workload_size_class(bytes)].alloc();
+        if (chunk != nullptr) return chunk;
+    }
+    if (pools->overflow != nullptr) return pools->overflow->alloc_aligned(bytes, align);
+    return std::calloc(1, bytes);
+}
+
+void workload_pools_free(void *ctx, void *ptr, size_t bytes) {
+    WorkloadPools *pools = (WorkloadPools*)ctx;
+    if (bytes <= WORKLOAD_MAX_CLASS && pools->classes[workload_size_class(bytes)].free(ptr)) return;
+    if (pools->overflow == nullptr) std::free(ptr);
+}
+
+void workload_pools_reset(void *ctx) {
+    WorkloadPools *pools = (WorkloadPools*)ctx;
+    if (pools->overflow != nullptr) pools->overflow->reset();
+}
+
+uint64_t workload_random(uint64_t &state) {
+    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+    return state;
+}
+
+char* workload_copy(WorkloadAllocator &allocator, const char *text, size_t length) {
+    char *copy = (char*)allocator.alloc(length + 1, 1);
+    if (copy != nullptr) std::memcpy(copy, text, length);
+    return copy;
+}
+
+//---------------------------- JSON DOM ----------------------------//
+
+enum JsonType : uint8_t { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+struct JsonValue {
+    JsonType type;
+    bool boolean;
+    uint32_t key_length;
+    uint32_t length;
+    // Set when this is a member of an object.
+    char *key;
+    char *string;
+    double number;
+    JsonValue *first_child;
+    JsonValue *next_sibling;
+};
+
+struct JsonWriter {
+    char *out;
+    size_t length;
+    size_t capacity;
+};
+
+void json_write_value(JsonWriter &w, uint64_t &rng, int depth) {
+    uint64_t r = workload_random(rng);
+    int kind = depth == 0 ? r % 4 : r % 6;
+    char *at = w.out + w.length;
+    size_t left = w.capacity - w.length;
+    switch (kind) {
+        case 0: w.length += snprintf(at, left, "%.3f", (double)(r >> 40) / 7.0); break;
+        case 1: w.length += snprintf(at, left, "%s", r & 0x100 ? "true" : r & 0x200 ? "false" : "null"); break;
+        case 2: case 3: {
+            int length = 2 + (r >> 16) % 30;
+            w.length += snprintf(at, left, "\"%.*s\"", length, "the quick brown fox jumps over the lazy dog");
+            break;
+        }
+        default: {
+            bool object = kind == 5;
+            size_t count = 1 + (r >> 24) % 6;
+            w.out[w.length++] = object ? '{' : '[';
+            for (size_t i = 0; i < count; i++) {
+                if (i > 0) w.out[w.length++] = ',';
+                if (object) w.length += snprintf(w.out + w.length, w.capacity - w.length, "\"k%zu\":", i);
+                json_write_value(w, rng, depth - 1);
+            }
+            w.out[w.length++] = object ? '}' : ']';
+        }
+    }
+}
+
+// A top-level object of `target` bytes or a bit more. Nested values are at
+// most a few thousand bytes, hence the slack.
+char* json_generate(size_t target, uint64_t &rng) {
+    JsonWriter w = { .out = (char*)std::malloc(target + (64 << 10)), .capacity = target + (64 << 10) };
+    w.out[w.length++] = '{';
+    for (size_t i = 0; w.length < target; i++) {
+        if (i > 0) w.out[w.length++] = ',';
+        w.length += snprintf(w.out + w.length, w.capacity - w.length, "\"member%zu\":", i);
+        json_write_value(w, rng, 3);
+    }
+    w.out[w.length++] = '}';
+    w.out[w.length] = '\0';
+    return w.out;
+}
+
+struct JsonParser {
+    const char *at;
+    WorkloadAllocator *allocator;
+};
+
+void json_skip_whitespace(JsonParser &p) {
+    while (*p.at == ' ' || *p.at == '\n' || *p.at == '\r' || *p.at == '\t') p.at++;
+}
+
+bool json_parse_string(JsonParser &p, char **out, uint32_t *out_length) {
+    if (*p.at != '"') return false;
+    const char *start = ++p.at;
+    uint32_t length = 0;
+    for (; *p.at != '"'; p.at++, length++) {
+        if (*p.at == '\0') return false;
+        if (*p.at == '\\' && *++p.at == '\0') return false;
+    }
+    char *copy = (char*)p.allocator->alloc(length + 1, 1);
+    if (copy == nullptr) return false;
+    for (uint32_t i = 0; i < length; i++, start++) {
+        if (*start == '\\') start++;
+        copy[i] = *start;
+    }
+    p.at++;
+    *out = copy;
+    *out_length = length;
+    return true;
+}
+
+// Children are linked in as soon as they're allocated, so whatever was built
+// before a failure can still be freed from the root.
+bool json_parse_into(JsonParser &p, JsonValue *value) {
+    json_skip_whitespace(p);
+    char c = *p.at;
+    if (c == '{' || c == '[') {
+        bool object = c == '{';
+        char close = object ? '}' : ']';
+        value->type = object ? JSON_OBJECT : JSON_ARRAY;
+        p.at++;
+        json_skip_whitespace(p);
+        if (*p.at == close) { p.at++; return true; }
+        JsonValue **tail = &value->first_child;
+        for (;;) {
+            JsonValue *child = (JsonValue*)p.allocator->alloc(sizeof(JsonValue));
+            if (child == nullptr) return false;
+            *tail = child;
+            tail = &child->next_sibling;
+            if (object) {
+                json_skip_whitespace(p);
+                if (!json_parse_string(p, &child->key, &child->key_length)) return false;
+                json_skip_whitespace(p);
+                if (*p.at++ != ':') return false;
+            }
+            if (!json_parse_into(p, child)) return false;
+            json_skip_whitespace(p);
+            char next = *p.at++;
+            if (next == ',') continue;
+            return next == close;
+        }
+    }
+    if (c == '"') {
+        value->type = JSON_STRING;
+        return json_parse_string(p, &value->string, &value->length);
+    }
+    if (std::strncmp(p.at, "true", 4) == 0 || std::strncmp(p.at, "false", 5) == 0) {
+        value->type = JSON_BOOL;
+        value->boolean = c == 't';
+        p.at += value->boolean ? 4 : 5;
+        return true;
+    }
+    if (std::strncmp(p.at, "null", 4) == 0) {
+        value->type = JSON_NULL;
+        p.at += 4;
+        return true;
+    }
+    char *end;
+    value->type = JSON_NUMBER;
+    value->number = strtod(p.at, &end);
+    if (end == p.at) return false;
+    p.at = end;
+    return true;
+}
+
+void json_free(WorkloadAllocator &allocator, JsonValue *value) {
+    JsonValue *child = value->first_child;
+    while (child != nullptr) {
+        JsonValue *next = child->next_sibling;
+        json_free(allocator, child);
+        child = next;
+    }
+    if (value->key != nullptr) allocator.free(value->key, value->key_length + 1);
+    if (value->string != nullptr) allocator.free(value->string, value->length + 1);
+    allocator.free(value, sizeof(JsonValue));
+}
+
+uint64_t json_checksum(JsonValue *value) {
+    uint64_t sum = value->type + value->key_length + value->length + value->boolean + (uint64_t)value->number;
+    for (JsonValue *child = value->first_child; child != nullptr; child = child->next_sibling) {
+        sum = sum * 31 + json_checksum(child);
+    }
+    return sum;
+}
+
+// Unit: parsing one ~64 KiB document into a DOM, walking it and freeing it.
+size_t workload_json(WorkloadAllocator &allocator, size_t units, uint64_t &checksum) {
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    char *text = json_generate(64 << 10, rng);
+    size_t done = 0;
+    for (; done < units; done++) {
+        JsonParser parser = { .at = text, .allocator = &allocator };
+        JsonValue *root = (JsonValue*)allocator.alloc(sizeof(JsonValue));
+        if (root == nullptr) break;
+        bool parsed = json_parse_into(parser, root);
+        if (parsed) checksum = checksum * 31 + json_checksum(root);
+        json_free(allocator, root);
+        allocator.reset();
+        if (!parsed) break;
+    }
+    std::free(text);
+    return done;
+}
+
+//------------------------------ AST -------------------------------//
+
+enum AstKind : uint8_t { AST_NUMBER, AST_VARIABLE, AST_NEGATE, AST_ADD, AST_SUBTRACT, AST_MULTIPLY };
+
+constexpr size_t AST_NUM_VARIABLES = 8;
+
+struct AstNode {
+    AstKind kind;
+    uint32_t variable;
+    uint64_t value;
+    AstNode *left;
+    AstNode *right;
+};
+
+// Children of a node whose allocation failed are just missing, the caller
+// checks the allocator's failure count before using the tree.
+AstNode* ast_build(WorkloadAllocator &allocator, uint64_t &rng, int depth) {
+    AstNode *node = (AstNode*)allocator.alloc(sizeof(AstNode));
+    if (node == nullptr) return nullptr;
+    uint64_t r = workload_random(rng);
+    if (depth == 0 || r % 8 == 0) {
+        if ((r >> 8) % 4 != 0) {
+            node->kind = AST_NUMBER;
+            node->value = (r >> 32) % 100;
+        } else {
+            node->kind = AST_VARIABLE;
+            node->variable = (r >> 16) % AST_NUM_VARIABLES;
+        }
+        return node;
+    }
+    node->kind = (AstKind)(AST_NEGATE + (r >> 8) % 4);
+    node->left = ast_build(allocator, rng, depth - 1);
+    if (node->kind != AST_NEGATE) node->right = ast_build(allocator, rng, depth - 1);
+    return node;
+}
+
+void ast_free(WorkloadAllocator &allocator, AstNode *node) {
+    if (node == nullptr) return;
+    ast_free(allocator, node->left);
+    ast_free(allocator, node->right);
+    allocator.free(node, sizeof(AstNode));
+}
+
+// Wraps around on overflow, we only care that folding doesn't change it.
+uint64_t ast_evaluate(AstNode *node, const uint64_t *variables) {
+    switch (node->kind) {
+        case AST_NUMBER: return node->value;
+        case AST_VARIABLE: return variables[node->variable];
+        case AST_NEGATE: return 0 - ast_evaluate(node->left, variables);
+        case AST_ADD: return ast_evaluate(node->left, variables) + ast_evaluate(node->right, variables);
+        case AST_SUBTRACT: return ast_evaluate(node->left, variables) - ast_evaluate(node->right, variables);
+        case AST_MULTIPLY: return ast_evaluate(node->left, variables) * ast_evaluate(node->right, variables);
+    }
+    return 0;
+}
+
+// Replaces every subtree without variables by a single number node.
+AstNode* ast_fold(WorkloadAllocator &allocator, AstNode *node) {
+    if (node->kind == AST_NUMBER || node->kind == AST_VARIABLE) return node;
+    node->left = ast_fold(allocator, node->left);
+    if (node->right != nullptr) node->right = ast_fold(allocator, node->right);
+    if (node->left->kind != AST_NUMBER || (node->right != nullptr && node->right->kind != AST_NUMBER)) return node;
+    AstNode *folded = (AstNode*)allocator.alloc(sizeof(AstNode));
+    if (folded == nullptr) return node;
+    folded->kind = AST_NUMBER;
+    folded->value = ast_evaluate(node, nullptr);
+    ast_free(allocator, node);
+    return folded;
+}
+
+// Unit: building an expression of up to a few thousand nodes, evaluating
+// it, constant folding it and evaluating it again.
+size_t workload_ast(WorkloadAllocator &allocator, size_t units, uint64_t &checksum) {
+    uint64_t rng = 0x2545f4914f6cdd1dull;
+    size_t done = 0;
+    for (; done < units; done++) {
+        uint64_t variables[AST_NUM_VARIABLES];
+        for (uint64_t &variable : variables) { variable = workload_random(rng) % 1000; }
+        AstNode *root = ast_build(allocator, rng, 14);
+        bool complete = allocator.failures == 0;
+        if (complete) {
+            uint64_t before = ast_evaluate(root, variables);
+            root = ast_fold(allocator, root);
+            uint64_t after = ast_evaluate(root, variables);
+            checksum = checksum * 31 + before + (before != after);
+        }
+        ast_free(allocator, root);
+        allocator.reset();
+        if (!complete) break;
+    }
+    return done;
+}
+
+//------------------------------ BFS -------------------------------//
+
+struct GraphEdge {
+    uint32_t to;
+    GraphEdge *next;
+};
+
+// Unit: building a random graph of 4096 vertices and 32768 edges as
+// adjacency lists of edge nodes, and a BFS over it.
+size_t workload_bfs(WorkloadAllocator &allocator, size_t units, uint64_t &checksum) {
+    constexpr uint32_t num_vertices = 4096;
+    constexpr uint32_t num_edges = 16384;
+    uint64_t rng = 0xda942042e4dd58b5ull;
+    size_t done = 0;
+    for (; done < units; done++) {
+        GraphEdge **adjacent = (GraphEdge**)allocator.alloc(num_vertices * sizeof(GraphEdge*));
+        uint32_t *distance = (uint32_t*)allocator.alloc(num_vertices * sizeof(uint32_t), 4);
+        uint32_t *queue = (uint32_t*)allocator.alloc(num_vertices * sizeof(uint32_t), 4);
+        bool complete = adjacent != nullptr && distance != nullptr && queue != nullptr;
+        for (uint32_t i = 0; complete && i < num_edges; i++) {
+            uint64_t r = workload_random(rng);
+            uint32_t from = r % num_vertices, to = (r >> 32) % num_vertices;
+            GraphEdge *forward = (GraphEdge*)allocator.alloc(sizeof(GraphEdge));
+            GraphEdge *backward = (GraphEdge*)allocator.alloc(sizeof(GraphEdge));
+            if (forward != nullptr) { *forward = { to, adjacent[from] }; adjacent[from] = forward; }
+            if (backward != nullptr) { *backward = { from, adjacent[to] }; adjacent[to] = backward; }
+            complete = forward != nullptr && backward != nullptr;
+        }
+
+        if (complete) {
+            for (uint32_t v = 0; v < num_vertices; v++) { distance[v] = UINT32_MAX; }
+            uint32_t head = 0, tail = 0;
+            distance[0] = 0;
+            queue[tail++] = 0;
+            uint64_t sum = 0;
+            while (head < tail) {
+                uint32_t v = queue[head++];
+                sum += distance[v];
+                for (GraphEdge *edge = adjacent[v]; edge != nullptr; edge = edge->next) {
+                    if (distance[edge->to] != UINT32_MAX) continue;
+                    distance[edge->to] = distance[v] + 1;
+                    queue[tail++] = edge->to;
+                }
+            }
+            checksum = checksum * 31 + sum + tail;
+        }
+
+        for (uint32_t v = 0; adjacent != nullptr && v < num_vertices; v++) {
+            GraphEdge *edge = adjacent[v];
+            while (edge != nullptr) {
+                GraphEdge *next = edge->next;
+                allocator.free(edge, sizeof(GraphEdge));
+                edge = next;
+            }
+        }
+        allocator.free(queue, num_vertices * sizeof(uint32_t));
+        allocator.free(distance, num_vertices * sizeof(uint32_t));
+        allocator.free(adjacent, num_vertices * sizeof(GraphEdge*));
+        allocator.reset();
+        if (!complete) break;
+    }
+    return done;
+}
+
+//------------------------------ LRU -------------------------------//
+
+struct LruEntry {
+    uint64_t key;
+    LruEntry *hash_next;
+    LruEntry *prev;
+    LruEntry *next;
+    uint32_t value_size;
+    unsigned char *value;
+};
+
+// Unit: 1000 lookups in a 16384-entry cache over 262144 keys, skewed towards
+// low keys. Misses allocate an entry and a 16-256 byte value and evict the
+// least recently used entry once full. Nothing is reset until the end, so
+// allocators that can't reuse freed memory just keep growing.
+size_t workload_lru(WorkloadAllocator &allocator, size_t units, uint64_t &checksum) {
+    constexpr size_t capacity = 16384;
+    constexpr size_t num_buckets = 32768;
+    constexpr uint64_t num_keys = 262144;
+    uint64_t rng = 0x853c49e6748fea9bull;
+    LruEntry **buckets = (LruEntry**)allocator.alloc(num_buckets * sizeof(LruEntry*));
+    if (buckets == nullptr) return 0;
+    LruEntry *newest = nullptr, *oldest = nullptr;
+    size_t count = 0;
+
+    size_t done = 0;
+    bool complete = true;
+    for (; complete && done < units; done++) {
+        for (int op = 0; op < 1000; op++) {
+            uint64_t r = workload_random(rng);
+            uint64_t key = (r % num_keys) % ((r >> 40) % num_keys + 1);
+            LruEntry **bucket = &buckets[(key * 0x9e3779b97f4a7c15ull) >> 49];
+            LruEntry *entry = *bucket;
+            while (entry != nullptr && entry->key != key) entry = entry->hash_next;
+
+            if (entry != nullptr) {
+                checksum += entry->value[entry->value_size - 1];
+                if (entry == newest) continue;
+                // Unlink, then move to the front.
+                entry->prev->next = entry->next;
+                if (entry->next != nullptr) entry->next->prev = entry->prev;
+                else oldest = entry->prev;
+            } else {
+                entry = (LruEntry*)allocator.alloc(sizeof(LruEntry));
+                uint32_t value_size = 16 + (key * 2654435761u) % 241;
+                unsigned char *value = (unsigned char*)allocator.alloc(value_size, 1);
+                if (entry == nullptr || value == nullptr) {
+                    allocator.free(entry, sizeof(LruEntry));
+                    allocator.free(value, value_size);
+                    complete = false;
+                    break;
+                }
+                entry->key = key;
+                entry->value_size = value_size;
+                entry->value = value;
+                std::memset(value, (int)key, value_size);
+                entry->hash_next = *bucket;
+                *bucket = entry;
+                count++;
+                if (oldest == nullptr) oldest = entry;
+            }
+            entry->prev = nullptr;
+            entry->next = newest;
+            if (newest != nullptr) newest->prev = entry;
+            newest = entry;
+
+            if (count > capacity) {
+                LruEntry *victim = oldest;
+                oldest = victim->prev;
+                oldest->next = nullptr;
+                LruEntry **link = &buckets[(victim->key * 0x9e3779b97f4a7c15ull) >> 49];
+                while (*link != victim) link = &(*link)->hash_next;
+                *link = victim->hash_next;
+                allocator.free(victim->value, victim->value_size);
+                allocator.free(victim, sizeof(LruEntry));
+                count--;
+            }
+        }
+    }
+
+    while (newest != nullptr) {
+        LruEntry *next = newest->next;
+        allocator.free(newest->value, newest->value_size);
+        allocator.free(newest, sizeof(LruEntry));
+        newest = next;
+    }
+    allocator.free(buckets, num_buckets * sizeof(LruEntry*));
+    allocator.reset();
+    return complete ? done : done - 1;
+}
+
+//------------------------------ HTTP ------------------------------//
+
+struct HttpHeader {
+    char *name;
+    char *value;
+    uint32_t name_length;
+    uint32_t value_length;
+    HttpHeader *next;
+};
+
+struct HttpRequest {
+    char *method;
+    char *path;
+    uint32_t method_length;
+    uint32_t path_length;
+    HttpHeader *headers;
+};
+
+struct HttpResponse {
+    uint32_t status;
+    HttpHeader *headers;
+    unsigned char *body;
+    size_t body_size;
+};
+
+HttpHeader* http_add_header(WorkloadAllocator &allocator, HttpHeader **list, const char *name, size_t name_length, const char *value, size_t value_length) {
+    HttpHeader *header = (HttpHeader*)allocator.alloc(sizeof(HttpHeader));
+    if (header == nullptr) return nullptr;
+    header->next = *list;
+    *list = header;
+    header->name = workload_copy(allocator, name, name_length);
+    header->value = workload_copy(allocator, value, value_length);
+    header->name_length = name_length;
+    header->value_length = value_length;
+    return header;
+}
+
+void http_free_headers(WorkloadAllocator &allocator, HttpHeader *header) {
+    while (header != nullptr) {
+        HttpHeader *next = header->next;
+        allocator.free(header->value, header->value_length + 1);
+        allocator.free(header->name, header->name_length + 1);
+        allocator.free(header, sizeof(HttpHeader));
+        header = next;
+    }
+}
+
+// Unit: one request. Parse a request with 6-21 headers (copying everything
+// out of the receive buffer), build a response with a 256 B-16 KiB body and
+// a few headers, "send" it, free it all.
+size_t workload_http(WorkloadAllocator &allocator, size_t units, uint64_t &checksum) {
+    uint64_t rng = 0xb5ad4eceda1ce2a9ull;
+    char buffer[4096];
+    size_t done = 0;
+    for (; done < units; done++) {
+        uint64_t r = workload_random(rng);
+        size_t length = snprintf(buffer, sizeof(buffer), "GET /api/items/%u?page=%u HTTP/1.1\r\nHost: example.com\r\n",
+            (uint32_t)(r % 100000), (uint32_t)(r >> 20) % 50);
+        size_t num_headers = 5 + (r >> 32) % 16;
+        for (size_t i = 0; i < num_headers; i++) {
+            length += snprintf(buffer + length, sizeof(buffer) - length, "X-Header-%zu: %.*s\r\n",
+                i, (int)(4 + (r >> i) % 40), "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJ");
+        }
+        length += snprintf(buffer + length, sizeof(buffer) - length, "\r\n");
+
+        // Parse
+        HttpRequest *request = (HttpRequest*)allocator.alloc(sizeof(HttpRequest));
+        HttpResponse *response = (HttpResponse*)allocator.alloc(sizeof(HttpResponse));
+        bool complete = request != nullptr && response != nullptr;
+        if (complete) {
+            const char *at = buffer;
+            const char *space = std::strchr(at, ' ');
+            request->method_length = space - at;
+            request->method = workload_copy(allocator, at, request->method_length);
+            at = space + 1;
+            space = std::strchr(at, ' ');
+            request->path_length = space - at;
+            request->path = workload_copy(allocator, at, request->path_length);
+            at = std::strstr(space, "\r\n") + 2;
+            while (complete && at[0] != '\r') {
+                const char *colon = std::strchr(at, ':');
+                const char *end = std::strstr(colon, "\r\n");
+                complete = http_add_header(allocator, &request->headers, at, colon - at, colon + 2, end - colon - 2) != nullptr;
+                at = end + 2;
+            }
+        }
+
+        // Handle
+        if (complete) {
+            response->status = 200;
+            response->body_size = (size_t)256 << (r >> 48) % 7;
+            response->body = (unsigned char*)allocator.alloc(response->body_size, 16);
+            char content_length[24];
+            int content_length_size = snprintf(content_length, sizeof(content_length), "%zu", response->body_size);
+            complete = response->body != nullptr
+                && http_add_header(allocator, &response->headers, "Content-Type", 12, "application/json", 16) != nullptr
+                && http_add_header(allocator, &response->headers, "Content-Length", 14, content_length, content_length_size) != nullptr
+                && http_add_header(allocator, &response->headers, "Cache-Control", 13, "no-store", 8) != nullptr;
+        }
+        if (complete) {
+            for (size_t i = 0; i < response->body_size; i += request->path_length) {
+                size_t chunk = response->body_size - i < request->path_length ? response->body_size - i : request->path_length;
+                std::memcpy(response->body + i, request->path, chunk);
+            }
+            uint64_t sum = response->status + response->body[response->body_size - 1];
+            for (HttpHeader *header = request->headers; header != nullptr; header = header->next) {
+                sum += header->value_length + header->value[0];
+            }
+            checksum = checksum * 31 + sum;
+        }
+
+        // Done with it
+        if (response != nullptr) {
+            http_free_headers(allocator, response->headers);
+            allocator.free(response->body, response->body_size);
+            allocator.free(response, sizeof(HttpResponse));
+        }
+        if (request != nullptr) {
+            http_free_headers(allocator, request->headers);
+            allocator.free(request->path, request->path_length + 1);
+            allocator.free(request->method, request->method_length + 1);
+            allocator.free(request, sizeof(HttpRequest));
+        }
+        allocator.reset();
+        if (!complete) break;
+    }
+    return done;
+}
+
+//----------------------------- Runner -----------------------------//
+
+typedef size_t (*WorkloadFn)(WorkloadAllocator &allocator, size_t units, uint64_t &checksum);
+
+struct Workload {
+    const char *name;
+    const char *unit;
+    size_t units;
+    WorkloadFn run;
+};
+
+enum WorkloadAllocatorKind {
+    WORKLOAD_MALLOC,
+    WORKLOAD_ARENA,
+    WORKLOAD_STACK,
+    WORKLOAD_POOL,
+    WORKLOAD_COMPOSED,
+    WORKLOAD_NUM_ALLOCATORS,
+};
+
+const char *workload_allocator_names[WORKLOAD_NUM_ALLOCATORS] = { "malloc", "arena", "stack", "pool", "composed" };
+
+// Whatever the allocator under test needs, set up fresh for every run.
+struct WorkloadSetup {
+    WorkloadAllocator allocator;
+    Arena arena;
+    Stack stack;
+    WorkloadPools pools;
+    unsigned char *memory;
+    size_t memory_size;
+    unsigned char *pool_memory;
+    size_t pool_memory_size;
+};
+
+// The size-class pools get `class_size` bytes each. Pools push every chunk on
+// their free list when they're built, so they're reset straight after and
+// their memory handed back to the OS: RSS only grows with what's used.
+bool workload_setup(WorkloadSetup &setup, WorkloadAllocatorKind kind, size_t arena_size, size_t class_size) {
+    setup = {};
+    switch (kind) {
+        case WORKLOAD_MALLOC:
+            setup.allocator = { nullptr, workload_malloc_alloc, workload_malloc_free, workload_nop_reset };
+            return true;
+        case WORKLOAD_ARENA:
+        case WORKLOAD_STACK:
+        case WORKLOAD_COMPOSED:
+            setup.memory_size = arena_size;
+            setup.memory = (unsigned char*)bench_backing_alloc(arena_size);
+            if (setup.memory == nullptr) return false;
+            break;
+        default:
+            break;
+    }
+
+    if (kind == WORKLOAD_ARENA) {
+        setup.arena = Arena(setup.memory, arena_size);
+        setup.allocator = { &setup.arena, workload_arena_alloc, workload_arena_free, workload_arena_reset };
+        return true;
+    }
+    if (kind == WORKLOAD_STACK) {
+        setup.stack = { .m_memory = setup.memory, .m_capacity = arena_size };
+        setup.allocator = { &setup.stack, workload_stack_alloc, workload_stack_free, workload_stack_reset };
+        return true;
+    }
+
+    setup.pool_memory_size = WORKLOAD_NUM_CLASSES * class_size;
+    setup.pool_memory = (unsigned char*)bench_backing_alloc(setup.pool_memory_size);
+    setup.pools.classes = (Pool*)std::malloc(WORKLOAD_NUM_CLASSES * sizeof(Pool));
+    if (setup.pool_memory == nullptr || setup.pools.classes == nullptr) return false;
+    for (size_t i = 0; i < WORKLOAD_NUM_CLASSES; i++) {
+        bool pool_is_valid;
+        new (&setup.pools.classes[i]) Pool(pool_is_valid, setup.pool_memory + i * class_size, class_size, (size_t)16 << i, 16);
+        if (!pool_is_valid) return false;
+        setup.pools.classes[i].reset();
+    }
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t release_start = forward_align((uintptr_t)setup.pool_memory, page_size);
+    uintptr_t release_end = ((uintptr_t)setup.pool_memory + setup.pool_memory_size) & ~(uintptr_t)(page_size - 1);
+    if (release_end > release_start) madvise((void*)release_start, release_end - release_start, MADV_DONTNEED);
+
+    if (kind == WORKLOAD_COMPOSED) {
+        setup.arena = Arena(setup.memory, arena_size);
+        setup.pools.overflow = &setup.arena;
+    }
+    setup.allocator = { &setup.pools, workload_pools_alloc, workload_pools_free, workload_pools_reset };
+    return true;
+}
+
+void workload_teardown(WorkloadSetup &setup) {
+    if (setup.memory != nullptr) bench_backing_free(setup.memory, setup.memory_size);
+    if (setup.pool_memory != nullptr) bench_backing_free(setup.pool_memory, setup.pool_memory_size);
+    std::free(setup.pools.classes);
+}
+
+// Lets bench_peak_rss_bytes() measure from here on. False if the kernel won't
+// let us, then peaks are for the whole process so far.
+bool bench_reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool reset = write(fd, "5", 1) == 1;
+    close(fd);
+    return reset;
+}
+
+size_t bench_peak_rss_bytes() {
+    char status[4096];
+    if (!read_small_file("/proc/self/status", status, sizeof(status))) return 0;
+    const char *peak = std::strstr(status, "VmHWM:");
+    if (peak == nullptr) return 0;
+    return (size_t)strtoull(peak + 6, nullptr, 10) * 1024;
+}
+
+void bench_workloads() {
+    size_t scale = bench_env_size("WORKLOAD_SCALE", 1);
+    const char *only = getenv("WORKLOAD");
+    size_t arena_size = bench_env_size("WORKLOAD_ARENA_SIZE", (size_t)1 << 30);
+    size_t class_size = bench_env_size("WORKLOAD_CLASS_SIZE", (size_t)32 << 20);
+    const Workload workloads[] = {
+        { "json dom", "docs", 100, workload_json },
+        { "ast", "trees", 1000, workload_ast },
+        { "bfs", "graphs", 100, workload_bfs },
+        { "lru", "k lookups", 500, workload_lru },
+        { "http", "requests", 100000, workload_http },
+    };
+    if (!bench_reset_peak_rss()) printf("  (can't reset peak RSS here, peaks are for the whole run so far)\n");
+
+    for (const Workload &workload : workloads) {
+        if (only != nullptr && std::strstr(workload.name, only) == nullptr) continue;
+        size_t units = workload.units * scale;
+        printf("  %s, %zu %s\n", workload.name, units, workload.unit);
+        uint64_t expected = 0;
+        for (int kind = 0; kind < WORKLOAD_NUM_ALLOCATORS; kind++) {
+            WorkloadSetup setup;
+            if (!workload_setup(setup, (WorkloadAllocatorKind)kind, arena_size, class_size)) {
+                printf("    %-9s couldn't set up\n", workload_allocator_names[kind]);
+                workload_teardown(setup);
+                continue;
+            }
+            // Give back whatever malloc kept from earlier runs so it doesn't
+            // hide this one's peak.
+            malloc_trim(0);
+            size_t rss_before = bench_rss_bytes();
+            bench_reset_peak_rss();
+
+            uint64_t checksum = 0;
+            uint64_t start = bench_now_ns();
+            size_t done = workload.run(setup.allocator, units, checksum);
+            uint64_t ns = bench_now_ns() - start;
+            size_t peak = bench_peak_rss_bytes();
+            workload_teardown(setup);
+
+            if (kind == WORKLOAD_MALLOC) expected = checksum;
+            printf("    %-9s %10.1f %s/s  peak RSS +%7.1f MiB  %10zu allocs %10zu frees",
+                workload_allocator_names[kind], done / (ns / 1e9), workload.unit,
+                (peak > rss_before ? peak - rss_before : 0) / (1024.0 * 1024.0),
+                setup.allocator.allocs, setup.allocator.frees);
+            if (done < units) printf("  out of memory after %zu", done);
+            else if (checksum != expected) printf("  checksum mismatch");
+            printf("\n");
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//============================== END BENCHMARKS ==============================//
+////////////////////////////////////////////////////////////////////////////////
+
+int run_benchmarks(const char* filter) {
+    uintptr_t fixed_base = bench_env_size("ALLOC_FIXED_BASE", 0);
+    FixedRegionProvider fixed_regions(fixed_base != 0 ? fixed_base : FIXED_REGION_DEFAULT_BASE);
+    if (fixed_base != 0) {
+        bench_fixed_regions = &fixed_regions;
+        bench_fixed_page_offset = bench_env_size("ALLOC_FIXED_PAGE_OFFSET", 0);
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        if (bench_fixed_page_offset >= page_size) {
+            printf("ALLOC_FIXED_PAGE_OFFSET must be less than the page size (%zu)\n", page_size);
+            return 1;
+        }
+        printf("backing memory at fixed addresses from %#lx, page offset %zu\n", (unsigned long)fixed_base, bench_fixed_page_offset);
+    }
+    RUN_BENCH("direct io", bench_direct_io);
+    RUN_BENCH("io buffer pool", bench_io_buffer_pool);
+    RUN_BENCH("spill arena", bench_spill_arena);
+    RUN_BENCH("intrusive containers", bench_intrusive_containers);
+    RUN_BENCH("btree", bench_btree);
+    RUN_BENCH("timer wheel", bench_timer_wheel);
+    RUN_BENCH("mpmc queue", bench_mpmc_queue);
+    RUN_BENCH("work stealing", bench_work_stealing);
+    RUN_BENCH("scavenger", bench_scavenger);
+    RUN_BENCH("stats segment", bench_stats_segment);
+    RUN_BENCH("fast path", bench_fast_path);
+    RUN_BENCH("prefetch", bench_prefetch);
+    RUN_BENCH("striped pool", bench_striped_pool);
+    RUN_BENCH("pool reset", bench_pool_reset);
+    RUN_BENCH("workloads", bench_workloads);
+    return 0;
+}
+
+// `./build/main stats <file> [interval_ms]`: show a stats segment, redrawn
+// every interval (default 1000ms) until interrupted. An interval of 0 prints
+// it once.
+int run_stats_viewer(const char *path, uint32_t interval_ms) {
+    StatsSegment segment = {};
+    if (!segment.open_readonly(path)) {
+        fprintf(stderr, "%s isn't a stats segment\n", path);
+        return 1;
+    }
+    for (;;) {
+        if (interval_ms != 0) printf("\x1b[H\x1b[2J");
+        stats_print(stdout, segment);
+        fflush(stdout);
+        if (interval_ms == 0) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+    segment.close();
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::strcmp(argv[1], "bench") == 0) {
+        return run_benchmarks(argc > 2 ? argv[2] : nullptr);
+    }
+    if (argc > 2 && std::strcmp(argv[1], "stats") == 0) {
+        return run_stats_viewer(argv[2], argc > 3 ? (uint32_t)strtoul(argv[3], nullptr, 10) : 1000);
+    }
 
-int main() {
     RUN_TEST("forward align", test_forward_align);
     RUN_TEST("arena", test_arena);
     RUN_TEST("calc padding with header", test_calc_padding_with_header);
     RUN_TEST("stack", test_stack);
+    RUN_TEST("stack large align", test_stack_large_align);
     RUN_TEST("pool", test_pool);
+    RUN_TEST("tlab", test_tlab);
+    RUN_TEST("arena split", test_arena_split);
+    RUN_TEST("child arena", test_child_arena);
+    RUN_TEST("semispace", test_semispace);
+    RUN_TEST("direct io", test_direct_io);
+    RUN_TEST("io buffer pool", test_io_buffer_pool);
+    RUN_TEST("scatter gather", test_scatter_gather);
+    RUN_TEST("flat buffers", test_flat_buffers);
+    RUN_TEST("spill arena", test_spill_arena);
+    RUN_TEST("intrusive containers", test_intrusive_containers);
+    RUN_TEST("btree", test_btree);
+    RUN_TEST("timer wheel", test_timer_wheel);
+    RUN_TEST("mpmc queue", test_mpmc_queue);
+    RUN_TEST("work stealing", test_work_stealing);
+    RUN_TEST("scavenger", test_scavenger);
+    RUN_TEST("memory governor", test_memory_governor);
+    RUN_TEST("memory tags", test_memory_tags);
+    RUN_TEST("stats segment", test_stats_segment);
+    RUN_TEST("fixed regions", test_fixed_regions);
+    RUN_TEST("prefetch", test_prefetch);
+    RUN_TEST("striped pool", test_striped_pool);
+    RUN_TEST("pool reset", test_pool_reset);
     return 0;
 }